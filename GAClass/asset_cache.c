@@ -0,0 +1,250 @@
+#include "asset_cache.h"
+
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "mutex.h"
+#include "trace.h"
+
+#include "include/lz4/xxhash.h"
+
+#include <stdint.h>
+#include <string.h>
+
+enum {
+	k_asset_cache_buckets = 1024,
+};
+
+/* A cached file
+
+- found through its hash bucket, the path is compared to rule out hash collisions
+- work is the read, shared by every reference. Its buffer is owned by the cache
+- while nothing references it, it sits in the cache's loading list until the read is done and
+  then in the least recently used list, list is whichever of the two it is on
+- size is counted against the budget once the read is done, a failed read is dropped on release
+*/
+typedef struct asset_t {
+	uint64_t hash;
+	char* path;
+	fs_work_t* work;
+	int ref_count;
+	size_t size;
+	bool counted;
+	struct asset_list_t* list;
+	struct asset_t* bucket_next;
+	struct asset_t* list_prev;
+	struct asset_t* list_next;
+} asset_t;
+
+// Doubly linked list of released assets, head was added longest ago.
+typedef struct asset_list_t {
+	asset_t* head;
+	asset_t* tail;
+} asset_list_t;
+
+typedef struct asset_cache_t {
+	heap_t* heap;
+	fs_t* fs;
+	mutex_t* mutex;
+	size_t budget;
+	size_t loaded_size;
+	asset_t* buckets[k_asset_cache_buckets];
+	// released assets whose read is done, only these are evicted to fit the budget
+	asset_list_t lru;
+	// released assets whose read is still in flight, they move to lru once it is done
+	asset_list_t loading;
+	int hits;
+	int misses;
+} asset_cache_t;
+
+asset_cache_t* asset_cache_create(heap_t* heap, fs_t* fs, size_t budget) {
+	asset_cache_t* cache = heap_alloc(heap, sizeof(asset_cache_t), 8);
+	memset(cache, 0, sizeof(asset_cache_t));
+	cache->heap = heap;
+	cache->fs = fs;
+	cache->mutex = mutex_create();
+	cache->budget = budget;
+	return cache;
+}
+
+static void asset_list_remove(asset_t* asset) {
+	asset_list_t* list = asset->list;
+	if (asset->list_prev) {
+		asset->list_prev->list_next = asset->list_next;
+	} else {
+		list->head = asset->list_next;
+	}
+	if (asset->list_next) {
+		asset->list_next->list_prev = asset->list_prev;
+	} else {
+		list->tail = asset->list_prev;
+	}
+	asset->list_prev = NULL;
+	asset->list_next = NULL;
+	asset->list = NULL;
+}
+
+static void asset_list_push(asset_list_t* list, asset_t* asset) {
+	asset->list_prev = list->tail;
+	asset->list_next = NULL;
+	if (list->tail) {
+		list->tail->list_next = asset;
+	} else {
+		list->head = asset;
+	}
+	list->tail = asset;
+	asset->list = list;
+}
+
+// Count a finished read against the budget, called with the mutex held.
+static void asset_count(asset_cache_t* cache, asset_t* asset) {
+	if (!asset->counted && fs_work_is_done(asset->work)) {
+		asset->size = fs_work_get_result(asset->work) == 0 ? fs_work_get_size(asset->work) : 0;
+		asset->counted = true;
+		cache->loaded_size += asset->size;
+	}
+}
+
+// Remove a released asset and free its data, called with the mutex held.
+static void asset_evict(asset_cache_t* cache, asset_t* asset) {
+	asset_t** link = &cache->buckets[asset->hash % k_asset_cache_buckets];
+	while (*link != asset) {
+		link = &(*link)->bucket_next;
+	}
+	*link = asset->bucket_next;
+	if (asset->list) {
+		asset_list_remove(asset);
+	}
+
+	if (asset->counted) {
+		cache->loaded_size -= asset->size;
+	}
+	// only waits when the cache is destroyed, trimming never picks an unfinished read
+	void* buffer = fs_work_get_result(asset->work) == 0 ? fs_work_get_buffer(asset->work) : NULL;
+	if (buffer) {
+		heap_free(cache->heap, buffer);
+	}
+	fs_work_destroy(asset->work);
+	heap_free(cache->heap, asset->path);
+	heap_free(cache->heap, asset);
+}
+
+// Put a released asset on the list for the state of its read, called with the mutex held.
+// A failed read is evicted so that the next acquire tries again.
+static void asset_park(asset_cache_t* cache, asset_t* asset) {
+	asset_count(cache, asset);
+	if (!asset->counted) {
+		asset_list_push(&cache->loading, asset);
+	} else if (fs_work_get_result(asset->work) != 0) {
+		asset_evict(cache, asset);
+	} else {
+		asset_list_push(&cache->lru, asset);
+	}
+}
+
+// Count released assets whose read finished, then evict released assets until the loaded size
+// fits the budget, called with the mutex held.
+static void asset_trim(asset_cache_t* cache) {
+	asset_t* asset = cache->loading.head;
+	while (asset) {
+		asset_t* next = asset->list_next;
+		if (fs_work_is_done(asset->work)) {
+			asset_list_remove(asset);
+			asset_park(cache, asset);
+		}
+		asset = next;
+	}
+
+	while (cache->loaded_size > cache->budget && cache->lru.head) {
+		TRACE_ZONE_BEGIN("asset_evict");
+		asset_evict(cache, cache->lru.head);
+		TRACE_ZONE_END();
+	}
+}
+
+void asset_cache_destroy(asset_cache_t* cache) {
+	for (int i = 0; i < k_asset_cache_buckets; ++i) {
+		while (cache->buckets[i]) {
+			asset_t* asset = cache->buckets[i];
+			if (asset->ref_count > 0) {
+				debug_print_line(k_print_warning, "Asset %s is still referenced when its cache is destroyed.\n", asset->path);
+				asset->ref_count = 0;
+			}
+			asset_evict(cache, asset);
+		}
+	}
+	mutex_destroy(cache->mutex);
+	heap_free(cache->heap, cache);
+}
+
+asset_t* asset_cache_acquire(asset_cache_t* cache, const char* path) {
+	size_t path_length = strlen(path);
+	uint64_t hash = XXH64(path, path_length, 0);
+
+	mutex_lock(cache->mutex);
+	asset_t* asset = cache->buckets[hash % k_asset_cache_buckets];
+	while (asset && (asset->hash != hash || strcmp(asset->path, path) != 0)) {
+		asset = asset->bucket_next;
+	}
+
+	if (asset) {
+		if (asset->ref_count++ == 0) {
+			asset_list_remove(asset);
+		}
+		++cache->hits;
+		mutex_unlock(cache->mutex);
+		return asset;
+	}
+
+	asset = heap_alloc(cache->heap, sizeof(asset_t), 8);
+	memset(asset, 0, sizeof(asset_t));
+	asset->hash = hash;
+	asset->path = heap_alloc(cache->heap, path_length + 1, 8);
+	memcpy(asset->path, path, path_length + 1);
+	asset->ref_count = 1;
+	// queued with the mutex held so that requests for the same path find it loading
+	asset->work = fs_read(cache->fs, path, cache->heap, false, false);
+	asset->bucket_next = cache->buckets[hash % k_asset_cache_buckets];
+	cache->buckets[hash % k_asset_cache_buckets] = asset;
+	++cache->misses;
+	mutex_unlock(cache->mutex);
+	return asset;
+}
+
+void asset_cache_release(asset_cache_t* cache, asset_t* asset) {
+	if (asset == NULL) {
+		return;
+	}
+	mutex_lock(cache->mutex);
+	if (--asset->ref_count == 0) {
+		asset_park(cache, asset);
+		asset_trim(cache);
+	}
+	mutex_unlock(cache->mutex);
+}
+
+bool asset_is_ready(asset_t* asset) {
+	return fs_work_is_done(asset->work);
+}
+
+const void* asset_get_data(asset_cache_t* cache, asset_t* asset) {
+	fs_work_wait(asset->work);
+	if (!asset->counted) {
+		mutex_lock(cache->mutex);
+		asset_count(cache, asset);
+		asset_trim(cache);
+		mutex_unlock(cache->mutex);
+	}
+	return fs_work_get_result(asset->work) == 0 ? fs_work_get_buffer(asset->work) : NULL;
+}
+
+size_t asset_get_size(asset_cache_t* cache, asset_t* asset) {
+	return asset_get_data(cache, asset) ? fs_work_get_size(asset->work) : 0;
+}
+
+void asset_cache_get_stats(asset_cache_t* cache, int* hits, int* misses) {
+	mutex_lock(cache->mutex);
+	*hits = cache->hits;
+	*misses = cache->misses;
+	mutex_unlock(cache->mutex);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Cache of whole files read through the file system.
+// Assets are found by a hash of their path. Requests for a file that is already loading share
+// the one read, and every request holds a reference until it is released. Released assets stay
+// loaded until the cache is over its memory budget, then the least recently used go first.
+
+typedef struct asset_cache_t asset_cache_t;
+
+typedef struct asset_t asset_t;
+
+typedef struct fs_t fs_t;
+
+typedef struct heap_t heap_t;
+
+// Create an asset cache reading through fs.
+// Asset data is allocated from heap. Budget is the bytes of released assets to keep loaded.
+asset_cache_t* asset_cache_create(heap_t* heap, fs_t* fs, size_t budget);
+
+// Destroy an asset cache and free every asset in it.
+// Every acquired asset must have been released.
+void asset_cache_destroy(asset_cache_t* cache);
+
+// Get a reference to the asset at path, queuing a read if it is not loaded or loading.
+// Does not wait for the read. Release the reference with asset_cache_release.
+asset_t* asset_cache_acquire(asset_cache_t* cache, const char* path);
+
+// Release a reference from asset_cache_acquire.
+// The asset's data must not be used afterwards.
+void asset_cache_release(asset_cache_t* cache, asset_t* asset);
+
+// If true, the asset has finished loading.
+bool asset_is_ready(asset_t* asset);
+
+// Get an asset's data, waiting for it to load. NULL if the read failed.
+// The data is shared and must not be written to or freed.
+const void* asset_get_data(asset_cache_t* cache, asset_t* asset);
+
+// Get an asset's size, waiting for it to load.
+size_t asset_get_size(asset_cache_t* cache, asset_t* asset);
+
+// Number of acquires that found the asset loaded or loading, and that had to read it.
+void asset_cache_get_stats(asset_cache_t* cache, int* hits, int* misses);
@@ -26,4 +26,19 @@ int atomic_load(int* address)
 void atomic_store(int* address, int value)
 {
 	*(volatile int*)address = value;
+}
+
+int atomic_exchange(int* address, int value)
+{
+	return InterlockedExchange(address, value);
+}
+
+void atomic_wait(int* address, int value)
+{
+	WaitOnAddress(address, &value, sizeof(int), INFINITE);
+}
+
+void atomic_wake_all(int* address)
+{
+	WakeByAddressAll(address);
 }
\ No newline at end of file
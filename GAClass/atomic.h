@@ -30,4 +30,17 @@ int atomic_load(int* address);
 // Paired with an atomic_load, can guarantee ordering and visibility.
 void atomic_store(int* address, int value);
 
+// Swap a number atomically.
+// Returns the old value of the number.
+// Performs the following operation atomically:
+//   int old_value = *address; *address = value; return old_value;
+int atomic_exchange(int* address, int value);
+
+// Block while the number at address is value, without polling or a kernel object.
+// May return before the number changes, so callers load it again.
+void atomic_wait(int* address, int value);
+
+// Wake every thread blocked in atomic_wait on address.
+void atomic_wake_all(int* address);
+
 //#endif
\ No newline at end of file
@@ -1,10 +1,38 @@
 #include "debug.h"
 
+#include <stdbool.h>
+
 static uint32_t s_mask = 0xffffffff;
+static void (*s_exception_callback)(void* user) = NULL;
+static void* s_exception_user = NULL;
+
+// Hardware faults, first chance C++ exceptions (0xE06D7363) and OutputDebugString
+// also come through the vectored handler and are usually handled, so they are not crashes.
+static bool debug_is_fault(DWORD code)
+{
+	switch (code)
+	{
+	case EXCEPTION_ACCESS_VIOLATION:
+	case EXCEPTION_ARRAY_BOUNDS_EXCEEDED:
+	case EXCEPTION_DATATYPE_MISALIGNMENT:
+	case EXCEPTION_FLT_DIVIDE_BY_ZERO:
+	case EXCEPTION_ILLEGAL_INSTRUCTION:
+	case EXCEPTION_IN_PAGE_ERROR:
+	case EXCEPTION_INT_DIVIDE_BY_ZERO:
+	case EXCEPTION_PRIV_INSTRUCTION:
+	case EXCEPTION_STACK_OVERFLOW:
+		return true;
+	}
+	return false;
+}
 
 static LONG debug_exception_handler(LPEXCEPTION_POINTERS ExceptionInfo)
 {
 	debug_print_line(k_print_error, "Caught an exception!\n");
+	if (s_exception_callback && debug_is_fault(ExceptionInfo->ExceptionRecord->ExceptionCode))
+	{
+		s_exception_callback(s_exception_user);
+	}
 	HANDLE file = CreateFile(L"ga2022-crash.dmp", GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (file != INVALID_HANDLE_VALUE)
 	{
@@ -32,6 +60,11 @@ void debug_install_exception_handler() {
 	AddVectoredExceptionHandler(TRUE, debug_exception_handler);
 }
 
+void debug_set_exception_callback(void (*callback)(void* user), void* user) {
+	s_exception_user = user;
+	s_exception_callback = callback;
+}
+
 void debug_set_print_mask(uint32_t mask) {
 	s_mask = mask;
 }
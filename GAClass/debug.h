@@ -24,6 +24,11 @@ static LONG debug_exception_handler(LPEXCEPTION_POINTERS POINTER);
 // When unhandled exceptions are caught, will log an error and capture a memory dump.
 void debug_install_exception_handler();
 
+// Set a function to be called when the exception handler catches an error.
+// Used to flush diagnostics, such as a trace flight recorder, before the dump is written.
+// Pass NULL to remove it.
+void debug_set_exception_callback(void (*callback)(void* user), void* user);
+
 // Set mask of which types of prints will actually fire.
 // See the debug_print().
 void debug_set_print_mask(uint32_t mask);
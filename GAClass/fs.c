@@ -1,117 +1,908 @@
 #include "fs.h"
 
-#include "event.h"
+#include "atomic.h"
 #include "heap.h"
+#include "mutex.h"
 #include "queue.h"
+#include "semaphore.h"
 #include "thread.h"
+#include "timer.h"
+#include "trace.h"
 #include "debug.h"
 
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
-#include "include/lz4/lz4.h"
+#include <stdlib.h>
+#define LZ4F_STATIC_LINKING_ONLY
+#include "include/lz4/lz4frame.h"
+#include "include/lz4/xxhash.h"
 
 #include <string.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+enum {
+	// reads at least this big count against max_large_reads
+	k_fs_large_read_size = 1024 * 1024,
+	// compressed files are split into blocks of this much raw data
+	k_fs_block_size = 256 * 1024,
+	k_fs_block_magic = 0x4b4c4246, // "FBLK"
+	// compressed reads are staged this many bytes of whole frames at a time
+	k_fs_stream_chunk_size = 1024 * 1024,
+	// largest single overlapped read or write, bigger requests continue where they stopped
+	k_fs_io_max_size = 64 * 1024 * 1024,
+	// completion port keys
+	k_fs_io_key_submit = 1,
+	k_fs_io_key_file = 2,
+	k_fs_io_key_quit = 3,
+	// first skippable frame magic of the LZ4 frame format, decoders step over these frames
+	k_fs_skippable_frame_magic = 0x184d2a50,
+	k_fs_pack_magic = 0x4b434150, // "PACK"
+	k_fs_pack_version = 3,
+	// pack entries start on sector and page boundaries
+	k_fs_pack_alignment = 4096,
+	k_fs_max_mounts = 8,
+	// LZ4 only looks back this far, longer dictionaries keep their last 64 KB
+	k_fs_max_dictionary_size = 64 * 1024,
+	// extensions told apart in the pack report, the rest are counted together
+	k_fs_pack_max_classes = 32,
+	// direct reads need sector aligned offsets, sizes and buffers, this covers 512 byte and 4 KB sectors
+	k_fs_direct_alignment = 4096,
+	// bytes a direct read moves at a time, each staging buffer also has room for the
+	// read to be widened to sector boundaries at both ends
+	k_fs_direct_chunk_size = k_fs_stream_chunk_size,
+	k_fs_direct_buffer_size = k_fs_direct_chunk_size + 2 * k_fs_direct_alignment,
+	// interned paths are found by hash in this many buckets
+	k_fs_path_buckets = 1024,
+	// how often the write-behind thread looks for pending writes that are due
+	k_fs_write_behind_poll_ms = 16,
+	k_fs_write_behind_default_delay_ms = 1000,
+};
+
+/* A compressed file, a valid stream of LZ4 frames
+
+- a skippable frame holding a header giving the raw size and the block size
+  and block_count + 1 offsets from the start of the file, block i is the bytes from offsets[i]
+  up to offsets[i + 1] and decodes to block_size bytes, or less for the last block.
+  dictionary_id is the id of the dictionary the blocks were compressed against, 0 for none
+- the blocks, each one LZ4 frame compressed alone so any one of them can be decoded without
+  the others. Frames carry their content size, a checksum per LZ4 block and an xxhash
+  checksum of their decompressed content
+*/
+typedef struct fs_block_header_t {
+	uint32_t frame_magic;
+	uint32_t frame_size; // bytes of the skippable frame after frame_magic and frame_size
+	uint32_t magic;
+	uint32_t block_size;
+	uint64_t raw_size;
+	uint32_t block_count;
+	uint32_t dictionary_id;
+} fs_block_header_t;
+
+// A shared dictionary that compressed blocks can be built against.
+// The compression side digests it into cdict once and shares it between the block threads.
+typedef struct fs_dictionary_t {
+	char* data;
+	int size;
+	uint32_t id;
+	LZ4F_CDict* cdict;
+} fs_dictionary_t;
+
+// Blocks of one file, the last block thread to finish wakes the thread waiting on remaining.
+typedef struct fs_block_batch_t {
+	int remaining;
+} fs_block_batch_t;
+
+typedef enum fs_block_op_t {
+	k_fs_block_compress,
+	k_fs_block_decompress,
+	// digest src, see fs_digest_jobs
+	k_fs_block_digest,
+} fs_block_op_t;
+
+// Compress or decompress one block from src into dst, or digest src.
+// Compression is at level, both directions use dictionary unless it is NULL.
+// result is the number of bytes written to dst, 0 or less on failure, or src_size for a digest.
+// With verify a decompressed block is digested too, digest is the xxhash64 of the raw block.
+typedef struct fs_block_job_t {
+	fs_block_op_t op;
+	bool verify;
+	uint64_t digest;
+	int level;
+	const fs_dictionary_t* dictionary;
+	const char* src;
+	int src_size;
+	char* dst;
+	int dst_capacity;
+	int result;
+	fs_block_batch_t* batch;
+} fs_block_job_t;
+
+/* A pack file
+
+- a header giving the number of entries and where the table of contents is, and where the
+  pack's dictionary is if its entries were compressed against one
+- the dictionary, at the first aligned offset
+- the entries, each at a multiple of the header's alignment
+- the table of contents, one fs_pack_entry_t per file sorted by the xxhash64 of its path
+  relative to the packed directory, with '/' separators. Each entry has a digest of its
+  raw content, see fs_digest_jobs, checked on load with fs_set_verify
+*/
+typedef struct fs_pack_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_count;
+	uint32_t alignment;
+	uint64_t toc_offset;
+	uint64_t dictionary_offset;
+	uint32_t dictionary_size;
+	uint32_t dictionary_id;
+} fs_pack_header_t;
+
+typedef enum fs_pack_entry_flags_t {
+	// the entry is a block file as written by a compressed fs_write
+	k_fs_pack_entry_compressed = 1 << 0,
+} fs_pack_entry_flags_t;
+
+typedef struct fs_pack_entry_t {
+	uint64_t hash;
+	uint64_t offset;
+	uint64_t size; // bytes stored in the pack
+	uint64_t raw_size; // bytes read back
+	uint32_t flags;
+	uint32_t reserved;
+	uint64_t digest;
+} fs_pack_entry_t;
+
+// A mounted pack, its file stays open and its table of contents and dictionary in memory.
+// direct_handle is the pack opened for direct reads, INVALID_HANDLE_VALUE if the volume
+// doesn't allow them. With direct, entries of 1 MB and up are read through it.
+typedef struct fs_mount_t {
+	HANDLE handle;
+	HANDLE direct_handle;
+	bool direct;
+	fs_pack_entry_t* entries;
+	uint32_t entry_count;
+	fs_dictionary_t dictionary;
+} fs_mount_t;
+
+// Works waiting at each priority. Each list is ordered by deadline, works without one
+// go last, in the order they were queued.
+typedef struct fs_work_queue_t {
+	fs_work_t* heads[k_fs_priority_count];
+	fs_work_t* tails[k_fs_priority_count];
+	int count;
+} fs_work_queue_t;
+
+typedef enum fs_manifest_kind_t {
+	k_fs_manifest_read,
+	k_fs_manifest_range,
+	k_fs_manifest_map,
+} fs_manifest_kind_t;
+
+/* A request in a startup manifest
+
+- read is a whole file read and flag is its use_compression
+- range is size bytes at offset of a file
+- map is an fs_map and flag is its prefetch
+- when the manifest is replayed, work is the prefetch queued for the request until a
+  matching request claims it. A range reads into buffer, which the fs owns until then
+*/
+typedef struct fs_manifest_entry_t {
+	fs_manifest_kind_t kind;
+	bool flag;
+	uint64_t offset;
+	uint64_t size;
+	char* path;
+	fs_work_t* work;
+	void* buffer;
+} fs_manifest_entry_t;
+
+typedef struct fs_manifest_t {
+	fs_manifest_entry_t* entries;
+	int count;
+	int capacity;
+} fs_manifest_t;
+
+// Staging for one direct read, two sector aligned buffers so that one is read into while
+// the other is consumed, each with the event its overlapped read signals.
+typedef struct fs_direct_pair_t {
+	char* buffers[2];
+	OVERLAPPED overlapped[2];
+	HANDLE events[2];
+	struct fs_direct_pair_t* next;
+} fs_direct_pair_t;
+
+// A path interned by fs_work_create, kept until the fs is destroyed.
+typedef struct fs_path_t {
+	uint64_t hash;
+	struct fs_path_t* next;
+	char path[];
+} fs_path_t;
+
+/* A write held back by fs_write_behind
+
+- buffer is the fs's copy of the latest data for path, a later write to the same path
+  replaces it and keeps due, so a path written every frame is still written every delay
+- due is the timer_get_ticks() value after which the write-behind thread writes it
+*/
+typedef struct fs_write_behind_t {
+	char* path;
+	char* buffer;
+	size_t size;
+	int compression_level;
+	uint64_t due;
+	struct fs_write_behind_t* next;
+} fs_write_behind_t;
+
+/* A file system
+
+- file_threads share file_works, so a slow read only holds up one of them. They take the
+  most urgent work first, file_works_ready counts wakeups and not works as a cancelled
+  work leaves its wakeup behind
+- queue_mutex guards both work queues, the queue stats and quit, the manifests and
+  the pending write-behinds
+- prefetches are the requests of a replayed manifest, records are the requests made until
+  record_end, written to record_path when the fs is destroyed
+- at most max_large_reads workers read large files at once, the rest are kept for small
+  files. Large reads over the limit wait in large_works, in priority order, and are taken
+  before file_works once a slot frees up. large_reads is guarded by queue_mutex so that a
+  read is never parked just after the last slot holder looked for parked reads
+- the compression thread splits each compressed write into block jobs, block_threads
+  compress the blocks in parallel
+- compressed reads stream whole frames from a file thread to the block threads,
+  which decode one chunk while the next is read
+- reads of paths in a mounted pack are offset reads of the pack's open handle
+  on the file threads
+- with verify, reads of pack entries are digested by the block threads as they arrive
+- with a completion port, plain reads and writes skip the file threads. io_thread
+  keeps up to max_in_flight of them in flight as overlapped I/O and completes each
+  work when the port reports it done. They wait in io_works, in priority order
+- direct reads stage through direct_pool, allocated on first use with a pair of buffers
+  per file thread so a thread never waits for one. Free pairs are in direct_free, guarded
+  by queue_mutex
+- destroyed works go to free_works and are reused by fs_work_create, and their paths are
+  interned in paths so a repeat read of a path allocates nothing. Both are guarded by
+  work_lock, a slim lock that does not enter the kernel unless it is contended
+- write_behinds are the writes held back by fs_write_behind, oldest first. The
+  write-behind thread is started by the first of them. A batch of due writes is taken
+  and written under write_behind_mutex, so fs_flush also waits for a batch in progress
+*/
 typedef struct fs_t {
 	heap_t* heap;
-	queue_t* file_queue;
-	thread_t* file_thread;
+	mutex_t* queue_mutex;
+	fs_work_queue_t file_works;
+	semaphore_t* file_works_ready;
+	bool quit;
+	fs_queue_stats_t queue_stats[k_fs_priority_count];
+	thread_t** file_threads;
+	int file_thread_count;
+	fs_work_queue_t large_works;
+	int large_reads;
+	int max_large_reads;
 	queue_t* compression_file_queue;
 	thread_t* compression_file_thread;
+	queue_t* block_queue;
+	thread_t** block_threads;
+	int block_thread_count;
+	bool verify;
+	HANDLE completion_port;
+	thread_t* io_thread;
+	int max_in_flight;
+	fs_work_queue_t io_works;
+	fs_mount_t mounts[k_fs_max_mounts];
+	int mount_count;
+	fs_manifest_t prefetches;
+	fs_manifest_t records;
+	uint64_t record_end;
+	char* record_path;
+	char* direct_pool;
+	fs_direct_pair_t* direct_pairs;
+	fs_direct_pair_t* direct_free;
+	SRWLOCK work_lock;
+	fs_work_t* free_works;
+	fs_path_t* paths[k_fs_path_buckets];
+	fs_write_behind_t* write_behinds;
+	mutex_t* write_behind_mutex;
+	thread_t* write_behind_thread;
+	bool write_behind_quit;
+	uint32_t write_behind_delay_ms;
+	bool write_behind_durable;
 } fs_t;
 
 typedef enum fs_work_op_t {
 	k_fs_work_op_read,
 	k_fs_work_op_write,
+	k_fs_work_op_map,
+	k_fs_work_op_read_ranges,
 } fs_work_op_t;
 
+// Completion states of a work. Completing a work only wakes threads once one of them
+// has moved it to waiting.
+typedef enum fs_work_state_t {
+	k_fs_work_pending,
+	k_fs_work_waiting,
+	k_fs_work_done,
+} fs_work_state_t;
+
 typedef struct fs_work_t {
+	fs_t* fs;
 	heap_t* heap;
 	fs_work_op_t op;
-	char path[1024];
+	// interned, valid until the fs is destroyed
+	const char* path;
 	bool null_terminate;
 	bool use_compression;
+	// read with direct I/O, see fs_read_direct
+	bool direct;
+	int compression_level;
+	// a write flushed to the drive before it replaces its file
+	bool flush;
+	bool prefetch;
 	char* buffer;
 	size_t size;
 	size_t compressed_size;
-	event_t* done;
+	bool large_read;
+	// an fs_work_state_t, changed atomically
+	int state;
 	int result;
+	uint32_t trace_id;
+	// overlapped I/O state, only used with a completion port
+	OVERLAPPED overlapped;
+	HANDLE handle;
+	size_t io_offset;
+	// scheduling, queue and its links are guarded by the fs queue_mutex
+	fs_priority_t priority;
+	uint64_t deadline;
+	uint64_t queued_ticks;
+	// phase timing, see fs_work_get_timing
+	uint64_t created_ticks;
+	uint64_t started_ticks;
+	uint64_t codec_ticks;
+	uint64_t completed_ticks;
+	fs_work_queue_t* queue;
+	struct fs_work_t* queue_prev;
+	// also links the fs's free_works
+	struct fs_work_t* queue_next;
+	// the pack entry a read comes from, NULL for reads from the path
+	const fs_pack_entry_t* pack_entry;
+	const fs_mount_t* pack_mount;
+	// caller memory to read into, for k_fs_work_op_read_ranges
+	fs_range_t* ranges;
+	int range_count;
 } fs_work_t;
 
 static int file_thread_func(void* user);
 static int compress_thread_func(void* user);
+static int block_thread_func(void* user);
+static int io_thread_func(void* user);
+static int write_behind_thread_func(void* user);
+static void fs_write_behind_run(fs_t* fs, bool all);
+static void fs_work_complete(fs_work_t* work);
+static void file_read_streamed(fs_t* fs, fs_work_t* work, HANDLE handle, HANDLE direct_handle, uint64_t base, uint64_t file_size);
+static void file_read_packed(fs_t* fs, fs_work_t* work);
+static void file_read_ranges(fs_t* fs, fs_work_t* work);
+static int fs_read_at(HANDLE handle, uint64_t offset, void* buffer, size_t size);
+static const fs_pack_entry_t* fs_pack_find(fs_t* fs, const char* path, const fs_mount_t** mount);
+static void fs_record_request(fs_t* fs, fs_manifest_kind_t kind, bool flag, uint64_t offset, uint64_t size, const char* path);
+static fs_work_t* fs_prefetch_claim(fs_t* fs, fs_manifest_kind_t kind, bool flag, uint64_t offset, uint64_t size,
+	const char* path, heap_t* heap, void* buffer, fs_priority_t priority, uint64_t deadline);
+static void fs_manifest_write(fs_t* fs);
+static void fs_manifest_free(fs_t* fs, fs_manifest_t* manifest);
 
-fs_t* fs_create(heap_t* heap, int queue_capacity) {
+fs_t* fs_create(heap_t* heap, int queue_capacity, int worker_count) {
 	fs_t* fs = heap_alloc(heap, sizeof(fs_t), 8);
+	memset(fs, 0, sizeof(fs_t));
 	fs->heap = heap;
-	fs->file_queue = queue_create(heap, queue_capacity);
-	fs->file_thread = thread_create(file_thread_func, fs);
+	fs->queue_mutex = mutex_create();
+	fs->file_works_ready = semaphore_create(0, INT_MAX);
+	fs->large_reads = 0;
+	fs->file_thread_count = __max(worker_count, 1);
+	fs->max_large_reads = __max(fs->file_thread_count - 1, 1);
+	fs->file_threads = heap_alloc(heap, sizeof(thread_t*) * fs->file_thread_count, 8);
+	fs->mount_count = 0;
+	for (int i = 0; i < fs->file_thread_count; ++i) {
+		fs->file_threads[i] = thread_create(file_thread_func, fs);
+	}
 	// Create the compressor thread and queue for file compression/decompression
 	fs->compression_file_queue = queue_create(heap, queue_capacity);
 	fs->compression_file_thread = thread_create(compress_thread_func, fs);
+	// one block thread per core, the compression thread mostly waits on them
+	SYSTEM_INFO system_info;
+	GetSystemInfo(&system_info);
+	fs->block_thread_count = __max((int)system_info.dwNumberOfProcessors - 1, 1);
+	fs->block_queue = queue_create(heap, 256);
+	fs->block_threads = heap_alloc(heap, sizeof(thread_t*) * fs->block_thread_count, 8);
+	for (int i = 0; i < fs->block_thread_count; ++i) {
+		fs->block_threads[i] = thread_create(block_thread_func, fs);
+	}
+	fs->completion_port = NULL;
+	fs->io_thread = NULL;
+	fs->max_in_flight = 0;
+	fs->write_behind_mutex = mutex_create();
+	fs->write_behind_delay_ms = k_fs_write_behind_default_delay_ms;
+	InitializeSRWLock(&fs->work_lock);
+	return fs;
+}
+
+fs_t* fs_create_overlapped(heap_t* heap, int queue_capacity, int worker_count, int max_in_flight) {
+	fs_t* fs = fs_create(heap, queue_capacity, worker_count);
+	fs->completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	if (fs->completion_port == NULL) {
+		debug_print_line(k_print_error, "Unable to create an I/O completion port, using the file threads.\n");
+		return fs;
+	}
+	fs->max_in_flight = __max(max_in_flight, 1);
+	fs->io_thread = thread_create(io_thread_func, fs);
 	return fs;
 }
 
 void fs_destroy(fs_t* fs) {
+	// pending write-behinds are written now, they still need the file threads
+	if (fs->write_behind_thread) {
+		mutex_lock(fs->queue_mutex);
+		fs->write_behind_quit = true;
+		mutex_unlock(fs->queue_mutex);
+		thread_destroy(fs->write_behind_thread);
+	}
+	fs_write_behind_run(fs, true);
+	mutex_destroy(fs->write_behind_mutex);
+	// prefetches and the manifest still need the file threads
+	fs_prefetch_release(fs);
+	if (fs->record_path) {
+		fs_manifest_write(fs);
+		fs_manifest_free(fs, &fs->records);
+		heap_free(fs->heap, fs->record_path);
+	}
 	// remove the compressor/decompressor
 	queue_push(fs->compression_file_queue, NULL);
 	thread_destroy(fs->compression_file_thread);
 	queue_destroy(fs->compression_file_queue);
-	// remove everything else
-	queue_push(fs->file_queue, NULL);
-	thread_destroy(fs->file_thread);
-	queue_destroy(fs->file_queue);
+	// remove the file threads, each stops at a wakeup once no work is left. They go before
+	// the block threads as a streamed read still queues blocks until it is done
+	mutex_lock(fs->queue_mutex);
+	fs->quit = true;
+	mutex_unlock(fs->queue_mutex);
+	for (int i = 0; i < fs->file_thread_count; ++i) {
+		semaphore_release(fs->file_works_ready);
+	}
+	for (int i = 0; i < fs->file_thread_count; ++i) {
+		thread_destroy(fs->file_threads[i]);
+	}
+	heap_free(fs->heap, fs->file_threads);
+	semaphore_destroy(fs->file_works_ready);
+	for (int i = 0; i < fs->block_thread_count; ++i) {
+		queue_push(fs->block_queue, NULL);
+	}
+	for (int i = 0; i < fs->block_thread_count; ++i) {
+		thread_destroy(fs->block_threads[i]);
+	}
+	heap_free(fs->heap, fs->block_threads);
+	queue_destroy(fs->block_queue);
+	// the I/O thread finishes what is in flight before it quits, nothing else queues on the port now
+	if (fs->completion_port) {
+		PostQueuedCompletionStatus(fs->completion_port, 0, k_fs_io_key_quit, NULL);
+		thread_destroy(fs->io_thread);
+		CloseHandle(fs->completion_port);
+	}
+	for (int i = 0; i < fs->mount_count; ++i) {
+		CloseHandle(fs->mounts[i].handle);
+		if (fs->mounts[i].direct_handle != INVALID_HANDLE_VALUE) {
+			CloseHandle(fs->mounts[i].direct_handle);
+		}
+		heap_free(fs->heap, fs->mounts[i].entries);
+		if (fs->mounts[i].dictionary.data) {
+			heap_free(fs->heap, fs->mounts[i].dictionary.data);
+		}
+	}
+	if (fs->direct_pool) {
+		for (int i = 0; i < fs->file_thread_count; ++i) {
+			CloseHandle(fs->direct_pairs[i].events[0]);
+			CloseHandle(fs->direct_pairs[i].events[1]);
+		}
+		heap_free(fs->heap, fs->direct_pairs);
+		VirtualFree(fs->direct_pool, 0, MEM_RELEASE);
+	}
+	while (fs->free_works) {
+		fs_work_t* work = fs->free_works;
+		fs->free_works = work->queue_next;
+		heap_free(fs->heap, work);
+	}
+	for (int i = 0; i < k_fs_path_buckets; ++i) {
+		while (fs->paths[i]) {
+			fs_path_t* path = fs->paths[i];
+			fs->paths[i] = path->next;
+			heap_free(fs->heap, path);
+		}
+	}
+	mutex_destroy(fs->queue_mutex);
 	heap_free(fs->heap, fs);
 }
 
-fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression) {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+// Works without a deadline sort after every work with one.
+static uint64_t fs_work_deadline_key(const fs_work_t* work) {
+	return work->deadline ? work->deadline : UINT64_MAX;
+}
+
+// Add a work behind the works of its priority that are due no later than it.
+// Called with the queue mutex held.
+static void fs_work_queue_insert(fs_work_queue_t* queue, fs_work_t* work) {
+	fs_work_t* prev = queue->tails[work->priority];
+	fs_work_t* next = NULL;
+	while (prev && fs_work_deadline_key(prev) > fs_work_deadline_key(work)) {
+		next = prev;
+		prev = prev->queue_prev;
+	}
+	work->queue_prev = prev;
+	work->queue_next = next;
+	if (prev) {
+		prev->queue_next = work;
+	} else {
+		queue->heads[work->priority] = work;
+	}
+	if (next) {
+		next->queue_prev = work;
+	} else {
+		queue->tails[work->priority] = work;
+	}
+	work->queue = queue;
+	++queue->count;
+}
+
+// Called with the queue mutex held.
+static void fs_work_queue_remove(fs_work_queue_t* queue, fs_work_t* work) {
+	if (work->queue_prev) {
+		work->queue_prev->queue_next = work->queue_next;
+	} else {
+		queue->heads[work->priority] = work->queue_next;
+	}
+	if (work->queue_next) {
+		work->queue_next->queue_prev = work->queue_prev;
+	} else {
+		queue->tails[work->priority] = work->queue_prev;
+	}
+	work->queue_prev = NULL;
+	work->queue_next = NULL;
+	work->queue = NULL;
+	--queue->count;
+}
+
+// Take the most urgent work and count the time it waited, NULL if the queue is empty.
+// Called with the queue mutex held.
+static fs_work_t* fs_work_queue_pop(fs_t* fs, fs_work_queue_t* queue) {
+	for (int priority = 0; priority < k_fs_priority_count; ++priority) {
+		fs_work_t* work = queue->heads[priority];
+		if (work) {
+			fs_work_queue_remove(queue, work);
+			uint64_t now = timer_get_ticks();
+			if (work->started_ticks == 0) {
+				work->started_ticks = now;
+			}
+			uint64_t wait_us = timer_ticks_to_us(now - work->queued_ticks);
+			fs_queue_stats_t* stats = &fs->queue_stats[priority];
+			++stats->count;
+			stats->total_wait_us += wait_us;
+			stats->max_wait_us = __max(stats->max_wait_us, wait_us);
+			return work;
+		}
+	}
+	return NULL;
+}
+
+// Queue a work on the file threads.
+static void fs_queue_file(fs_t* fs, fs_work_t* work) {
+	TRACE_ASYNC_BEGIN("fs_queue_wait", work->trace_id);
+	mutex_lock(fs->queue_mutex);
+	work->queued_ticks = timer_get_ticks();
+	fs_work_queue_insert(&fs->file_works, work);
+	int count = fs->file_works.count;
+	mutex_unlock(fs->queue_mutex);
+	semaphore_release(fs->file_works_ready);
+	TRACE_COUNTER("fs_queue_depth", count);
+}
+
+// Queue a plain read or write, on the completion port when there is one.
+// Flushed writes go to the file threads so that the flush does not stall the I/O thread.
+static void fs_queue_io(fs_t* fs, fs_work_t* work) {
+	if (!fs->completion_port || work->flush) {
+		fs_queue_file(fs, work);
+		return;
+	}
+	TRACE_ASYNC_BEGIN("fs_queue_wait", work->trace_id);
+	mutex_lock(fs->queue_mutex);
+	work->queued_ticks = timer_get_ticks();
+	fs_work_queue_insert(&fs->io_works, work);
+	mutex_unlock(fs->queue_mutex);
+	// only a wakeup, the I/O thread takes works from io_works as it has room for them
+	PostQueuedCompletionStatus(fs->completion_port, 0, k_fs_io_key_submit, NULL);
+}
+
+// Find path in the fs's interned paths, adding it if it is not there yet.
+// Called with the work lock held.
+static const char* fs_path_intern(fs_t* fs, const char* path) {
+	size_t length = strlen(path);
+	uint64_t hash = XXH64(path, length, 0);
+	fs_path_t** bucket = &fs->paths[hash % k_fs_path_buckets];
+	for (fs_path_t* interned = *bucket; interned; interned = interned->next) {
+		if (interned->hash == hash && strcmp(interned->path, path) == 0) {
+			return interned->path;
+		}
+	}
+	fs_path_t* interned = heap_alloc(fs->heap, sizeof(fs_path_t) + length + 1, 8);
+	interned->hash = hash;
+	memcpy(interned->path, path, length + 1);
+	interned->next = *bucket;
+	*bucket = interned;
+	return interned->path;
+}
+
+// Take a work from the pool, or allocate one, with every field at its default.
+static fs_work_t* fs_work_create(fs_t* fs, fs_work_op_t op, const char* path, heap_t* heap,
+	fs_priority_t priority, uint64_t deadline) {
+	AcquireSRWLockExclusive(&fs->work_lock);
+	fs_work_t* work = fs->free_works;
+	if (work) {
+		fs->free_works = work->queue_next;
+	}
+	const char* interned = fs_path_intern(fs, path);
+	ReleaseSRWLockExclusive(&fs->work_lock);
+	if (work == NULL) {
+		work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	}
+	memset(work, 0, sizeof(fs_work_t));
+	work->fs = fs;
 	work->heap = heap;
-	work->op = k_fs_work_op_read;
-	strcpy_s(work->path, sizeof(work->path), path);
-	work->buffer = NULL;
-	work->size = 0;
-	work->compressed_size = 0;
-	work->done = event_create();
-	work->result = 0;
+	work->op = op;
+	work->path = interned;
+	work->state = k_fs_work_pending;
+	work->trace_id = TRACE_NEW_ID();
+	work->handle = INVALID_HANDLE_VALUE;
+	work->priority = priority >= 0 && priority < k_fs_priority_count ? priority : k_fs_priority_normal;
+	work->deadline = deadline;
+	work->created_ticks = timer_get_ticks();
+	return work;
+}
+
+fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression) {
+	return fs_read_priority(fs, path, heap, null_terminate, use_compression, k_fs_priority_normal, 0);
+}
+
+// Queue a read as fs_read_priority does, with direct it is read with direct I/O.
+static fs_work_t* fs_read_queue(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression,
+	fs_priority_t priority, uint64_t deadline, bool direct) {
+	fs_record_request(fs, k_fs_manifest_read, use_compression, 0, 0, path);
+	fs_work_t* work = fs_prefetch_claim(fs, k_fs_manifest_read, use_compression, 0, 0, path, heap, NULL, priority, deadline);
+	if (work) {
+		return work;
+	}
+
+	work = fs_work_create(fs, k_fs_work_op_read, path, heap, priority, deadline);
 	work->null_terminate = null_terminate;
 	work->use_compression = use_compression;
-	queue_push(fs->file_queue, work);
+	work->direct = direct;
+
+	TRACE_ZONE_BEGIN("fs_read");
+	TRACE_ASYNC_BEGIN("fs_work", work->trace_id);
+	TRACE_FLOW_BEGIN("fs_flow", work->trace_id);
+	work->pack_entry = fs_pack_find(fs, path, &work->pack_mount);
+	if (use_compression || work->pack_entry || direct) {
+		// compressed, packed and direct reads are done by a file thread
+		fs_queue_file(fs, work);
+	} else {
+		fs_queue_io(fs, work);
+	}
+	TRACE_ZONE_END();
+	return work;
+}
+
+fs_work_t* fs_read_priority(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression,
+	fs_priority_t priority, uint64_t deadline) {
+	return fs_read_queue(fs, path, heap, null_terminate, use_compression, priority, deadline, false);
+}
+
+fs_work_t* fs_read_direct(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression,
+	fs_priority_t priority, uint64_t deadline) {
+	return fs_read_queue(fs, path, heap, null_terminate, use_compression, priority, deadline, true);
+}
+
+fs_work_t* fs_read_range(fs_t* fs, const char* path, uint64_t offset, size_t size, void* buffer) {
+	fs_range_t range = { offset, size, buffer };
+	return fs_read_ranges(fs, path, &range, 1);
+}
+
+fs_work_t* fs_read_ranges(fs_t* fs, const char* path, const fs_range_t* ranges, int range_count) {
+	return fs_read_ranges_priority(fs, path, ranges, range_count, k_fs_priority_normal, 0);
+}
+
+fs_work_t* fs_read_ranges_priority(fs_t* fs, const char* path, const fs_range_t* ranges, int range_count,
+	fs_priority_t priority, uint64_t deadline) {
+	for (int i = 0; i < range_count; ++i) {
+		fs_record_request(fs, k_fs_manifest_range, false, ranges[i].offset, ranges[i].size, path);
+	}
+	if (range_count == 1) {
+		fs_work_t* work = fs_prefetch_claim(fs, k_fs_manifest_range, false, ranges[0].offset, ranges[0].size, path,
+			NULL, ranges[0].buffer, priority, deadline);
+		if (work) {
+			return work;
+		}
+	}
+
+	fs_work_t* work = fs_work_create(fs, k_fs_work_op_read_ranges, path, fs->heap, priority, deadline);
+	work->ranges = heap_alloc(fs->heap, sizeof(fs_range_t) * __max(range_count, 1), 8);
+	memcpy(work->ranges, ranges, sizeof(fs_range_t) * range_count);
+	work->range_count = range_count;
+
+	TRACE_ZONE_BEGIN("fs_read_ranges");
+	TRACE_ASYNC_BEGIN("fs_work", work->trace_id);
+	TRACE_FLOW_BEGIN("fs_flow", work->trace_id);
+	work->pack_entry = fs_pack_find(fs, path, &work->pack_mount);
+	fs_queue_file(fs, work);
+	TRACE_ZONE_END();
 	return work;
 }
 
-fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression) {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
-	work->heap = fs->heap;
-	work->op = k_fs_work_op_write;
-	strcpy_s(work->path, sizeof(work->path), path);
+// Queue a write as fs_write does, with flush the file is flushed to the drive before it is renamed.
+static fs_work_t* fs_write_flush(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level, bool flush) {
+	fs_work_t* work = fs_work_create(fs, k_fs_work_op_write, path, fs->heap, k_fs_priority_normal, 0);
 	work->buffer = (char*)buffer;
 	work->size = size;
-	work->compressed_size = 0;
-	work->done = event_create();
-	work->result = 0;
-	work->null_terminate = false;
-	work->use_compression = use_compression;
+	work->use_compression = compression_level != k_fs_compression_none;
+	work->compression_level = compression_level;
+	work->flush = flush;
 
-	if (use_compression) { // HOMEWORK 2: Queue file write work on compression queue!
+	TRACE_ZONE_BEGIN("fs_write");
+	TRACE_ASYNC_BEGIN("fs_work", work->trace_id);
+	TRACE_FLOW_BEGIN("fs_flow", work->trace_id);
+	if (work->use_compression) { // HOMEWORK 2: Queue file write work on compression queue!
+		TRACE_ASYNC_BEGIN("fs_compress_wait", work->trace_id);
 		queue_push(fs->compression_file_queue, work);
 	} else {
-		queue_push(fs->file_queue, work);
+		fs_queue_io(fs, work);
+	}
+	TRACE_ZONE_END();
+
+	return work;
+}
+
+fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level) {
+	return fs_write_flush(fs, path, buffer, size, compression_level, false);
+}
+
+void fs_write_behind(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level) {
+	// the copy is made before taking the lock, the caller may reuse its buffer on return
+	char* copy = heap_alloc(fs->heap, __max(size, 1), 8);
+	memcpy(copy, buffer, size);
+
+	TRACE_ZONE_BEGIN("fs_write_behind");
+	mutex_lock(fs->queue_mutex);
+	// few paths are pending at once, such as a save and a config, so a list is enough
+	fs_write_behind_t** link = &fs->write_behinds;
+	while (*link && strcmp((*link)->path, path) != 0) {
+		link = &(*link)->next;
+	}
+	fs_write_behind_t* pending = *link;
+	char* replaced = NULL;
+	if (pending) {
+		replaced = pending->buffer;
+	} else {
+		size_t length = strlen(path);
+		pending = heap_alloc(fs->heap, sizeof(fs_write_behind_t), 8);
+		memset(pending, 0, sizeof(fs_write_behind_t));
+		pending->path = heap_alloc(fs->heap, length + 1, 8);
+		memcpy(pending->path, path, length + 1);
+		pending->due = timer_get_ticks() + timer_get_ticks_per_second() * fs->write_behind_delay_ms / 1000;
+		*link = pending;
+	}
+	pending->buffer = copy;
+	pending->size = size;
+	pending->compression_level = compression_level;
+	if (!fs->write_behind_thread && !fs->write_behind_quit) {
+		fs->write_behind_thread = thread_create(write_behind_thread_func, fs);
+	}
+	mutex_unlock(fs->queue_mutex);
+	if (replaced) {
+		heap_free(fs->heap, replaced);
+	}
+	TRACE_ZONE_END();
+}
+
+void fs_set_write_behind(fs_t* fs, uint32_t delay_ms, bool durable) {
+	mutex_lock(fs->queue_mutex);
+	fs->write_behind_delay_ms = delay_ms;
+	fs->write_behind_durable = durable;
+	mutex_unlock(fs->queue_mutex);
+}
+
+void fs_flush(fs_t* fs) {
+	fs_write_behind_run(fs, true);
+}
+
+fs_work_t* fs_map(fs_t* fs, const char* path, bool prefetch) {
+	fs_record_request(fs, k_fs_manifest_map, prefetch, 0, 0, path);
+	fs_work_t* work = fs_prefetch_claim(fs, k_fs_manifest_map, prefetch, 0, 0, path, NULL, NULL, k_fs_priority_normal, 0);
+	if (work) {
+		return work;
 	}
 
+	work = fs_work_create(fs, k_fs_work_op_map, path, fs->heap, k_fs_priority_normal, 0);
+	work->prefetch = prefetch;
+
+	TRACE_ZONE_BEGIN("fs_map");
+	TRACE_ASYNC_BEGIN("fs_work", work->trace_id);
+	TRACE_FLOW_BEGIN("fs_flow", work->trace_id);
+	fs_queue_file(fs, work);
+	TRACE_ZONE_END();
 	return work;
 }
 
+void fs_unmap(fs_work_t* work) {
+	fs_work_wait(work);
+	if (work && work->op == k_fs_work_op_map && work->buffer) {
+		UnmapViewOfFile(work->buffer);
+		work->buffer = NULL;
+		work->size = 0;
+	}
+}
+
+bool fs_work_cancel(fs_work_t* work) {
+	if (work == NULL) {
+		return false;
+	}
+	fs_t* fs = work->fs;
+	mutex_lock(fs->queue_mutex);
+	bool queued = work->queue != NULL;
+	if (queued) {
+		fs_work_queue_remove(work->queue, work);
+		++fs->queue_stats[work->priority].cancelled;
+	}
+	mutex_unlock(fs->queue_mutex);
+
+	if (queued) {
+		TRACE_ASYNC_END("fs_queue_wait", work->trace_id);
+		work->result = ERROR_OPERATION_ABORTED;
+		fs_work_complete(work);
+	}
+	return queued;
+}
+
+void fs_get_queue_stats(fs_t* fs, fs_priority_t priority, fs_queue_stats_t* stats) {
+	mutex_lock(fs->queue_mutex);
+	*stats = fs->queue_stats[priority];
+	mutex_unlock(fs->queue_mutex);
+}
+
+void fs_work_get_timing(fs_work_t* work, fs_work_timing_t* timing) {
+	memset(timing, 0, sizeof(fs_work_timing_t));
+	fs_work_wait(work);
+	if (work == NULL || work->completed_ticks == 0) {
+		return;
+	}
+	uint64_t started = work->started_ticks ? work->started_ticks : work->created_ticks;
+	uint64_t service = work->completed_ticks - started;
+	timing->queue_us = timer_ticks_to_us(started - work->created_ticks);
+	timing->codec_us = timer_ticks_to_us(__min(work->codec_ticks, service));
+	timing->io_us = timer_ticks_to_us(service - __min(work->codec_ticks, service));
+	timing->total_us = timer_ticks_to_us(work->completed_ticks - work->created_ticks);
+}
+
 bool fs_work_is_done(fs_work_t* work) {
-	return work ? event_is_raised(work->done) : true;
+	return work ? atomic_load(&work->state) == k_fs_work_done : true;
 }
 
 void fs_work_wait(fs_work_t* work) {
-	if (work) {
-		event_wait(work->done);
+	if (work == NULL) {
+		return;
+	}
+	int state = atomic_load(&work->state);
+	while (state != k_fs_work_done) {
+		// fails if the work completed meanwhile, then the wait returns at once
+		if (state == k_fs_work_pending) {
+			atomic_compare_and_exchange(&work->state, k_fs_work_pending, k_fs_work_waiting);
+		}
+		atomic_wait(&work->state, k_fs_work_waiting);
+		state = atomic_load(&work->state);
 	}
 }
 
@@ -132,28 +923,284 @@ size_t fs_work_get_size(fs_work_t* work) {
 
 void fs_work_destroy(fs_work_t* work) {
 	if (work) {
-		event_wait(work->done);
-		event_destroy(work->done);
-		heap_free(work->heap, work);
+		fs_work_wait(work);
+		fs_unmap(work);
+		fs_t* fs = work->fs;
+		if (work->ranges) {
+			heap_free(fs->heap, work->ranges);
+		}
+		AcquireSRWLockExclusive(&fs->work_lock);
+		work->queue_next = fs->free_works;
+		fs->free_works = work;
+		ReleaseSRWLockExclusive(&fs->work_lock);
+	}
+}
+
+// Signal the waiters and close the work's async slice and flow arrow.
+static void fs_work_complete(fs_work_t* work) {
+	if (work->deadline && work->result != ERROR_OPERATION_ABORTED && timer_get_ticks() > work->deadline) {
+		atomic_increment(&work->fs->queue_stats[work->priority].deadline_misses);
+	}
+	work->completed_ticks = timer_get_ticks();
+	TRACE_FLOW_END("fs_flow", work->trace_id);
+	TRACE_ASYNC_END("fs_work", work->trace_id);
+	// a waiter can reuse the work as soon as it is done, a wake after that is spurious at worst
+	if (atomic_exchange(&work->state, k_fs_work_done) == k_fs_work_waiting) {
+		atomic_wake_all(&work->state);
+	}
+}
+
+// Take a large read slot for a work, or park it in large_works if max_large_reads workers
+// already have one. Returns false if it was parked.
+static bool fs_large_read_acquire(fs_t* fs, fs_work_t* work) {
+	mutex_lock(fs->queue_mutex);
+	bool acquired = fs->large_reads < fs->max_large_reads;
+	if (acquired) {
+		++fs->large_reads;
+		work->large_read = true;
+	} else {
+		TRACE_ASYNC_BEGIN("fs_queue_wait", work->trace_id);
+		work->queued_ticks = timer_get_ticks();
+		fs_work_queue_insert(&fs->large_works, work);
+	}
+	mutex_unlock(fs->queue_mutex);
+	return acquired;
+}
+
+// Give back a work's large read slot, waking a file thread for a parked read if there is one.
+static void fs_large_read_release(fs_t* fs, fs_work_t* work) {
+	if (!work->large_read) {
+		return;
+	}
+	work->large_read = false;
+	mutex_lock(fs->queue_mutex);
+	--fs->large_reads;
+	bool parked = fs->large_works.count > 0;
+	mutex_unlock(fs->queue_mutex);
+	if (parked) {
+		semaphore_release(fs->file_works_ready);
+	}
+}
+
+// Take the most urgent parked large read if a slot is free, NULL otherwise.
+// Called with the queue mutex held.
+static fs_work_t* fs_large_read_pop(fs_t* fs) {
+	if (fs->large_reads >= fs->max_large_reads) {
+		return NULL;
+	}
+	for (int priority = 0; priority < k_fs_priority_count; ++priority) {
+		fs_work_t* work = fs->large_works.heads[priority];
+		if (work) {
+			fs_work_queue_remove(&fs->large_works, work);
+			++fs->large_reads;
+			work->large_read = true;
+			return work;
+		}
+	}
+	return NULL;
+}
+
+// Read size bytes at offset, safe to call from many threads on one handle.
+// Sizes past what one ReadFile call can transfer are read in several calls.
+// Returns 0 on success or an error code.
+static int fs_read_at(HANDLE handle, uint64_t offset, void* buffer, size_t size) {
+	for (size_t done = 0; done < size; ) {
+		// an OVERLAPPED on a handle not opened for overlapped I/O gives a synchronous read at its offset
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = (DWORD)((offset + done) & 0xffffffff);
+		overlapped.OffsetHigh = (DWORD)((offset + done) >> 32);
+		DWORD chunk = (DWORD)__min(size - done, k_fs_io_max_size);
+		DWORD bytes_read = 0;
+		if (!ReadFile(handle, (char*)buffer + done, chunk, &bytes_read, &overlapped)) {
+			return GetLastError();
+		}
+		if (bytes_read != chunk) {
+			return -1;
+		}
+		done += chunk;
+	}
+	return 0;
+}
+
+// Take a pair of staging buffers for a direct read, NULL if the pool can't be allocated.
+static fs_direct_pair_t* fs_direct_acquire(fs_t* fs) {
+	mutex_lock(fs->queue_mutex);
+	if (fs->direct_pool == NULL) {
+		// page aligned, and every buffer is a whole number of sectors
+		size_t pool_size = (size_t)fs->file_thread_count * 2 * k_fs_direct_buffer_size;
+		fs->direct_pool = VirtualAlloc(NULL, pool_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+		if (fs->direct_pool) {
+			fs->direct_pairs = heap_alloc(fs->heap, sizeof(fs_direct_pair_t) * fs->file_thread_count, 8);
+			memset(fs->direct_pairs, 0, sizeof(fs_direct_pair_t) * fs->file_thread_count);
+			for (int i = 0; i < fs->file_thread_count; ++i) {
+				fs_direct_pair_t* pair = &fs->direct_pairs[i];
+				for (int slot = 0; slot < 2; ++slot) {
+					pair->buffers[slot] = fs->direct_pool + ((size_t)i * 2 + slot) * k_fs_direct_buffer_size;
+					pair->events[slot] = CreateEvent(NULL, TRUE, FALSE, NULL);
+				}
+				pair->next = fs->direct_free;
+				fs->direct_free = pair;
+			}
+		} else {
+			debug_print_line(k_print_warning, "Unable to allocate direct read staging, reading buffered.\n");
+		}
+	}
+	fs_direct_pair_t* pair = fs->direct_free;
+	if (pair) {
+		fs->direct_free = pair->next;
+	}
+	mutex_unlock(fs->queue_mutex);
+	return pair;
+}
+
+static void fs_direct_release(fs_t* fs, fs_direct_pair_t* pair) {
+	mutex_lock(fs->queue_mutex);
+	pair->next = fs->direct_free;
+	fs->direct_free = pair;
+	mutex_unlock(fs->queue_mutex);
+}
+
+// Start reading size bytes at offset into one of a pair's buffers. The read is widened to
+// sector boundaries, data is set to where the requested bytes will be in the buffer.
+// Returns 0 if the read started or an error code.
+static int fs_direct_begin(HANDLE direct_handle, fs_direct_pair_t* pair, int slot, uint64_t offset, size_t size, char** data) {
+	uint64_t start = offset & ~(uint64_t)(k_fs_direct_alignment - 1);
+	uint64_t end = (offset + size + k_fs_direct_alignment - 1) & ~(uint64_t)(k_fs_direct_alignment - 1);
+	OVERLAPPED* overlapped = &pair->overlapped[slot];
+	memset(overlapped, 0, sizeof(OVERLAPPED));
+	overlapped->Offset = (DWORD)(start & 0xffffffff);
+	overlapped->OffsetHigh = (DWORD)(start >> 32);
+	overlapped->hEvent = pair->events[slot];
+	*data = pair->buffers[slot] + (offset - start);
+	if (!ReadFile(direct_handle, pair->buffers[slot], (DWORD)(end - start), NULL, overlapped)) {
+		int result = GetLastError();
+		if (result != ERROR_IO_PENDING) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+// Wait for a read started by fs_direct_begin to deliver size bytes at data.
+// Returns 0 on success or an error code.
+static int fs_direct_end(HANDLE direct_handle, fs_direct_pair_t* pair, int slot, const char* data, size_t size) {
+	DWORD bytes = 0;
+	if (!GetOverlappedResult(direct_handle, &pair->overlapped[slot], &bytes, TRUE)) {
+		int result = GetLastError();
+		if (result != ERROR_HANDLE_EOF) {
+			return result;
+		}
+	}
+	// a read that reaches the end of the file comes back short of the widened size
+	return (size_t)(data - pair->buffers[slot]) + size <= bytes ? 0 : -1;
+}
+
+// Read size bytes at base into dst, bypassing the page cache through direct_handle.
+// Each chunk is copied out of one buffer of a staging pair while the next is read into
+// the other. Reads buffered through handle if there is no direct_handle or staging.
+// Returns 0 on success or an error code.
+static int fs_read_direct_at(fs_t* fs, HANDLE handle, HANDLE direct_handle, uint64_t base, size_t size, char* dst) {
+	fs_direct_pair_t* pair = direct_handle != INVALID_HANDLE_VALUE ? fs_direct_acquire(fs) : NULL;
+	if (pair == NULL) {
+		return fs_read_at(handle, base, dst, size);
+	}
+
+	char* data[2] = { NULL, NULL };
+	size_t sizes[2] = { 0, 0 };
+	bool pending[2] = { false, false };
+	size_t issued = 0;
+	size_t copied = 0;
+	int slot = 0;
+	int result = 0;
+	while (copied < size && result == 0) {
+		// the chunk after the one being copied is always in flight
+		for (int i = 0; i < 2 && issued < size && result == 0; ++i) {
+			int next = slot ^ i;
+			if (!pending[next]) {
+				sizes[next] = __min(size - issued, k_fs_direct_chunk_size);
+				result = fs_direct_begin(direct_handle, pair, next, base + issued, sizes[next], &data[next]);
+				pending[next] = result == 0;
+				issued += sizes[next];
+			}
+		}
+		if (result != 0) {
+			break;
+		}
+		TRACE_ZONE_BEGIN("fs_direct_wait");
+		result = fs_direct_end(direct_handle, pair, slot, data[slot], sizes[slot]);
+		TRACE_ZONE_END();
+		pending[slot] = false;
+		if (result == 0) {
+			memcpy(dst + copied, data[slot], sizes[slot]);
+			copied += sizes[slot];
+		}
+		slot ^= 1;
+	}
+	// the pair can't go back to the pool with a read still in flight into it
+	for (int i = 0; i < 2; ++i) {
+		if (pending[i]) {
+			fs_direct_end(direct_handle, pair, i, data[i], sizes[i]);
+		}
+	}
+	fs_direct_release(fs, pair);
+	return result;
+}
+
+// Finish a read that failed, the work's waiters get the error in result.
+static void file_read_failed(fs_t* fs, fs_work_t* work, int result) {
+	fs_large_read_release(fs, work);
+	if (work->buffer) {
+		heap_free(work->heap, work->buffer);
+		work->buffer = NULL;
 	}
+	work->size = 0;
+	work->result = result;
+	fs_work_complete(work);
 }
 
 static void file_read(fs_t* fs, fs_work_t* work) {
+	if (work->pack_entry) {
+		file_read_packed(fs, work);
+		return;
+	}
+
 	wchar_t wide_path[1024];
-	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0) {
-		work->result = -1;
+	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, _countof(wide_path)) <= 0) {
+		file_read_failed(fs, work, -1);
 		return;
 	}
 
 	HANDLE handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
 		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (handle == INVALID_HANDLE_VALUE) {
-		work->result = GetLastError();
+		file_read_failed(fs, work, GetLastError());
 		return;
 	}
 
 	if (!GetFileSizeEx(handle, (PLARGE_INTEGER)&work->size)) {
-		work->result = GetLastError();
+		CloseHandle(handle);
+		file_read_failed(fs, work, GetLastError());
+		return;
+	}
+
+	if (work->size >= k_fs_large_read_size && !work->large_read && !fs_large_read_acquire(fs, work)) {
+		// a file thread picks it up again once a large read finishes
+		CloseHandle(handle);
+		return;
+	}
+
+	// the buffered handle is still needed for a compressed file's index, which is not sector aligned.
+	// A volume that doesn't allow direct reads is read buffered
+	HANDLE direct_handle = work->direct
+		? CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL)
+		: INVALID_HANDLE_VALUE;
+
+	if (work->use_compression) {
+		file_read_streamed(fs, work, handle, direct_handle, 0, work->size);
+		if (direct_handle != INVALID_HANDLE_VALUE) {
+			CloseHandle(direct_handle);
+		}
 		CloseHandle(handle);
 		return;
 	}
@@ -161,9 +1208,19 @@ static void file_read(fs_t* fs, fs_work_t* work) {
 	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
 
 	DWORD bytes_read = 0;
-	if (!ReadFile(handle, work->buffer, (DWORD)work->size, &bytes_read, NULL)) {
-		work->result = GetLastError();
+	if (direct_handle != INVALID_HANDLE_VALUE) {
+		int result = fs_read_direct_at(fs, handle, direct_handle, 0, work->size, work->buffer);
+		CloseHandle(direct_handle);
+		if (result != 0) {
+			CloseHandle(handle);
+			file_read_failed(fs, work, result);
+			return;
+		}
+		bytes_read = (DWORD)work->size;
+	} else if (!ReadFile(handle, work->buffer, (DWORD)work->size, &bytes_read, NULL)) {
+		int result = GetLastError();
 		CloseHandle(handle);
+		file_read_failed(fs, work, result);
 		return;
 	}
 
@@ -175,123 +1232,706 @@ static void file_read(fs_t* fs, fs_work_t* work) {
 
 	CloseHandle(handle);
 
-	if (work->use_compression) { // HOMEWORK 2: Queue file read work on decompression queue!
-		queue_push(fs->compression_file_queue, work);
-	} else {
-		event_signal(work->done);
+	fs_large_read_release(fs, work);
+
+	fs_work_complete(work);
+}
+
+// Get a write's path and the temporary path it is written to before it replaces the file.
+// The temporary path is named after the work, so writes of one path in flight at once each
+// have their own.
+static bool fs_write_paths(const fs_work_t* work, wchar_t* wide_path, wchar_t* temp_path, int count) {
+	char temp[1100];
+	snprintf(temp, sizeof(temp), "%s.%llx.tmp", work->path, (unsigned long long)(uintptr_t)work);
+	return MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, count) > 0
+		&& MultiByteToWideChar(CP_UTF8, 0, temp, -1, temp_path, count) > 0;
+}
+
+// Rename a written temporary file over the write's path, or delete it if the write failed.
+// The rename replaces the file in one step, a reader sees the old file or the new one and
+// never a partial write. After a crash that only holds for flushed writes, an unflushed one
+// can leave the new name with contents the drive never got. Returns the write's result.
+static int fs_write_replace(const wchar_t* wide_path, const wchar_t* temp_path, int result, bool flush) {
+	if (result == 0 && !MoveFileEx(temp_path, wide_path, MOVEFILE_REPLACE_EXISTING | (flush ? MOVEFILE_WRITE_THROUGH : 0))) {
+		result = GetLastError();
+	}
+	if (result != 0) {
+		DeleteFile(temp_path);
 	}
+	return result;
 }
 
 static void file_write(fs_work_t* work) {
 	wchar_t wide_path[1024];
-	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0) {
+	wchar_t temp_path[1024];
+	if (!fs_write_paths(work, wide_path, temp_path, _countof(wide_path))) {
 		work->result = -1;
+		fs_work_complete(work);
 		return;
 	}
 
-	HANDLE handle = CreateFile(wide_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
+	// not shared, a second writer of the same temporary path fails instead of mixing writes
+	HANDLE handle = CreateFile(temp_path, GENERIC_WRITE, 0, NULL,
 		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (handle == INVALID_HANDLE_VALUE) {
 		work->result = GetLastError();
+		fs_work_complete(work);
 		return;
 	}
 
-	/*
-	// if compression is used, write the compression size into the file for reading
-	DWORD bytes_written_compression = 0;
-	char compressed_size_str[256];
-	if (work->use_compression) {
-		snprintf(compressed_size_str, sizeof(compressed_size_str), "%zu ", work->compressed_size);
-		if (!WriteFile(handle, (LPVOID) compressed_size_str, strlen(compressed_size_str), &bytes_written_compression, NULL)) {
-			work->result = GetLastError();
-			CloseHandle(handle);
-			return;
-		}
-	}
-	*/
-
+	// a compressed write keeps the caller's size and writes the compressed buffer
+	size_t write_size = work->use_compression ? work->compressed_size : work->size;
 	DWORD bytes_written = 0;
-	if (!WriteFile(handle, work->buffer, (DWORD)work->size, &bytes_written, NULL)) {
+	if (!WriteFile(handle, work->buffer, (DWORD)write_size, &bytes_written, NULL)) {
+		work->result = GetLastError();
+	} else if (!work->use_compression) {
+		work->size = bytes_written;
+	}
+	if (work->result == 0 && work->flush && !FlushFileBuffers(handle)) {
 		work->result = GetLastError();
-		CloseHandle(handle);
-		return;
 	}
-
-	work->size = bytes_written;
 
 	CloseHandle(handle);
+	work->result = fs_write_replace(wide_path, temp_path, work->result, work->flush);
 
 	if (work->use_compression) {
 		// free the buffer (we don't need the compressed buffer)
 		heap_free(work->heap, work->buffer);
+		work->buffer = NULL;
 	}
 
-	event_signal(work->done);
+	fs_work_complete(work);
 }
 
-static void file_read_compressed(fs_work_t* work) {
-	// read the file for the destination file size (delimit by ' ')
-	FILE* stream;
-	errno_t err = fopen_s(&stream, work->path, "r");
-	if (err) {
-		debug_print_line(k_print_error, "Unable to open the file for reading a compressed file.\n");
+// Map a file read-only, the view keeps the mapping alive after its handles are closed.
+static void file_map(fs_work_t* work) {
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, _countof(wide_path)) <= 0) {
+		work->result = -1;
+		fs_work_complete(work);
 		return;
 	}
-	int space_count = 0; // count the amount of space to skip for the buffer
-	int dst_buffer_size = work->size;
-	int compressed_size = 0;
-	fscanf_s(stream, "%d%n", &compressed_size, &space_count);
-	// move in compressed_size + 1, due to the extra space added to the compressed file
-	space_count += 1;
-	
-	void* dst_buffer = heap_alloc(work->heap, dst_buffer_size, 0);
-	int decompressed_size = LZ4_decompress_safe((char*)work->buffer+space_count, dst_buffer, compressed_size, dst_buffer_size);
 
-	// there is extra garbage left over from writing into the file
-	//	i.e. if we write 4 bytes at the start, there are 4 garbage bytes at the end that we need to clear up
-	for (int x = decompressed_size + space_count; x > decompressed_size-1; x--) {
-		*((char*)dst_buffer+x) = '\0';
-	}
-
-	heap_free(work->heap, work->buffer);
-
-	work->buffer = dst_buffer;
-	work->size = decompressed_size;
+	HANDLE handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		work->result = GetLastError();
+		fs_work_complete(work);
+		return;
+	}
+
+	if (!GetFileSizeEx(handle, (PLARGE_INTEGER)&work->size)) {
+		work->result = GetLastError();
+		CloseHandle(handle);
+		fs_work_complete(work);
+		return;
+	}
+
+	// an empty file can't be mapped, it succeeds with a NULL buffer
+	if (work->size == 0) {
+		CloseHandle(handle);
+		fs_work_complete(work);
+		return;
+	}
+
+	HANDLE mapping = CreateFileMapping(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(handle);
+	if (mapping == NULL) {
+		work->result = GetLastError();
+		work->size = 0;
+		fs_work_complete(work);
+		return;
+	}
+
+	work->buffer = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (work->buffer == NULL) {
+		work->result = GetLastError();
+		work->size = 0;
+		fs_work_complete(work);
+		return;
+	}
+
+	if (work->prefetch) {
+		// start paging the whole view in now rather than a fault at a time on first touch
+		WIN32_MEMORY_RANGE_ENTRY range = { work->buffer, work->size };
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+	}
+
+	fs_work_complete(work);
+}
+
+// Frame settings for a block of size bytes.
+static LZ4F_preferences_t fs_block_preferences(size_t size) {
+	LZ4F_preferences_t preferences;
+	memset(&preferences, 0, sizeof(preferences));
+	preferences.frameInfo.blockSizeID = LZ4F_max256KB;
+	preferences.frameInfo.blockMode = LZ4F_blockIndependent;
+	preferences.frameInfo.contentChecksumFlag = LZ4F_contentChecksumEnabled;
+	preferences.frameInfo.blockChecksumFlag = LZ4F_blockChecksumEnabled;
+	preferences.frameInfo.contentSize = size;
+	return preferences;
+}
+
+// Levels below LZ4HC_CLEVEL_MIN are plain LZ4, the rest are LZ4HC and only cost compression time.
+static int fs_block_compress(LZ4F_cctx* cctx, const fs_block_job_t* job) {
+	LZ4F_preferences_t preferences = fs_block_preferences(job->src_size);
+	preferences.compressionLevel = __min(job->level, LZ4F_compressionLevel_max());
+	const LZ4F_CDict* cdict = NULL;
+	if (job->dictionary) {
+		preferences.frameInfo.dictID = job->dictionary->id;
+		cdict = job->dictionary->cdict;
+	}
+	size_t result = LZ4F_compressFrame_usingCDict(cctx, job->dst, job->dst_capacity, job->src, job->src_size, cdict, &preferences);
+	return LZ4F_isError(result) ? -1 : (int)result;
+}
+
+// Decode one frame, which must hold exactly dst_capacity bytes and pass its checksums.
+static int fs_block_decompress(LZ4F_dctx* dctx, const fs_block_job_t* job) {
+	LZ4F_frameInfo_t info;
+	size_t src_pos = job->src_size;
+	size_t result = LZ4F_getFrameInfo(dctx, &info, job->src, &src_pos);
+	if (LZ4F_isError(result) || info.contentSize != (unsigned long long)job->dst_capacity
+		|| info.dictID != (job->dictionary ? job->dictionary->id : 0)) {
+		LZ4F_resetDecompressionContext(dctx);
+		return -1;
+	}
+	const char* dictionary = job->dictionary ? job->dictionary->data : NULL;
+	size_t dictionary_size = job->dictionary ? job->dictionary->size : 0;
+
+	size_t dst_pos = 0;
+	while (true) {
+		size_t dst_size = job->dst_capacity - dst_pos;
+		size_t src_size = job->src_size - src_pos;
+		result = LZ4F_decompress_usingDict(dctx, job->dst + dst_pos, &dst_size, job->src + src_pos, &src_size,
+			dictionary, dictionary_size, NULL);
+		if (LZ4F_isError(result)) {
+			LZ4F_resetDecompressionContext(dctx);
+			return -1;
+		}
+		dst_pos += dst_size;
+		src_pos += src_size;
+		if (result == 0) {
+			// the frame ended and its content checksum matched
+			return (int)dst_pos;
+		}
+		if (src_pos == (size_t)job->src_size) {
+			// truncated frame
+			LZ4F_resetDecompressionContext(dctx);
+			return -1;
+		}
+	}
+}
+
+// Queue count jobs on the block threads as one batch, count must not be 0.
+static void fs_block_submit(fs_t* fs, fs_block_job_t* jobs, int count, fs_block_batch_t* batch) {
+	batch->remaining = count;
+	for (int i = 0; i < count; ++i) {
+		jobs[i].batch = batch;
+		queue_push(fs->block_queue, &jobs[i]);
+	}
+}
+
+// Wait for every job of a submitted batch to finish, returns the ticks spent waiting.
+static uint64_t fs_block_wait(fs_block_batch_t* batch) {
+	TRACE_ZONE_BEGIN("fs_block_wait");
+	uint64_t start = timer_get_ticks();
+	int remaining = atomic_load(&batch->remaining);
+	while (remaining != 0) {
+		atomic_wait(&batch->remaining, remaining);
+		remaining = atomic_load(&batch->remaining);
+	}
+	uint64_t ticks = timer_get_ticks() - start;
+	TRACE_ZONE_END();
+	return ticks;
+}
+
+// Run every job in jobs on the block threads and wait for all of them.
+// Returns the ticks spent waiting.
+static uint64_t fs_block_run(fs_t* fs, fs_block_job_t* jobs, int count) {
+	if (count == 0) {
+		return 0;
+	}
+	fs_block_batch_t batch;
+	fs_block_submit(fs, jobs, count, &batch);
+	return fs_block_wait(&batch);
+}
+
+// Compress size bytes of src at level into a block file allocated from heap.
+// With a dictionary, which must have its cdict, every block is compressed against it.
+// Returns NULL if a block fails to compress.
+static char* fs_compress_blocks(fs_t* fs, heap_t* heap, const char* src, size_t size, int level,
+	const fs_dictionary_t* dictionary, size_t* compressed_size) {
+	int block_count = (int)((size + k_fs_block_size - 1) / k_fs_block_size);
+	LZ4F_preferences_t preferences = fs_block_preferences(k_fs_block_size);
+	int bound = (int)LZ4F_compressFrameBound(k_fs_block_size, &preferences);
+
+	// each block compresses into its own slot, then they are packed behind the index
+	char* scratch = heap_alloc(fs->heap, (size_t)bound * __max(block_count, 1), 8);
+	fs_block_job_t* jobs = heap_alloc(fs->heap, sizeof(fs_block_job_t) * __max(block_count, 1), 8);
+	for (int i = 0; i < block_count; ++i) {
+		size_t offset = (size_t)i * k_fs_block_size;
+		jobs[i].op = k_fs_block_compress;
+		jobs[i].verify = false;
+		jobs[i].level = level;
+		jobs[i].dictionary = dictionary;
+		jobs[i].src = src + offset;
+		jobs[i].src_size = (int)__min(size - offset, k_fs_block_size);
+		jobs[i].dst = scratch + (size_t)i * bound;
+		jobs[i].dst_capacity = bound;
+		jobs[i].result = 0;
+	}
+	fs_block_run(fs, jobs, block_count);
+
+	size_t header_size = sizeof(fs_block_header_t) + sizeof(uint64_t) * ((size_t)block_count + 1);
+	*compressed_size = header_size;
+	for (int i = 0; i < block_count; ++i) {
+		if (jobs[i].result <= 0) {
+			heap_free(fs->heap, jobs);
+			heap_free(fs->heap, scratch);
+			return NULL;
+		}
+		*compressed_size += jobs[i].result;
+	}
 
-	event_signal(work->done);
+	char* dst_buffer = heap_alloc(heap, *compressed_size, 8);
+	fs_block_header_t* header = (fs_block_header_t*)dst_buffer;
+	header->frame_magic = k_fs_skippable_frame_magic;
+	header->frame_size = (uint32_t)(header_size - 2 * sizeof(uint32_t));
+	header->magic = k_fs_block_magic;
+	header->block_size = k_fs_block_size;
+	header->raw_size = size;
+	header->block_count = block_count;
+	header->dictionary_id = dictionary ? dictionary->id : 0;
+
+	uint64_t* offsets = (uint64_t*)(dst_buffer + sizeof(fs_block_header_t));
+	uint64_t offset = header_size;
+	for (int i = 0; i < block_count; ++i) {
+		offsets[i] = offset;
+		memcpy(dst_buffer + offset, jobs[i].dst, jobs[i].result);
+		offset += jobs[i].result;
+	}
+	offsets[block_count] = offset;
+
+	heap_free(fs->heap, jobs);
+	heap_free(fs->heap, scratch);
+	return dst_buffer;
 }
 
+// Compress the caller's buffer into blocks and queue the result for writing.
 static void file_write_compressed(fs_t* fs, fs_work_t* work) {
-	int dst_buffer_size = LZ4_compressBound(work->size);
-	char* dst_buffer = heap_alloc(work->heap, dst_buffer_size + sizeof(int), 8);
-	int compressed_size = LZ4_compress_default(work->buffer, dst_buffer + sizeof(int), (int)work->size, dst_buffer_size);
-	memcpy(dst_buffer, compressed_size, sizeof(int));
-	
+	size_t compressed_size = 0;
+	work->started_ticks = timer_get_ticks();
+	char* dst_buffer = fs_compress_blocks(fs, work->heap, work->buffer, work->size, work->compression_level, NULL, &compressed_size);
+	work->codec_ticks += timer_get_ticks() - work->started_ticks;
+	if (dst_buffer == NULL) {
+		debug_print_line(k_print_error, "Unable to compress %s.\n", work->path);
+		work->result = -1;
+		fs_work_complete(work);
+		return;
+	}
+
 	work->buffer = dst_buffer;
 	work->compressed_size = compressed_size;
-	queue_push(fs->file_queue, work);
+	fs_queue_io(fs, work);
+}
+
+// Check a compressed file's header against the file's size.
+static bool fs_block_header_check(const fs_block_header_t* header, uint64_t file_size) {
+	if (header->frame_magic != k_fs_skippable_frame_magic
+		|| header->magic != k_fs_block_magic || header->block_size == 0 || header->block_size > INT_MAX
+		|| header->block_count != (header->raw_size + header->block_size - 1) / header->block_size) {
+		return false;
+	}
+	uint64_t header_size = sizeof(fs_block_header_t) + sizeof(uint64_t) * ((uint64_t)header->block_count + 1);
+	return header_size <= file_size && header->frame_size == header_size - 2 * sizeof(uint32_t);
+}
+
+// Check a compressed file's block index, every frame must fit in a stream chunk.
+static bool fs_block_index_check(const fs_block_header_t* header, const uint64_t* offsets, uint64_t file_size) {
+	uint64_t header_size = sizeof(fs_block_header_t) + sizeof(uint64_t) * ((uint64_t)header->block_count + 1);
+	if (offsets[0] != header_size || offsets[header->block_count] > file_size) {
+		return false;
+	}
+	for (uint32_t i = 0; i < header->block_count; ++i) {
+		if (offsets[i + 1] <= offsets[i] || offsets[i + 1] - offsets[i] > k_fs_stream_chunk_size) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Read and check the header and block index of a block file of file_size bytes at base.
+// Returns the index allocated from the fs heap, NULL if the file is not a valid block file.
+static uint64_t* fs_block_load_index(fs_t* fs, HANDLE handle, uint64_t base, uint64_t file_size, fs_block_header_t* header) {
+	if (fs_read_at(handle, base, header, sizeof(fs_block_header_t)) != 0 || !fs_block_header_check(header, file_size)) {
+		return NULL;
+	}
+	DWORD index_size = (DWORD)(sizeof(uint64_t) * ((size_t)header->block_count + 1));
+	uint64_t* offsets = heap_alloc(fs->heap, index_size, 8);
+	if (fs_read_at(handle, base + sizeof(fs_block_header_t), offsets, index_size) != 0
+		|| !fs_block_index_check(header, offsets, file_size)) {
+		heap_free(fs->heap, offsets);
+		return NULL;
+	}
+	return offsets;
+}
+
+// Find the dictionary a work's block file was compressed against, NULL if it used none.
+// Returns false if the dictionary is not the one of the pack the work reads from.
+static bool fs_block_find_dictionary(const fs_work_t* work, const fs_block_header_t* header,
+	const fs_dictionary_t** dictionary) {
+	*dictionary = NULL;
+	if (header->dictionary_id == 0) {
+		return true;
+	}
+	if (work->pack_mount && work->pack_mount->dictionary.id == header->dictionary_id) {
+		*dictionary = &work->pack_mount->dictionary;
+		return true;
+	}
+	return false;
+}
+
+// Decode a whole block file of size bytes held in memory into dst on the block threads.
+// dst must hold the header's raw_size. Returns false if the file is not valid or a block fails.
+static bool fs_decompress_blocks(fs_t* fs, const char* src, size_t size, char* dst, const fs_dictionary_t* dictionary) {
+	const fs_block_header_t* header = (const fs_block_header_t*)src;
+	if (size < sizeof(fs_block_header_t) || !fs_block_header_check(header, size)) {
+		return false;
+	}
+	const uint64_t* offsets = (const uint64_t*)(src + sizeof(fs_block_header_t));
+	if (!fs_block_index_check(header, offsets, size)) {
+		return false;
+	}
+
+	int block_count = (int)header->block_count;
+	fs_block_job_t* jobs = heap_alloc(fs->heap, sizeof(fs_block_job_t) * __max(block_count, 1), 8);
+	for (int i = 0; i < block_count; ++i) {
+		size_t offset = (size_t)i * header->block_size;
+		jobs[i].op = k_fs_block_decompress;
+		jobs[i].verify = false;
+		jobs[i].dictionary = dictionary;
+		jobs[i].src = src + offsets[i];
+		jobs[i].src_size = (int)(offsets[i + 1] - offsets[i]);
+		jobs[i].dst = dst + offset;
+		jobs[i].dst_capacity = (int)__min(header->raw_size - offset, header->block_size);
+		jobs[i].result = 0;
+	}
+	fs_block_run(fs, jobs, block_count);
+
+	bool succeeded = true;
+	for (int i = 0; i < block_count; ++i) {
+		succeeded = succeeded && jobs[i].result == jobs[i].dst_capacity;
+	}
+	heap_free(fs->heap, jobs);
+	return succeeded;
+}
+
+// Combine the digests of count jobs, each of one k_fs_block_size segment of a pack entry's
+// raw content, into the entry's digest. The digest is the xxhash64 of the segments'
+// xxhash64s, so the segments can be digested in parallel and as they arrive.
+static uint64_t fs_digest_jobs(fs_t* fs, const fs_block_job_t* jobs, int count) {
+	uint64_t* digests = heap_alloc(fs->heap, sizeof(uint64_t) * __max(count, 1), 8);
+	for (int i = 0; i < count; ++i) {
+		digests[i] = jobs[i].digest;
+	}
+	uint64_t digest = XXH64(digests, sizeof(uint64_t) * count, 0);
+	heap_free(fs->heap, digests);
+	return digest;
+}
+
+// Queue digest jobs for size bytes of data, starting at segment first of jobs.
+// offset is where data is in the content, a multiple of k_fs_block_size.
+static void fs_digest_submit(fs_t* fs, fs_block_job_t* jobs, const char* data, size_t offset, size_t size, fs_block_batch_t* batch) {
+	int first = (int)(offset / k_fs_block_size);
+	int count = (int)((size + k_fs_block_size - 1) / k_fs_block_size);
+	for (int i = 0; i < count; ++i) {
+		fs_block_job_t* job = &jobs[first + i];
+		size_t segment = (size_t)i * k_fs_block_size;
+		job->op = k_fs_block_digest;
+		job->verify = false;
+		job->src = data + segment;
+		job->src_size = (int)__min(size - segment, k_fs_block_size);
+		job->result = 0;
+	}
+	fs_block_submit(fs, jobs + first, count, batch);
+}
+
+// Digest a pack entry's raw content on the block threads, see fs_digest_jobs.
+static uint64_t fs_digest_blocks(fs_t* fs, const char* data, size_t size) {
+	int count = (int)((size + k_fs_block_size - 1) / k_fs_block_size);
+	fs_block_job_t* jobs = heap_alloc(fs->heap, sizeof(fs_block_job_t) * __max(count, 1), 8);
+	if (count > 0) {
+		fs_block_batch_t batch;
+		fs_digest_submit(fs, jobs, data, 0, size, &batch);
+		fs_block_wait(&batch);
+	}
+	uint64_t digest = fs_digest_jobs(fs, jobs, count);
+	heap_free(fs->heap, jobs);
+	return digest;
+}
+
+// Decode the raw bytes [offset, offset + size) of a block file at base into buffer.
+// Only the blocks that overlap the range are read, a chunk of frames at a time, and decoded
+// on the block threads. Blocks cut by the range are decoded aside and the overlap copied.
+// Returns 0 on success or an error code.
+static int fs_block_read_range(fs_t* fs, HANDLE handle, uint64_t base, const fs_block_header_t* header,
+	const uint64_t* offsets, const fs_dictionary_t* dictionary, uint64_t offset, size_t size, char* buffer,
+	uint64_t* codec_ticks) {
+	if (offset + size > header->raw_size) {
+		return ERROR_HANDLE_EOF;
+	}
+	if (size == 0) {
+		return 0;
+	}
+
+	uint64_t block_size = header->block_size;
+	int first_block = (int)(offset / block_size);
+	int end_block = (int)((offset + size - 1) / block_size) + 1;
+	fs_block_job_t* jobs = heap_alloc(fs->heap, sizeof(fs_block_job_t) * (end_block - first_block), 8);
+	char* staging = heap_alloc(fs->heap, k_fs_stream_chunk_size, 8);
+	char* edges = heap_alloc(fs->heap, (size_t)block_size * 2, 8);
+	int result = 0;
+
+	for (int first = first_block; first < end_block && result == 0; ) {
+		int last = first + 1;
+		while (last < end_block && offsets[last + 1] - offsets[first] <= k_fs_stream_chunk_size) {
+			++last;
+		}
+
+		TRACE_ZONE_BEGIN("fs_range_read");
+		result = fs_read_at(handle, base + offsets[first], staging, (DWORD)(offsets[last] - offsets[first]));
+		TRACE_ZONE_END();
+		if (result != 0) {
+			break;
+		}
+
+		for (int i = first; i < last; ++i) {
+			uint64_t block_start = i * block_size;
+			int block_raw_size = (int)__min(header->raw_size - block_start, block_size);
+			fs_block_job_t* job = &jobs[i - first_block];
+			job->op = k_fs_block_decompress;
+			job->verify = false;
+			job->dictionary = dictionary;
+			job->src = staging + (offsets[i] - offsets[first]);
+			job->src_size = (int)(offsets[i + 1] - offsets[i]);
+			job->dst_capacity = block_raw_size;
+			job->result = 0;
+			if (block_start >= offset && block_start + block_raw_size <= offset + size) {
+				job->dst = buffer + (block_start - offset);
+			} else {
+				// only the first and last blocks can be cut by the range
+				job->dst = edges + (i == first_block ? 0 : block_size);
+			}
+		}
+		*codec_ticks += fs_block_run(fs, jobs + (first - first_block), last - first);
+
+		for (int i = first; i < last && result == 0; ++i) {
+			fs_block_job_t* job = &jobs[i - first_block];
+			if (job->result != job->dst_capacity) {
+				result = -1;
+				break;
+			}
+			if (job->dst < buffer || job->dst >= buffer + size) {
+				uint64_t block_start = i * block_size;
+				uint64_t copy_start = __max(offset, block_start);
+				uint64_t copy_end = __min(offset + size, block_start + job->dst_capacity);
+				memcpy(buffer + (copy_start - offset), job->dst + (copy_start - block_start), (size_t)(copy_end - copy_start));
+			}
+		}
+		first = last;
+	}
+
+	heap_free(fs->heap, edges);
+	heap_free(fs->heap, staging);
+	heap_free(fs->heap, jobs);
+	return result;
+}
+
+// Read a block file of file_size bytes starting at base in chunks of whole frames.
+// The block threads decode each chunk while the next one is read into the other staging
+// buffer, so at most two chunks of compressed data are held at once.
+// With a direct_handle the chunks bypass the page cache and are staged in a direct pair.
+// The caller closes the handles.
+static void file_read_streamed(fs_t* fs, fs_work_t* work, HANDLE handle, HANDLE direct_handle, uint64_t base, uint64_t file_size) {
+	fs_block_header_t header;
+	uint64_t* offsets = fs_block_load_index(fs, handle, base, file_size, &header);
+	if (offsets == NULL) {
+		debug_print_line(k_print_error, "Compressed file %s is not a valid block file.\n", work->path);
+		file_read_failed(fs, work, -1);
+		return;
+	}
+	const fs_dictionary_t* dictionary = NULL;
+	if (!fs_block_find_dictionary(work, &header, &dictionary)) {
+		heap_free(fs->heap, offsets);
+		debug_print_line(k_print_error, "Compressed file %s needs a dictionary that is not mounted.\n", work->path);
+		file_read_failed(fs, work, -1);
+		return;
+	}
+	int block_count = (int)header.block_count;
+	// blocks are digested as they are decoded if they are the segments of the entry's digest
+	const fs_pack_entry_t* verify_entry = fs->verify ? work->pack_entry : NULL;
+	bool verify = verify_entry && header.block_size == k_fs_block_size;
+
+	size_t raw_size = (size_t)header.raw_size;
+	work->buffer = heap_alloc(work->heap, work->null_terminate ? raw_size + 1 : __max(raw_size, 1), 8);
+
+	fs_block_job_t* jobs = heap_alloc(fs->heap, sizeof(fs_block_job_t) * __max(block_count, 1), 8);
+	fs_direct_pair_t* pair = direct_handle != INVALID_HANDLE_VALUE ? fs_direct_acquire(fs) : NULL;
+	char* staging[2] = { NULL, NULL };
+	if (pair == NULL) {
+		size_t staging_size = (size_t)__max(__min(offsets[block_count] - offsets[0], k_fs_stream_chunk_size), 1);
+		staging[0] = heap_alloc(fs->heap, staging_size, 8);
+		staging[1] = heap_alloc(fs->heap, staging_size, 8);
+	}
+	fs_block_batch_t batches[2];
+	bool pending[2] = { false, false };
+	int slot = 0;
+	int result = 0;
+
+	for (int first = 0; first < block_count; ) {
+		int last = first + 1;
+		while (last < block_count && offsets[last + 1] - offsets[first] <= k_fs_stream_chunk_size) {
+			++last;
+		}
+
+		if (pending[slot]) {
+			work->codec_ticks += fs_block_wait(&batches[slot]);
+			pending[slot] = false;
+		}
+
+		TRACE_ZONE_BEGIN("fs_stream_read");
+		char* chunk = staging[slot];
+		size_t chunk_size = (size_t)(offsets[last] - offsets[first]);
+		if (pair) {
+			result = fs_direct_begin(direct_handle, pair, slot, base + offsets[first], chunk_size, &chunk);
+			if (result == 0) {
+				result = fs_direct_end(direct_handle, pair, slot, chunk, chunk_size);
+			}
+		} else {
+			result = fs_read_at(handle, base + offsets[first], chunk, (DWORD)chunk_size);
+		}
+		TRACE_ZONE_END();
+		if (result != 0) {
+			break;
+		}
+
+		for (int i = first; i < last; ++i) {
+			size_t offset = (size_t)i * header.block_size;
+			jobs[i].op = k_fs_block_decompress;
+			jobs[i].verify = verify;
+			jobs[i].dictionary = dictionary;
+			jobs[i].src = chunk + (offsets[i] - offsets[first]);
+			jobs[i].src_size = (int)(offsets[i + 1] - offsets[i]);
+			jobs[i].dst = work->buffer + offset;
+			jobs[i].dst_capacity = (int)__min(raw_size - offset, header.block_size);
+			jobs[i].result = 0;
+		}
+		fs_block_submit(fs, jobs + first, last - first, &batches[slot]);
+		pending[slot] = true;
+		slot ^= 1;
+		first = last;
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		if (pending[i]) {
+			work->codec_ticks += fs_block_wait(&batches[i]);
+		}
+	}
+
+	for (int i = 0; i < block_count && result == 0; ++i) {
+		if (jobs[i].result != jobs[i].dst_capacity) {
+			debug_print_line(k_print_error, "Compressed file %s has a corrupt block.\n", work->path);
+			result = -1;
+		}
+	}
+	if (result == 0 && verify_entry) {
+		uint64_t start = timer_get_ticks();
+		uint64_t digest = verify ? fs_digest_jobs(fs, jobs, block_count) : fs_digest_blocks(fs, work->buffer, raw_size);
+		work->codec_ticks += timer_get_ticks() - start;
+		if (digest != verify_entry->digest) {
+			debug_print_line(k_print_error, "Pack entry %s does not match its digest.\n", work->path);
+			result = -1;
+		}
+	}
+
+	if (pair) {
+		fs_direct_release(fs, pair);
+	} else {
+		heap_free(fs->heap, staging[1]);
+		heap_free(fs->heap, staging[0]);
+	}
+	heap_free(fs->heap, jobs);
+	heap_free(fs->heap, offsets);
+
+	if (result != 0) {
+		file_read_failed(fs, work, result);
+		return;
+	}
+
+	fs_large_read_release(fs, work);
+
+	if (work->null_terminate) {
+		work->buffer[raw_size] = 0;
+	}
+	work->size = raw_size;
+
+	fs_work_complete(work);
 }
 
 static int file_thread_func(void* user) {
 	fs_t* fs = user;
 	while (true) {
-		fs_work_t* work = queue_pop(fs->file_queue);
-		if (work == NULL){
-			break;
+		semaphore_acquire(fs->file_works_ready);
+		mutex_lock(fs->queue_mutex);
+		// parked large reads go first, they already waited for a slot
+		fs_work_t* work = fs_large_read_pop(fs);
+		if (work == NULL) {
+			work = fs_work_queue_pop(fs, &fs->file_works);
+		}
+		bool quit = fs->quit;
+		mutex_unlock(fs->queue_mutex);
+		if (work == NULL) {
+			// the wakeup of a cancelled work, or the queue is drained and the fs is going away
+			if (quit) {
+				break;
+			}
+			continue;
 		}
+		TRACE_ASYNC_END("fs_queue_wait", work->trace_id);
 
 		switch (work->op) {
 		case k_fs_work_op_read:
+			TRACE_ZONE_BEGIN("file_read");
+			TRACE_FLOW_STEP("fs_flow", work->trace_id);
 			file_read(fs, work);
+			TRACE_ZONE_END();
 			break;
 		case k_fs_work_op_write:
+			TRACE_ZONE_BEGIN("file_write");
+			TRACE_FLOW_STEP("fs_flow", work->trace_id);
 			file_write(work);
+			TRACE_ZONE_END();
+			break;
+		case k_fs_work_op_map:
+			TRACE_ZONE_BEGIN("file_map");
+			TRACE_FLOW_STEP("fs_flow", work->trace_id);
+			file_map(work);
+			TRACE_ZONE_END();
+			break;
+		case k_fs_work_op_read_ranges:
+			TRACE_ZONE_BEGIN("file_read_ranges");
+			TRACE_FLOW_STEP("fs_flow", work->trace_id);
+			file_read_ranges(fs, work);
+			TRACE_ZONE_END();
 			break;
 		}
 	}
 	return 0;
 }
 
+// Splits compressed writes into block jobs and waits for the block threads.
+// Compressed reads are streamed by the file threads instead, see file_read_streamed.
 static int compress_thread_func(void* user) {
 	fs_t* fs = user;
 	while (true) {
@@ -299,15 +1939,1140 @@ static int compress_thread_func(void* user) {
 		if (work == NULL) {
 			break;
 		}
+		TRACE_ASYNC_END("fs_compress_wait", work->trace_id);
 
-		switch (work->op) {
-		case k_fs_work_op_read:
-			file_read_compressed(work);
+		TRACE_ZONE_BEGIN("file_write_compressed");
+		TRACE_FLOW_STEP("fs_flow", work->trace_id);
+		file_write_compressed(fs, work);
+		TRACE_ZONE_END();
+	}
+	return 0;
+}
+
+static int block_thread_func(void* user) {
+	fs_t* fs = user;
+	LZ4F_cctx* cctx = NULL;
+	if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION))) {
+		debug_print_line(k_print_error, "Unable to create an LZ4 compression context.\n");
+		cctx = NULL;
+	}
+	LZ4F_dctx* dctx = NULL;
+	if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION))) {
+		debug_print_line(k_print_error, "Unable to create an LZ4 decompression context.\n");
+		dctx = NULL;
+	}
+	while (true) {
+		fs_block_job_t* job = queue_pop(fs->block_queue);
+		if (job == NULL) {
 			break;
-		case k_fs_work_op_write:
-			file_write_compressed(fs, work);
+		}
+
+		switch (job->op) {
+		case k_fs_block_compress:
+			TRACE_ZONE_BEGIN("fs_block_compress");
+			job->result = cctx ? fs_block_compress(cctx, job) : -1;
+			TRACE_ZONE_END();
+			break;
+		case k_fs_block_decompress:
+			TRACE_ZONE_BEGIN("fs_block_decompress");
+			job->result = dctx ? fs_block_decompress(dctx, job) : -1;
+			if (job->verify && job->result > 0) {
+				// the block is still in cache from being decoded
+				job->digest = XXH64(job->dst, job->result, 0);
+			}
+			TRACE_ZONE_END();
+			break;
+		case k_fs_block_digest:
+			TRACE_ZONE_BEGIN("fs_block_digest");
+			job->digest = XXH64(job->src, job->src_size, 0);
+			job->result = job->src_size;
+			TRACE_ZONE_END();
 			break;
 		}
+
+		// the last block of the batch wakes its waiter, the batch may be gone by the wake
+		// but waking an address nobody waits on does nothing
+		fs_block_batch_t* batch = job->batch;
+		if (atomic_decrement(&batch->remaining) == 1) {
+			atomic_wake_all(&batch->remaining);
+		}
 	}
+	LZ4F_freeCompressionContext(cctx);
+	LZ4F_freeDecompressionContext(dctx);
 	return 0;
-}
\ No newline at end of file
+}
+
+// Finish an overlapped read or write, result is 0 on success.
+static void io_finish(fs_t* fs, fs_work_t* work, int result) {
+	if (work->handle != INVALID_HANDLE_VALUE) {
+		CloseHandle(work->handle);
+		work->handle = INVALID_HANDLE_VALUE;
+	}
+
+	if (work->op == k_fs_work_op_read) {
+		if (result != 0) {
+			file_read_failed(fs, work, result);
+			return;
+		}
+		work->size = work->io_offset;
+		if (work->null_terminate) {
+			work->buffer[work->size] = 0;
+		}
+	} else {
+		// the paths only fail to convert when io_start already failed the write on them
+		wchar_t wide_path[1024];
+		wchar_t temp_path[1024];
+		if (fs_write_paths(work, wide_path, temp_path, _countof(wide_path))) {
+			result = fs_write_replace(wide_path, temp_path, result, false);
+		}
+		work->result = result;
+		if (result == 0 && !work->use_compression) {
+			work->size = work->io_offset;
+		}
+		if (work->use_compression) {
+			// free the buffer (we don't need the compressed buffer)
+			heap_free(work->heap, work->buffer);
+			work->buffer = NULL;
+		}
+	}
+	fs_work_complete(work);
+}
+
+// Start the next overlapped transfer of a work at io_offset.
+// Returns false if it could not be started, the completion port reports it otherwise,
+// even when it finishes right away.
+static bool io_issue(fs_work_t* work, size_t total_size) {
+	DWORD size = (DWORD)__min(total_size - work->io_offset, k_fs_io_max_size);
+	memset(&work->overlapped, 0, sizeof(work->overlapped));
+	work->overlapped.Offset = (DWORD)(work->io_offset & 0xffffffff);
+	work->overlapped.OffsetHigh = (DWORD)((uint64_t)work->io_offset >> 32);
+
+	BOOL started = work->op == k_fs_work_op_read
+		? ReadFile(work->handle, work->buffer + work->io_offset, size, NULL, &work->overlapped)
+		: WriteFile(work->handle, work->buffer + work->io_offset, size, NULL, &work->overlapped);
+	return started || GetLastError() == ERROR_IO_PENDING;
+}
+
+// Bytes a work transfers in total.
+static size_t io_total_size(fs_work_t* work) {
+	if (work->op == k_fs_work_op_write && work->use_compression) {
+		return work->compressed_size;
+	}
+	return work->size;
+}
+
+// Open the work's file on the completion port and start its first transfer.
+// Returns false if the work already finished, true if a transfer is in flight.
+static bool io_start(fs_t* fs, fs_work_t* work) {
+	bool read = work->op == k_fs_work_op_read;
+	wchar_t wide_path[1024];
+	wchar_t temp_path[1024];
+	bool converted = read
+		? MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, _countof(wide_path)) > 0
+		: fs_write_paths(work, wide_path, temp_path, _countof(wide_path));
+	if (!converted) {
+		io_finish(fs, work, -1);
+		return false;
+	}
+
+	// writes go to the temporary path, io_finish renames it over the file
+	work->handle = CreateFile(read ? wide_path : temp_path, read ? GENERIC_READ : GENERIC_WRITE, read ? FILE_SHARE_READ : 0, NULL,
+		read ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+	if (work->handle == INVALID_HANDLE_VALUE) {
+		io_finish(fs, work, GetLastError());
+		return false;
+	}
+	if (CreateIoCompletionPort(work->handle, fs->completion_port, k_fs_io_key_file, 0) == NULL) {
+		io_finish(fs, work, GetLastError());
+		return false;
+	}
+
+	if (read) {
+		if (!GetFileSizeEx(work->handle, (PLARGE_INTEGER)&work->size)) {
+			io_finish(fs, work, GetLastError());
+			return false;
+		}
+		work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+	}
+
+	work->io_offset = 0;
+	if (io_total_size(work) == 0) {
+		io_finish(fs, work, 0);
+		return false;
+	}
+	if (!io_issue(work, io_total_size(work))) {
+		io_finish(fs, work, GetLastError());
+		return false;
+	}
+	return true;
+}
+
+// Account for a finished transfer and start the next one if the work has more to move.
+// Returns false once the work is finished.
+static bool io_continue(fs_t* fs, fs_work_t* work, DWORD bytes) {
+	DWORD transferred = 0;
+	if (!GetOverlappedResult(work->handle, &work->overlapped, &transferred, FALSE)) {
+		int result = GetLastError();
+		if (result != ERROR_HANDLE_EOF) {
+			io_finish(fs, work, result);
+			return false;
+		}
+		// the file shrank since its size was read
+		io_finish(fs, work, 0);
+		return false;
+	}
+
+	work->io_offset += bytes;
+	if (bytes == 0 || work->io_offset >= io_total_size(work)) {
+		io_finish(fs, work, 0);
+		return false;
+	}
+	if (!io_issue(work, io_total_size(work))) {
+		io_finish(fs, work, GetLastError());
+		return false;
+	}
+	return true;
+}
+
+// The only thread that touches the completion port's files.
+// Works past max_in_flight stay in io_works and start by priority as others finish.
+static int io_thread_func(void* user) {
+	fs_t* fs = user;
+	int in_flight = 0;
+	bool pending = false;
+	bool quit = false;
+
+	while (!quit || in_flight > 0 || pending) {
+		OVERLAPPED_ENTRY entries[64];
+		ULONG count = 0;
+		if (!GetQueuedCompletionStatusEx(fs->completion_port, entries, _countof(entries), &count, INFINITE, FALSE)) {
+			continue;
+		}
+
+		TRACE_ZONE_BEGIN("fs_io_completions");
+		for (ULONG i = 0; i < count; ++i) {
+			if (entries[i].lpCompletionKey == k_fs_io_key_quit) {
+				quit = true;
+				continue;
+			}
+			if (entries[i].lpCompletionKey == k_fs_io_key_submit) {
+				continue;
+			}
+
+			fs_work_t* work = (fs_work_t*)((char*)entries[i].lpOverlapped - offsetof(fs_work_t, overlapped));
+			if (!io_continue(fs, work, entries[i].dwNumberOfBytesTransferred)) {
+				--in_flight;
+			}
+		}
+
+		while (in_flight < fs->max_in_flight) {
+			mutex_lock(fs->queue_mutex);
+			fs_work_t* work = fs_work_queue_pop(fs, &fs->io_works);
+			mutex_unlock(fs->queue_mutex);
+			if (work == NULL) {
+				break;
+			}
+			TRACE_ASYNC_END("fs_queue_wait", work->trace_id);
+			TRACE_FLOW_STEP("fs_flow", work->trace_id);
+			if (io_start(fs, work)) {
+				++in_flight;
+			}
+		}
+		mutex_lock(fs->queue_mutex);
+		pending = fs->io_works.count > 0;
+		mutex_unlock(fs->queue_mutex);
+		TRACE_COUNTER("fs_io_in_flight", in_flight);
+		TRACE_ZONE_END();
+	}
+	return 0;
+}
+
+// Write every pending write-behind, or only those that are due, and wait for them.
+// The batch's writes are queued together so their flushes overlap on the file threads
+// instead of each write waiting for its own.
+static void fs_write_behind_run(fs_t* fs, bool all) {
+	mutex_lock(fs->write_behind_mutex);
+	mutex_lock(fs->queue_mutex);
+	uint64_t now = timer_get_ticks();
+	bool durable = fs->write_behind_durable;
+	fs_write_behind_t* batch = NULL;
+	fs_write_behind_t** batch_tail = &batch;
+	fs_write_behind_t** link = &fs->write_behinds;
+	while (*link) {
+		fs_write_behind_t* pending = *link;
+		if (all || pending->due <= now) {
+			*link = pending->next;
+			pending->next = NULL;
+			*batch_tail = pending;
+			batch_tail = &pending->next;
+		} else {
+			link = &pending->next;
+		}
+	}
+	mutex_unlock(fs->queue_mutex);
+
+	if (batch) {
+		TRACE_ZONE_BEGIN("fs_write_behind_run");
+		fs_work_t* works[64];
+		fs_write_behind_t* next = batch;
+		while (next) {
+			fs_write_behind_t* first = next;
+			int count = 0;
+			while (next && count < (int)_countof(works)) {
+				works[count++] = fs_write_flush(fs, next->path, next->buffer, next->size, next->compression_level, durable);
+				next = next->next;
+			}
+			for (int i = 0; i < count; ++i) {
+				fs_write_behind_t* pending = first;
+				first = first->next;
+				if (fs_work_get_result(works[i]) != 0) {
+					debug_print_line(k_print_error, "Unable to write %s behind, error %d.\n", pending->path, fs_work_get_result(works[i]));
+				}
+				fs_work_destroy(works[i]);
+				heap_free(fs->heap, pending->buffer);
+				heap_free(fs->heap, pending->path);
+				heap_free(fs->heap, pending);
+			}
+		}
+		TRACE_ZONE_END();
+	}
+	mutex_unlock(fs->write_behind_mutex);
+}
+
+static int write_behind_thread_func(void* user) {
+	fs_t* fs = user;
+	while (true) {
+		thread_sleep(k_fs_write_behind_poll_ms);
+		mutex_lock(fs->queue_mutex);
+		bool quit = fs->write_behind_quit;
+		mutex_unlock(fs->queue_mutex);
+		if (quit) {
+			break;
+		}
+		fs_write_behind_run(fs, false);
+	}
+	return 0;
+}
+
+// Hash of a path as stored in a pack, '\\' and '/' hash the same.
+static uint64_t fs_pack_hash(const char* path) {
+	char normalized[1024];
+	size_t length = 0;
+	while (path[length] && length < sizeof(normalized)) {
+		normalized[length] = path[length] == '\\' ? '/' : path[length];
+		++length;
+	}
+	return XXH64(normalized, length, 0);
+}
+
+// Find a path in the mounted packs, the most recent mount first.
+static const fs_pack_entry_t* fs_pack_find(fs_t* fs, const char* path, const fs_mount_t** mount) {
+	if (fs->mount_count == 0) {
+		return NULL;
+	}
+	uint64_t hash = fs_pack_hash(path);
+	for (int i = fs->mount_count - 1; i >= 0; --i) {
+		const fs_mount_t* candidate = &fs->mounts[i];
+		uint32_t low = 0;
+		uint32_t high = candidate->entry_count;
+		while (low < high) {
+			uint32_t middle = low + (high - low) / 2;
+			if (candidate->entries[middle].hash < hash) {
+				low = middle + 1;
+			} else {
+				high = middle;
+			}
+		}
+		if (low < candidate->entry_count && candidate->entries[low].hash == hash) {
+			*mount = candidate;
+			return &candidate->entries[low];
+		}
+	}
+	return NULL;
+}
+
+// Read an uncompressed pack entry into the work's buffer a chunk at a time and check it
+// against the entry's digest. The block threads digest each chunk while the next is read.
+// Returns 0 on success or an error code.
+static int fs_read_verified(fs_t* fs, fs_work_t* work, HANDLE handle, HANDLE direct_handle, uint64_t base, size_t size) {
+	int segment_count = (int)((size + k_fs_block_size - 1) / k_fs_block_size);
+	fs_block_job_t* jobs = heap_alloc(fs->heap, sizeof(fs_block_job_t) * __max(segment_count, 1), 8);
+	fs_block_batch_t batches[2];
+	bool pending[2] = { false, false };
+	int slot = 0;
+	int result = 0;
+
+	// chunks are whole segments, k_fs_stream_chunk_size is a multiple of k_fs_block_size
+	for (size_t offset = 0; offset < size && result == 0; offset += k_fs_stream_chunk_size) {
+		size_t chunk_size = __min(size - offset, k_fs_stream_chunk_size);
+		TRACE_ZONE_BEGIN("fs_verified_read");
+		result = fs_read_direct_at(fs, handle, direct_handle, base + offset, chunk_size, work->buffer + offset);
+		TRACE_ZONE_END();
+		if (result != 0) {
+			break;
+		}
+		if (pending[slot]) {
+			work->codec_ticks += fs_block_wait(&batches[slot]);
+		}
+		fs_digest_submit(fs, jobs, work->buffer + offset, offset, chunk_size, &batches[slot]);
+		pending[slot] = true;
+		slot ^= 1;
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		if (pending[i]) {
+			work->codec_ticks += fs_block_wait(&batches[i]);
+		}
+	}
+	if (result == 0 && fs_digest_jobs(fs, jobs, segment_count) != work->pack_entry->digest) {
+		debug_print_line(k_print_error, "Pack entry %s does not match its digest.\n", work->path);
+		result = -1;
+	}
+	heap_free(fs->heap, jobs);
+	return result;
+}
+
+// Read an entry of a mounted pack, decompressing it if it was packed compressed.
+// Direct reads are of the work's choosing or of large entries of a mount in direct mode.
+static void file_read_packed(fs_t* fs, fs_work_t* work) {
+	const fs_pack_entry_t* entry = work->pack_entry;
+	const fs_mount_t* mount = work->pack_mount;
+	bool direct = work->direct || (mount->direct && entry->size >= k_fs_large_read_size);
+	HANDLE direct_handle = direct ? mount->direct_handle : INVALID_HANDLE_VALUE;
+	if (entry->flags & k_fs_pack_entry_compressed) {
+		file_read_streamed(fs, work, mount->handle, direct_handle, entry->offset, entry->size);
+		return;
+	}
+
+	size_t size = (size_t)entry->size;
+	work->buffer = heap_alloc(work->heap, work->null_terminate ? size + 1 : __max(size, 1), 8);
+	int result = fs->verify
+		? fs_read_verified(fs, work, mount->handle, direct_handle, entry->offset, size)
+		: fs_read_direct_at(fs, mount->handle, direct_handle, entry->offset, size, work->buffer);
+	if (result != 0) {
+		file_read_failed(fs, work, result);
+		return;
+	}
+
+	if (work->null_terminate) {
+		work->buffer[size] = 0;
+	}
+	work->size = size;
+
+	fs_work_complete(work);
+}
+
+// Id of a dictionary's contents, never 0 as that means no dictionary.
+static uint32_t fs_dictionary_id(const char* data, int size) {
+	return (uint32_t)XXH64(data, size, 0) | 1;
+}
+
+// Mount a pack as fs_mount does, with direct its large entries are read with direct I/O.
+static bool fs_mount_mode(fs_t* fs, const char* pack_path, bool direct) {
+	if (fs->mount_count == k_fs_max_mounts) {
+		debug_print_line(k_print_error, "Unable to mount %s, %d packs are already mounted.\n", pack_path, k_fs_max_mounts);
+		return false;
+	}
+
+	wchar_t wide_path[1024];
+	if (MultiByteToWideChar(CP_UTF8, 0, pack_path, -1, wide_path, _countof(wide_path)) <= 0) {
+		return false;
+	}
+
+	HANDLE handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) {
+		debug_print_line(k_print_error, "Unable to open pack %s.\n", pack_path);
+		return false;
+	}
+
+	LARGE_INTEGER file_size;
+	fs_pack_header_t header;
+	if (!GetFileSizeEx(handle, &file_size) || fs_read_at(handle, 0, &header, sizeof(header)) != 0
+		|| header.magic != k_fs_pack_magic || header.version != k_fs_pack_version
+		|| header.toc_offset + (uint64_t)header.entry_count * sizeof(fs_pack_entry_t) != (uint64_t)file_size.QuadPart) {
+		debug_print_line(k_print_error, "%s is not a valid pack.\n", pack_path);
+		CloseHandle(handle);
+		return false;
+	}
+
+	size_t toc_size = (size_t)header.entry_count * sizeof(fs_pack_entry_t);
+	fs_pack_entry_t* entries = heap_alloc(fs->heap, __max(toc_size, 1), 8);
+	bool valid = toc_size == 0 || fs_read_at(handle, header.toc_offset, entries, toc_size) == 0;
+	for (uint32_t i = 0; valid && i < header.entry_count; ++i) {
+		valid = entries[i].offset + entries[i].size <= header.toc_offset
+			&& (i == 0 || entries[i - 1].hash < entries[i].hash);
+	}
+	if (!valid) {
+		debug_print_line(k_print_error, "Pack %s has a bad table of contents.\n", pack_path);
+		heap_free(fs->heap, entries);
+		CloseHandle(handle);
+		return false;
+	}
+
+	fs_dictionary_t dictionary = { NULL, 0, 0, NULL };
+	if (header.dictionary_size > 0) {
+		dictionary.data = heap_alloc(fs->heap, header.dictionary_size, 8);
+		dictionary.size = header.dictionary_size;
+		dictionary.id = header.dictionary_id;
+		if (header.dictionary_size > k_fs_max_dictionary_size
+			|| header.dictionary_offset + header.dictionary_size > header.toc_offset
+			|| fs_read_at(handle, header.dictionary_offset, dictionary.data, header.dictionary_size) != 0
+			|| fs_dictionary_id(dictionary.data, dictionary.size) != dictionary.id) {
+			debug_print_line(k_print_error, "Pack %s has a bad dictionary.\n", pack_path);
+			heap_free(fs->heap, dictionary.data);
+			heap_free(fs->heap, entries);
+			CloseHandle(handle);
+			return false;
+		}
+	}
+
+	// a second handle, a buffered one is still needed for reads that are not sector aligned
+	HANDLE direct_handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, NULL);
+	if (direct && direct_handle == INVALID_HANDLE_VALUE) {
+		debug_print_line(k_print_warning, "Pack %s can't be read with direct I/O, reading it buffered.\n", pack_path);
+	}
+
+	fs_mount_t* mount = &fs->mounts[fs->mount_count++];
+	mount->handle = handle;
+	mount->direct_handle = direct_handle;
+	mount->direct = direct;
+	mount->entries = entries;
+	mount->entry_count = header.entry_count;
+	mount->dictionary = dictionary;
+	return true;
+}
+
+bool fs_mount(fs_t* fs, const char* pack_path) {
+	return fs_mount_mode(fs, pack_path, false);
+}
+
+void fs_set_verify(fs_t* fs, bool verify) {
+	fs->verify = verify;
+}
+
+bool fs_mount_direct(fs_t* fs, const char* pack_path) {
+	return fs_mount_mode(fs, pack_path, true);
+}
+
+// A file found by the packer.
+typedef struct fs_pack_file_t {
+	char path[1024]; // relative to the packed directory
+	uint64_t hash;
+} fs_pack_file_t;
+
+typedef struct fs_pack_file_list_t {
+	heap_t* heap;
+	fs_pack_file_t* files;
+	int count;
+	int capacity;
+} fs_pack_file_list_t;
+
+// Add every file under directory/relative to the list.
+static void fs_pack_list_files(fs_pack_file_list_t* list, const char* directory, const char* relative) {
+	char pattern[2048];
+	if (relative[0]) {
+		snprintf(pattern, sizeof(pattern), "%s/%s/*", directory, relative);
+	} else {
+		snprintf(pattern, sizeof(pattern), "%s/*", directory);
+	}
+
+	WIN32_FIND_DATAA find_data;
+	HANDLE find = FindFirstFileA(pattern, &find_data);
+	if (find == INVALID_HANDLE_VALUE) {
+		return;
+	}
+	do {
+		if (strcmp(find_data.cFileName, ".") == 0 || strcmp(find_data.cFileName, "..") == 0) {
+			continue;
+		}
+		char path[1024];
+		if (relative[0]) {
+			snprintf(path, sizeof(path), "%s/%s", relative, find_data.cFileName);
+		} else {
+			snprintf(path, sizeof(path), "%s", find_data.cFileName);
+		}
+		if (find_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			fs_pack_list_files(list, directory, path);
+			continue;
+		}
+
+		if (list->count == list->capacity) {
+			int capacity = __max(list->capacity * 2, 64);
+			fs_pack_file_t* files = heap_alloc(list->heap, sizeof(fs_pack_file_t) * capacity, 8);
+			if (list->files) {
+				memcpy(files, list->files, sizeof(fs_pack_file_t) * list->count);
+				heap_free(list->heap, list->files);
+			}
+			list->files = files;
+			list->capacity = capacity;
+		}
+		fs_pack_file_t* file = &list->files[list->count++];
+		strcpy_s(file->path, sizeof(file->path), path);
+		file->hash = fs_pack_hash(path);
+	} while (FindNextFileA(find, &find_data));
+	FindClose(find);
+}
+
+static int fs_pack_file_compare(const void* a, const void* b) {
+	uint64_t hash_a = ((const fs_pack_file_t*)a)->hash;
+	uint64_t hash_b = ((const fs_pack_file_t*)b)->hash;
+	return hash_a < hash_b ? -1 : hash_a > hash_b;
+}
+
+// Write size bytes at offset of a file opened for writing, returns false on failure.
+// Sizes past what one WriteFile call can transfer are written in several calls.
+static bool fs_pack_write_at(HANDLE handle, uint64_t offset, const void* buffer, size_t size) {
+	for (size_t done = 0; done < size; ) {
+		OVERLAPPED overlapped;
+		memset(&overlapped, 0, sizeof(overlapped));
+		overlapped.Offset = (DWORD)((offset + done) & 0xffffffff);
+		overlapped.OffsetHigh = (DWORD)((offset + done) >> 32);
+		DWORD chunk = (DWORD)__min(size - done, k_fs_io_max_size);
+		DWORD bytes_written = 0;
+		if (!WriteFile(handle, (const char*)buffer + done, chunk, &bytes_written, &overlapped) || bytes_written != chunk) {
+			return false;
+		}
+		done += chunk;
+	}
+	return true;
+}
+
+// Totals for the files of one extension in a pack.
+// Decode time is only counted for entries stored compressed, decoded_size is their raw size.
+typedef struct fs_pack_class_t {
+	char extension[16];
+	int count;
+	uint64_t raw_size;
+	uint64_t stored_size;
+	uint64_t decoded_size;
+	uint64_t decode_ticks;
+} fs_pack_class_t;
+
+// Find or add the class of a path's extension, the last class takes every extension past the limit.
+static fs_pack_class_t* fs_pack_find_class(fs_pack_class_t* classes, int* class_count, const char* path) {
+	const char* name = strrchr(path, '/');
+	const char* extension = strrchr(name ? name : path, '.');
+	extension = extension ? extension + 1 : "";
+	for (int i = 0; i < *class_count; ++i) {
+		if (strcmp(classes[i].extension, extension) == 0) {
+			return &classes[i];
+		}
+	}
+	// the last slot is kept for every extension past the others, real classes never share it
+	if (*class_count == k_fs_pack_max_classes) {
+		return &classes[k_fs_pack_max_classes - 1];
+	}
+	fs_pack_class_t* added = &classes[(*class_count)++];
+	memset(added, 0, sizeof(fs_pack_class_t));
+	if (*class_count == k_fs_pack_max_classes) {
+		strcpy_s(added->extension, sizeof(added->extension), "other");
+	} else {
+		strncpy_s(added->extension, sizeof(added->extension), extension, _TRUNCATE);
+	}
+	return added;
+}
+
+// Print the compression ratio and decode speed of each class.
+static void fs_pack_report(const fs_pack_class_t* classes, int class_count, int compression_level, bool dictionary) {
+	debug_print_line(k_print_info, "Pack report, level %d, %s dictionary:\n", compression_level, dictionary ? "with" : "no");
+	for (int i = 0; i < class_count; ++i) {
+		const fs_pack_class_t* c = &classes[i];
+		double ratio = c->stored_size ? (double)c->raw_size / (double)c->stored_size : 1.0;
+		uint64_t decode_us = timer_ticks_to_us(c->decode_ticks);
+		if (c->decoded_size > 0) {
+			debug_print_line(k_print_info, "  %-8s %6d files %12llu -> %12llu bytes, ratio %5.2f, decode %8.1f MB/s\n",
+				c->extension[0] ? c->extension : "(none)", c->count, c->raw_size, c->stored_size, ratio,
+				(double)c->decoded_size / (double)__max(decode_us, 1));
+		} else {
+			debug_print_line(k_print_info, "  %-8s %6d files %12llu -> %12llu bytes, ratio %5.2f, stored raw\n",
+				c->extension[0] ? c->extension : "(none)", c->count, c->raw_size, c->stored_size, ratio);
+		}
+	}
+}
+
+// Load the dictionary file at path for packing, keeping its last k_fs_max_dictionary_size bytes.
+static bool fs_pack_load_dictionary(fs_t* fs, const char* path, fs_dictionary_t* dictionary) {
+	fs_work_t* work = fs_read(fs, path, fs->heap, false, false);
+	int result = fs_work_get_result(work);
+	char* data = fs_work_get_buffer(work);
+	size_t size = fs_work_get_size(work);
+	fs_work_destroy(work);
+	if (result != 0 || size == 0) {
+		if (data) {
+			heap_free(fs->heap, data);
+		}
+		return false;
+	}
+
+	dictionary->size = (int)__min(size, k_fs_max_dictionary_size);
+	dictionary->data = heap_alloc(fs->heap, dictionary->size, 8);
+	memcpy(dictionary->data, data + (size - dictionary->size), dictionary->size);
+	heap_free(fs->heap, data);
+	dictionary->id = fs_dictionary_id(dictionary->data, dictionary->size);
+	dictionary->cdict = LZ4F_createCDict(dictionary->data, dictionary->size);
+	if (dictionary->cdict == NULL) {
+		heap_free(fs->heap, dictionary->data);
+		dictionary->data = NULL;
+		return false;
+	}
+	return true;
+}
+
+bool fs_pack(fs_t* fs, const char* directory, const char* pack_path, int compression_level, const char* dictionary_path) {
+	fs_dictionary_t dictionary = { NULL, 0, 0, NULL };
+	if (dictionary_path && !fs_pack_load_dictionary(fs, dictionary_path, &dictionary)) {
+		debug_print_line(k_print_error, "Unable to load dictionary %s for packing.\n", dictionary_path);
+		return false;
+	}
+
+	fs_pack_file_list_t list = { fs->heap, NULL, 0, 0 };
+	fs_pack_list_files(&list, directory, "");
+	if (list.count > 0) {
+		qsort(list.files, list.count, sizeof(fs_pack_file_t), fs_pack_file_compare);
+	}
+	bool succeeded = true;
+	for (int i = 1; i < list.count && succeeded; ++i) {
+		if (list.files[i - 1].hash == list.files[i].hash) {
+			debug_print_line(k_print_error, "Unable to pack %s, %s and %s have the same hash.\n",
+				directory, list.files[i - 1].path, list.files[i].path);
+			succeeded = false;
+		}
+	}
+
+	wchar_t wide_path[1024];
+	HANDLE pack = INVALID_HANDLE_VALUE;
+	if (succeeded && MultiByteToWideChar(CP_UTF8, 0, pack_path, -1, wide_path, _countof(wide_path)) > 0) {
+		pack = CreateFile(wide_path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (pack == INVALID_HANDLE_VALUE) {
+			debug_print_line(k_print_error, "Unable to create pack %s.\n", pack_path);
+		}
+	}
+	if (pack == INVALID_HANDLE_VALUE) {
+		if (dictionary.data) {
+			LZ4F_freeCDict(dictionary.cdict);
+			heap_free(fs->heap, dictionary.data);
+		}
+		if (list.files) {
+			heap_free(fs->heap, list.files);
+		}
+		return false;
+	}
+
+	// the dictionary takes the first aligned slot, the entries follow it
+	uint64_t offset = k_fs_pack_alignment;
+	uint64_t dictionary_offset = 0;
+	if (dictionary.data) {
+		dictionary_offset = offset;
+		succeeded = fs_pack_write_at(pack, dictionary_offset, dictionary.data, dictionary.size);
+		offset = (offset + dictionary.size + k_fs_pack_alignment - 1) & ~(uint64_t)(k_fs_pack_alignment - 1);
+	}
+
+	fs_pack_entry_t* entries = heap_alloc(fs->heap, sizeof(fs_pack_entry_t) * __max(list.count, 1), 8);
+	fs_pack_class_t* classes = heap_alloc(fs->heap, sizeof(fs_pack_class_t) * k_fs_pack_max_classes, 8);
+	int class_count = 0;
+	size_t raw_total = 0;
+	size_t packed_total = 0;
+	for (int i = 0; i < list.count && succeeded; ++i) {
+		char path[2048];
+		snprintf(path, sizeof(path), "%s/%s", directory, list.files[i].path);
+
+		// reads go through the file threads, the pack is not mounted so they come from disk
+		fs_work_t* work = fs_read(fs, path, fs->heap, false, false);
+		int result = fs_work_get_result(work);
+		char* data = fs_work_get_buffer(work);
+		size_t size = fs_work_get_size(work);
+		fs_work_destroy(work);
+		if (result != 0) {
+			debug_print_line(k_print_error, "Unable to read %s for packing.\n", path);
+			succeeded = false;
+			break;
+		}
+
+		fs_pack_entry_t* entry = &entries[i];
+		entry->hash = list.files[i].hash;
+		entry->offset = offset;
+		entry->size = size;
+		entry->raw_size = size;
+		entry->flags = 0;
+		entry->reserved = 0;
+		entry->digest = fs_digest_blocks(fs, data, size);
+
+		// keep the compressed copy only if it is smaller
+		fs_pack_class_t* file_class = fs_pack_find_class(classes, &class_count, list.files[i].path);
+		char* stored = data;
+		if (compression_level != k_fs_compression_none && size > 0) {
+			size_t compressed_size = 0;
+			char* compressed = fs_compress_blocks(fs, fs->heap, data, size, compression_level,
+				dictionary.data ? &dictionary : NULL, &compressed_size);
+			if (compressed && compressed_size < size) {
+				stored = compressed;
+				entry->size = compressed_size;
+				entry->flags |= k_fs_pack_entry_compressed;
+			} else if (compressed) {
+				heap_free(fs->heap, compressed);
+			}
+		}
+
+		if (stored != data) {
+			// time a decode as a load would do it, which also checks the entry round trips
+			char* decoded = heap_alloc(fs->heap, size, 8);
+			uint64_t start = timer_get_ticks();
+			bool decoded_ok = fs_decompress_blocks(fs, stored, (size_t)entry->size, decoded, dictionary.data ? &dictionary : NULL);
+			file_class->decode_ticks += timer_get_ticks() - start;
+			file_class->decoded_size += size;
+			if (!decoded_ok || memcmp(decoded, data, size) != 0) {
+				debug_print_line(k_print_error, "Packed %s does not decode to its contents.\n", path);
+				succeeded = false;
+			}
+			heap_free(fs->heap, decoded);
+		}
+		++file_class->count;
+		file_class->raw_size += entry->raw_size;
+		file_class->stored_size += entry->size;
+
+		succeeded = succeeded && (entry->size == 0 || fs_pack_write_at(pack, entry->offset, stored, (size_t)entry->size));
+		if (stored != data) {
+			heap_free(fs->heap, stored);
+		}
+		heap_free(fs->heap, data);
+
+		raw_total += entry->raw_size;
+		packed_total += entry->size;
+		offset = (entry->offset + entry->size + k_fs_pack_alignment - 1) & ~(uint64_t)(k_fs_pack_alignment - 1);
+	}
+
+	fs_pack_header_t header = { k_fs_pack_magic, k_fs_pack_version, list.count, k_fs_pack_alignment, offset,
+		dictionary_offset, dictionary.size, dictionary.id };
+	succeeded = succeeded
+		&& (list.count == 0 || fs_pack_write_at(pack, offset, entries, sizeof(fs_pack_entry_t) * list.count))
+		&& fs_pack_write_at(pack, 0, &header, sizeof(header));
+	CloseHandle(pack);
+
+	if (succeeded) {
+		debug_print_line(k_print_info, "Packed %d files from %s into %s, %zu bytes stored as %zu.\n",
+			list.count, directory, pack_path, raw_total, packed_total);
+		fs_pack_report(classes, class_count, compression_level, dictionary.data != NULL);
+	} else {
+		debug_print_line(k_print_error, "Unable to write pack %s.\n", pack_path);
+		DeleteFile(wide_path);
+	}
+
+	heap_free(fs->heap, classes);
+	heap_free(fs->heap, entries);
+	if (list.files) {
+		heap_free(fs->heap, list.files);
+	}
+	if (dictionary.data) {
+		LZ4F_freeCDict(dictionary.cdict);
+		heap_free(fs->heap, dictionary.data);
+	}
+	return succeeded;
+}
+
+// Read each of a work's ranges into the caller's memory.
+// Ranges are offsets into the file, or into a pack entry's data once it is decompressed.
+static void file_read_ranges(fs_t* fs, fs_work_t* work) {
+	HANDLE handle = INVALID_HANDLE_VALUE;
+	uint64_t base = 0;
+	uint64_t limit = 0;
+	if (work->pack_entry) {
+		handle = work->pack_mount->handle;
+		base = work->pack_entry->offset;
+		limit = work->pack_entry->size;
+	} else {
+		wchar_t wide_path[1024];
+		if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, _countof(wide_path)) <= 0) {
+			work->result = -1;
+			fs_work_complete(work);
+			return;
+		}
+		handle = CreateFile(wide_path, GENERIC_READ, FILE_SHARE_READ, NULL,
+			OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (handle == INVALID_HANDLE_VALUE) {
+			work->result = GetLastError();
+			fs_work_complete(work);
+			return;
+		}
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(handle, &file_size)) {
+			work->result = GetLastError();
+			CloseHandle(handle);
+			fs_work_complete(work);
+			return;
+		}
+		limit = file_size.QuadPart;
+	}
+
+	// compressed pack entries decode only the blocks the ranges touch
+	fs_block_header_t header;
+	uint64_t* offsets = NULL;
+	const fs_dictionary_t* dictionary = NULL;
+	if (work->pack_entry && (work->pack_entry->flags & k_fs_pack_entry_compressed)) {
+		offsets = fs_block_load_index(fs, handle, base, limit, &header);
+		if (offsets == NULL || !fs_block_find_dictionary(work, &header, &dictionary)) {
+			debug_print_line(k_print_error, "Packed file %s is not a valid block file.\n", work->path);
+			work->result = -1;
+		}
+	}
+
+	size_t total = 0;
+	for (int i = 0; i < work->range_count && work->result == 0; ++i) {
+		const fs_range_t* range = &work->ranges[i];
+		if (offsets) {
+			work->result = fs_block_read_range(fs, handle, base, &header, offsets, dictionary,
+				range->offset, range->size, range->buffer, &work->codec_ticks);
+		} else if (range->offset + range->size > limit) {
+			work->result = ERROR_HANDLE_EOF;
+		} else {
+			work->result = fs_read_at(handle, base + range->offset, range->buffer, range->size);
+		}
+		total += range->size;
+	}
+	work->size = work->result == 0 ? total : 0;
+
+	if (offsets) {
+		heap_free(fs->heap, offsets);
+	}
+	if (!work->pack_entry) {
+		CloseHandle(handle);
+	}
+	fs_work_complete(work);
+}
+
+// Add a request to a manifest, called with the queue mutex held or before other threads use it.
+static fs_manifest_entry_t* fs_manifest_add(fs_t* fs, fs_manifest_t* manifest, fs_manifest_kind_t kind, bool flag,
+	uint64_t offset, uint64_t size, const char* path) {
+	if (manifest->count == manifest->capacity) {
+		int capacity = __max(manifest->capacity * 2, 64);
+		fs_manifest_entry_t* entries = heap_alloc(fs->heap, sizeof(fs_manifest_entry_t) * capacity, 8);
+		if (manifest->entries) {
+			memcpy(entries, manifest->entries, sizeof(fs_manifest_entry_t) * manifest->count);
+			heap_free(fs->heap, manifest->entries);
+		}
+		manifest->entries = entries;
+		manifest->capacity = capacity;
+	}
+	fs_manifest_entry_t* entry = &manifest->entries[manifest->count++];
+	memset(entry, 0, sizeof(fs_manifest_entry_t));
+	entry->kind = kind;
+	entry->flag = flag;
+	entry->offset = offset;
+	entry->size = size;
+	size_t length = strlen(path);
+	entry->path = heap_alloc(fs->heap, length + 1, 8);
+	memcpy(entry->path, path, length + 1);
+	return entry;
+}
+
+static void fs_manifest_free(fs_t* fs, fs_manifest_t* manifest) {
+	for (int i = 0; i < manifest->count; ++i) {
+		heap_free(fs->heap, manifest->entries[i].path);
+	}
+	if (manifest->entries) {
+		heap_free(fs->heap, manifest->entries);
+	}
+	memset(manifest, 0, sizeof(fs_manifest_t));
+}
+
+static bool fs_manifest_entry_matches(const fs_manifest_entry_t* entry, fs_manifest_kind_t kind, bool flag,
+	uint64_t offset, uint64_t size, const char* path) {
+	// any map of a file can share a mapping, prefetched or not
+	return entry->kind == kind && (entry->flag == flag || kind == k_fs_manifest_map)
+		&& entry->offset == offset && entry->size == size && strcmp(entry->path, path) == 0;
+}
+
+// Add a request to the manifest being recorded, once, while the recording lasts.
+static void fs_record_request(fs_t* fs, fs_manifest_kind_t kind, bool flag, uint64_t offset, uint64_t size, const char* path) {
+	mutex_lock(fs->queue_mutex);
+	if (fs->record_end && timer_get_ticks() < fs->record_end) {
+		bool recorded = false;
+		for (int i = 0; i < fs->records.count && !recorded; ++i) {
+			recorded = fs_manifest_entry_matches(&fs->records.entries[i], kind, flag, offset, size, path);
+		}
+		if (!recorded) {
+			fs_manifest_add(fs, &fs->records, kind, flag, offset, size, path);
+		}
+	}
+	mutex_unlock(fs->queue_mutex);
+}
+
+// Hand over the prefetch of a matching manifest request, NULL if there is none the caller can use.
+// A prefetch still queued becomes the caller's request, with its heap or buffer and priority.
+// One already started is only handed over if its result can be used as is, else the caller
+// reads the file again, from the page cache by then.
+static fs_work_t* fs_prefetch_claim(fs_t* fs, fs_manifest_kind_t kind, bool flag, uint64_t offset, uint64_t size,
+	const char* path, heap_t* heap, void* buffer, fs_priority_t priority, uint64_t deadline) {
+	fs_work_t* claimed = NULL;
+	void* unused_buffer = NULL;
+	mutex_lock(fs->queue_mutex);
+	for (int i = 0; i < fs->prefetches.count; ++i) {
+		fs_manifest_entry_t* entry = &fs->prefetches.entries[i];
+		if (entry->work == NULL || !fs_manifest_entry_matches(entry, kind, flag, offset, size, path)) {
+			continue;
+		}
+		fs_work_t* work = entry->work;
+		if (work->queue) {
+			fs_work_queue_t* queue = work->queue;
+			fs_work_queue_remove(queue, work);
+			if (kind == k_fs_manifest_read) {
+				work->heap = heap;
+			} else if (kind == k_fs_manifest_range) {
+				work->ranges[0].buffer = buffer;
+				unused_buffer = entry->buffer;
+				entry->buffer = NULL;
+			}
+			work->priority = priority >= 0 && priority < k_fs_priority_count ? priority : k_fs_priority_normal;
+			work->deadline = deadline;
+			fs_work_queue_insert(queue, work);
+			claimed = work;
+		} else if (kind == k_fs_manifest_map || (kind == k_fs_manifest_read && heap == fs->heap)) {
+			claimed = work;
+		}
+		if (claimed) {
+			entry->work = NULL;
+		}
+		break;
+	}
+	mutex_unlock(fs->queue_mutex);
+
+	if (unused_buffer) {
+		heap_free(fs->heap, unused_buffer);
+	}
+	return claimed;
+}
+
+bool fs_prefetch_manifest(fs_t* fs, const char* manifest_path) {
+	// a second manifest replaces the first
+	fs_prefetch_release(fs);
+
+	fs_work_t* manifest_work = fs_read(fs, manifest_path, fs->heap, true, false);
+	char* text = fs_work_get_result(manifest_work) == 0 ? fs_work_get_buffer(manifest_work) : NULL;
+	fs_work_destroy(manifest_work);
+	if (text == NULL) {
+		return false;
+	}
+
+	TRACE_ZONE_BEGIN("fs_prefetch_manifest");
+	fs_manifest_t prefetches = { NULL, 0, 0 };
+	for (char* line = text; line && *line; ) {
+		char* next = strchr(line, '\n');
+		if (next) {
+			*next++ = 0;
+		}
+		size_t length = strlen(line);
+		if (length > 0 && line[length - 1] == '\r') {
+			line[length - 1] = 0;
+		}
+
+		char kind[8];
+		int consumed = 0;
+		int flag = 0;
+		unsigned long long offset = 0;
+		unsigned long long size = 0;
+		if (sscanf(line, "%7s %n", kind, &consumed) == 1) {
+			const char* rest = line + consumed;
+			int path_start = 0;
+			if (strcmp(kind, "read") == 0 && sscanf(rest, "%d %n", &flag, &path_start) == 1 && rest[path_start]) {
+				fs_manifest_entry_t* entry = fs_manifest_add(fs, &prefetches, k_fs_manifest_read, flag != 0, 0, 0, rest + path_start);
+				entry->work = fs_read_priority(fs, entry->path, fs->heap, true, entry->flag, k_fs_priority_prefetch, 0);
+			} else if (strcmp(kind, "range") == 0 && sscanf(rest, "%llu %llu %n", &offset, &size, &path_start) == 2 && rest[path_start]) {
+				fs_manifest_entry_t* entry = fs_manifest_add(fs, &prefetches, k_fs_manifest_range, false, offset, size, rest + path_start);
+				entry->buffer = heap_alloc(fs->heap, __max((size_t)size, 1), 8);
+				fs_range_t range = { offset, (size_t)size, entry->buffer };
+				entry->work = fs_read_ranges_priority(fs, entry->path, &range, 1, k_fs_priority_prefetch, 0);
+			} else if (strcmp(kind, "map") == 0 && sscanf(rest, "%d %n", &flag, &path_start) == 1 && rest[path_start]) {
+				fs_manifest_entry_t* entry = fs_manifest_add(fs, &prefetches, k_fs_manifest_map, flag != 0, 0, 0, rest + path_start);
+				entry->work = fs_map(fs, entry->path, entry->flag);
+			}
+		}
+		line = next;
+	}
+	heap_free(fs->heap, text);
+
+	// published last so the prefetches above don't claim each other
+	mutex_lock(fs->queue_mutex);
+	fs->prefetches = prefetches;
+	mutex_unlock(fs->queue_mutex);
+	debug_print_line(k_print_info, "Prefetching %d requests from %s.\n", prefetches.count, manifest_path);
+	TRACE_ZONE_END();
+	return true;
+}
+
+void fs_prefetch_release(fs_t* fs) {
+	mutex_lock(fs->queue_mutex);
+	fs_manifest_t prefetches = fs->prefetches;
+	memset(&fs->prefetches, 0, sizeof(fs_manifest_t));
+	mutex_unlock(fs->queue_mutex);
+
+	int unclaimed = 0;
+	for (int i = 0; i < prefetches.count; ++i) {
+		fs_manifest_entry_t* entry = &prefetches.entries[i];
+		if (entry->work == NULL) {
+			continue;
+		}
+		++unclaimed;
+		// nothing asked for it this run, don't read it if it has not started
+		fs_work_cancel(entry->work);
+		if (entry->kind == k_fs_manifest_read && fs_work_get_result(entry->work) == 0 && fs_work_get_buffer(entry->work)) {
+			heap_free(fs->heap, fs_work_get_buffer(entry->work));
+		}
+		fs_work_destroy(entry->work);
+		if (entry->buffer) {
+			heap_free(fs->heap, entry->buffer);
+		}
+	}
+	if (prefetches.count > 0) {
+		debug_print_line(k_print_info, "%d of %d prefetched requests were claimed.\n",
+			prefetches.count - unclaimed, prefetches.count);
+	}
+	fs_manifest_free(fs, &prefetches);
+}
+
+void fs_record_manifest(fs_t* fs, const char* manifest_path, uint32_t duration_ms) {
+	size_t length = strlen(manifest_path);
+	char* record_path = heap_alloc(fs->heap, length + 1, 8);
+	memcpy(record_path, manifest_path, length + 1);
+
+	mutex_lock(fs->queue_mutex);
+	char* previous = fs->record_path;
+	fs->record_path = record_path;
+	fs->record_end = timer_get_ticks() + timer_get_ticks_per_second() * duration_ms / 1000;
+	mutex_unlock(fs->queue_mutex);
+	if (previous) {
+		heap_free(fs->heap, previous);
+	}
+}
+
+// Write the recorded requests to the record path, one per line in the order they were made.
+static void fs_manifest_write(fs_t* fs) {
+	size_t capacity = 64;
+	for (int i = 0; i < fs->records.count; ++i) {
+		capacity += strlen(fs->records.entries[i].path) + 64;
+	}
+	char* text = heap_alloc(fs->heap, capacity, 8);
+	size_t length = 0;
+	for (int i = 0; i < fs->records.count; ++i) {
+		const fs_manifest_entry_t* entry = &fs->records.entries[i];
+		switch (entry->kind) {
+		case k_fs_manifest_read:
+			length += snprintf(text + length, capacity - length, "read %d %s\n", entry->flag, entry->path);
+			break;
+		case k_fs_manifest_range:
+			length += snprintf(text + length, capacity - length, "range %llu %llu %s\n",
+				(unsigned long long)entry->offset, (unsigned long long)entry->size, entry->path);
+			break;
+		case k_fs_manifest_map:
+			length += snprintf(text + length, capacity - length, "map %d %s\n", entry->flag, entry->path);
+			break;
+		}
+	}
+
+	fs_work_t* work = fs_write(fs, fs->record_path, text, length, k_fs_compression_none);
+	if (fs_work_get_result(work) != 0) {
+		debug_print_line(k_print_warning, "Unable to write manifest %s.\n", fs->record_path);
+	}
+	fs_work_destroy(work);
+	heap_free(fs->heap, text);
+}
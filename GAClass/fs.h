@@ -2,6 +2,7 @@
 #define __FILESYS_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h> 
 
 // Asynchronous read/write file system.
@@ -14,10 +15,63 @@ typedef struct fs_work_t fs_work_t;
 
 typedef struct heap_t heap_t;
 
+// Order in which queued work is picked, most urgent first.
+// Work of one priority is picked by earliest deadline, work without a deadline goes last.
+typedef enum fs_priority_t {
+	// needed for the frame being built
+	k_fs_priority_critical,
+	k_fs_priority_high,
+	k_fs_priority_normal,
+	// speculative loads, picked only when nothing more urgent is waiting
+	k_fs_priority_prefetch,
+	k_fs_priority_count,
+} fs_priority_t;
+
+// Compression levels for fs_write and fs_pack. Levels from 3 up are LZ4HC, which writes
+// slower for a better ratio and decodes as fast as LZ4.
+enum {
+	k_fs_compression_none = 0,
+	k_fs_compression_fast = 1,
+	k_fs_compression_hc = 9,
+	k_fs_compression_max = 12,
+};
+
+// Where a work's time went, in microseconds.
+typedef struct fs_work_timing_t {
+	// from being queued until a thread picked it up
+	uint64_t queue_us;
+	// reading or writing, including waits for a second queue such as after compression
+	uint64_t io_us;
+	// compression, or the part of decompression that did not overlap reading
+	uint64_t codec_us;
+	uint64_t total_us;
+} fs_work_timing_t;
+
+// Queue statistics for one priority.
+typedef struct fs_queue_stats_t {
+	// works taken off the queue by a file thread or the I/O thread
+	int count;
+	// microseconds those works spent queued
+	uint64_t total_wait_us;
+	uint64_t max_wait_us;
+	// works cancelled while queued
+	int cancelled;
+	// works finished after their deadline
+	int deadline_misses;
+} fs_queue_stats_t;
+
 // Create a new file system.
 // Provided heap will be used to allocate space for queue and work buffers.
 // Provided queue size defines number of in-flight file operations.
-fs_t* fs_create(heap_t* heap, int queue_capacity);
+// Worker count is the number of threads doing file I/O. While more than one runs, one is
+// always left free for files under 1 MB so they are not stuck behind large reads.
+fs_t* fs_create(heap_t* heap, int queue_capacity, int worker_count);
+
+// Create a new file system that reads and writes uncompressed files with overlapped I/O.
+// One thread keeps up to max_in_flight reads and writes in flight on an I/O completion port,
+// so the drive sees a deep queue during loads. The file threads still stream compressed
+// reads and run fs_map. Falls back to the file threads if the port can't be created.
+fs_t* fs_create_overlapped(heap_t* heap, int queue_capacity, int worker_count, int max_in_flight);
 
 // Destroy a previously created file system.
 void fs_destroy(fs_t* fs);
@@ -26,22 +80,152 @@ void fs_destroy(fs_t* fs);
 // compression size to the compression buffer.
 void file_read_compression_size(fs_work_t* work);
 
+// Mount a pack file written by fs_pack.
+// Reads of a path that is in the pack, relative to the directory that was packed, are
+// offset reads of the pack's open file instead of opening the path. Later mounts are
+// searched first. Mount before queuing reads, mounting is not safe alongside them.
+// Returns false if the pack can't be opened or is not valid.
+bool fs_mount(fs_t* fs, const char* pack_path);
+
+// Mount a pack as fs_mount does, for packs that are streamed rather than read in pieces.
+// Entries of 1 MB and up are read with direct I/O, which skips the page cache and its copy.
+// Data comes from the drive on every read, repeat reads of small entries stay buffered.
+// Reads sector aligned chunks into a pool of staging buffers, the next chunk is read while
+// the last one is copied out or decompressed. Reads buffered if the volume doesn't allow it.
+bool fs_mount_direct(fs_t* fs, const char* pack_path);
+
+// Check whole file reads from mounted packs against each entry's stored digest.
+// The block threads digest a read as it arrives, a chunk behind the reading or as they
+// decompress each block, so only the last chunk's digest adds to the load time. An entry
+// that doesn't match fails its read. Range reads and fs_map are not checked.
+// Off by default, set it before queuing reads.
+void fs_set_verify(fs_t* fs, bool verify);
+
+// Write every file under directory into one pack file at pack_path.
+// Entries are found by the xxhash64 of their path relative to directory and are aligned
+// to 4 KB. Unless compression_level is k_fs_compression_none, each file is stored compressed
+// at that level if that makes it smaller. Each entry stores a digest of its contents for
+// fs_set_verify.
+// With a dictionary_path, files are compressed against the last 64 KB of that file, which is
+// stored in the pack and loaded by fs_mount. This helps small files of similar content, a
+// dictionary can be trained from samples with "zstd --train --maxdict=65536".
+// Prints the ratio and decode speed for each file extension.
+// Blocks until the pack is written, returns false on failure.
+bool fs_pack(fs_t* fs, const char* directory, const char* pack_path, int compression_level, const char* dictionary_path);
+
 // Queue a file read.
 // File at the specified path will be read in full.
 // Memory for the file will be allocated out of the provided heap.
 // It is the calls responsibility to free the memory allocated!
+// With use_compression the file must have been written compressed by fs_write. It is read
+// in 1 MB chunks that are decompressed in parallel while the next chunk is read, and the
+// size is the decompressed size.
+// A block that fails its checksum fails the read.
+// Queued at normal priority with no deadline.
 // Returns a work object.
 fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression);
 
-// Queue a file write.
-// File at the specified path will be written in full.
+// Queue a file read as fs_read does, at a priority.
+// Deadline is the timer_get_ticks() value the data is needed by, 0 for none. A deadline only
+// orders work within its priority, work past its deadline is still read.
+fs_work_t* fs_read_priority(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression,
+	fs_priority_t priority, uint64_t deadline);
+
+// Queue a file read as fs_read_priority does, with direct I/O as for the large entries of
+// fs_mount_direct, for a pack entry or a file of any size.
+fs_work_t* fs_read_direct(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression,
+	fs_priority_t priority, uint64_t deadline);
+
+// A range of a file to read into caller memory.
+typedef struct fs_range_t {
+	uint64_t offset;
+	size_t size;
+	void* buffer;
+} fs_range_t;
+
+// Queue a read of size bytes at offset in a file into buffer, which the caller owns and
+// must keep valid until the work is done. Nothing is allocated for the data.
+// Reading past the end of the file fails the work.
+// Returns a work object, its size is the bytes read and its buffer is NULL.
+fs_work_t* fs_read_range(fs_t* fs, const char* path, uint64_t offset, size_t size, void* buffer);
+
+// Queue one read of several ranges of a file, each into its own caller buffer.
+// For a path in a mounted pack the offsets are into the file as it was packed, and for a
+// compressed entry only the blocks that hold the ranges are read and decompressed.
+// The ranges are copied, the buffers are not.
+// Returns a work object, its size is the total bytes read and its buffer is NULL.
+fs_work_t* fs_read_ranges(fs_t* fs, const char* path, const fs_range_t* ranges, int range_count);
+
+// Queue a read of several ranges as fs_read_ranges does, at a priority and deadline as for fs_read_priority.
+fs_work_t* fs_read_ranges_priority(fs_t* fs, const char* path, const fs_range_t* ranges, int range_count,
+	fs_priority_t priority, uint64_t deadline);
+
+// Queue a file write at normal priority.
+// File at the specified path will be written in full. The data goes to a temporary file next
+// to it, which is then renamed over the file, so readers never see it half written. Only
+// durable writes, see fs_set_write_behind, are also whole after a crash.
+// Unless compression_level is k_fs_compression_none the buffer is compressed at that level into
+// independent 256 KB LZ4 frames with content size and checksums, behind a block index, the
+// work's size stays the uncompressed size. Read it back with use_compression at any level.
 // Returns a work object.
-fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression);
+fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level);
+
+// Write a file later, for writes that repeat such as saves, config and logs.
+// The buffer is copied and the call returns without queuing anything. The write is queued
+// as fs_write does once the write-behind delay has passed since the path was first written
+// behind. Until then, a later write of the same path replaces the pending data, so only the
+// latest is written. Reads don't see pending data, call fs_flush first.
+void fs_write_behind(fs_t* fs, const char* path, const void* buffer, size_t size, int compression_level);
+
+// Set how long fs_write_behind holds writes back, 1000 ms by default.
+// With durable, each write is flushed to the drive before it replaces its file. The flushes
+// of the writes that are due together overlap, instead of each write waiting for its own.
+void fs_set_write_behind(fs_t* fs, uint32_t delay_ms, bool durable);
+
+// Write every pending fs_write_behind now and wait for them. Also done by fs_destroy.
+void fs_flush(fs_t* fs);
+
+// Queue a read-only memory mapping of a file.
+// The work's buffer is the file's contents in place, with no heap copy, and the size is the
+// file's size. Repeat loads are served from the OS page cache. With prefetch the whole file
+// is paged in ahead of first use. The buffer must not be written to or freed, it stays valid
+// until fs_unmap or fs_work_destroy.
+// Returns a work object.
+fs_work_t* fs_map(fs_t* fs, const char* path, bool prefetch);
+
+// Release the mapping of a work queued by fs_map, waiting for it first.
+// Does nothing for other work.
+void fs_unmap(fs_work_t* work);
+
+// Cancel a work that is still waiting for a file thread or the I/O thread.
+// A cancelled work is done with a result of ERROR_OPERATION_ABORTED and must still be destroyed.
+// Returns false if the work already started, it then runs to completion as usual.
+bool fs_work_cancel(fs_work_t* work);
+
+// Get how long work of a priority has waited in the queues since the fs was created.
+void fs_get_queue_stats(fs_t* fs, fs_priority_t priority, fs_queue_stats_t* stats);
+
+// Queue every request of a manifest written by fs_record_manifest at prefetch priority.
+// A later fs_read, single range fs_read_ranges or fs_map that matches a prefetched request
+// takes it over instead of queuing its own, a prefetch that has not started yet moves up to
+// the caller's priority. Prefetched reads are only handed over as is to callers reading into
+// the fs heap. Call before anything else reads files, after mounting packs.
+// Returns false if the manifest can't be read, such as on the first run.
+bool fs_prefetch_manifest(fs_t* fs, const char* manifest_path);
+
+// Drop the prefetches nobody claimed, cancelling those not started yet.
+// Call once startup has loaded what it needs. Also done by fs_destroy.
+void fs_prefetch_release(fs_t* fs);
+
+// Record the reads, ranges and maps requested for the next duration_ms into a manifest
+// for fs_prefetch_manifest. It is written to manifest_path when the fs is destroyed.
+void fs_record_manifest(fs_t* fs, const char* manifest_path, uint32_t duration_ms);
 
 // If true, the file work is complete.
 bool fs_work_is_done(fs_work_t* work);
 
 // Block for the file work to complete.
+// Works carry no kernel object, a waiting thread sleeps on the work's completion state.
 void fs_work_wait(fs_work_t* work);
 
 // Get the error code for the file work.
@@ -54,7 +238,11 @@ void* fs_work_get_buffer(fs_work_t* work);
 // Get the size associated with the file operation.
 size_t fs_work_get_size(fs_work_t* work);
 
-// Free a file work object.
+// Get where the file work's time went, waiting for it to complete.
+void fs_work_get_timing(fs_work_t* work, fs_work_timing_t* timing);
+
+// Free a file work object, a mapping made by fs_map is released with it.
+// Works are pooled by their fs and reused, destroy every work before its fs.
 void fs_work_destroy(fs_work_t* work);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,461 @@
+#include "fs_bench.h"
+
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "timer.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+enum {
+	k_fs_bench_large_every = 16,
+	k_fs_bench_large_size = 8 * 1024 * 1024,
+	k_fs_bench_small_min = 4 * 1024,
+	k_fs_bench_small_max = 256 * 1024,
+};
+
+static void fs_bench_path(const char* directory, int index, char* path, size_t path_size) {
+	snprintf(path, path_size, "%s/asset_%04d.bin", directory, index);
+}
+
+// Same sizes on every run, so results from different machines compare.
+static size_t fs_bench_file_size(int index) {
+	if (index % k_fs_bench_large_every == k_fs_bench_large_every - 1) {
+		return k_fs_bench_large_size;
+	}
+	uint32_t hash = (uint32_t)index * 2654435761u;
+	return k_fs_bench_small_min + hash % (k_fs_bench_small_max - k_fs_bench_small_min);
+}
+
+static void fs_bench_generate(heap_t* heap, const char* directory, int file_count) {
+	CreateDirectoryA(directory, NULL);
+
+	fs_t* fs = fs_create(heap, file_count, 4);
+	char* data = heap_alloc(heap, k_fs_bench_large_size, 8);
+	for (size_t i = 0; i < k_fs_bench_large_size; ++i) {
+		data[i] = (char)(i * 31 + (i >> 12));
+	}
+
+	fs_work_t** works = heap_alloc(heap, sizeof(fs_work_t*) * file_count, 8);
+	for (int i = 0; i < file_count; ++i) {
+		char path[1024];
+		fs_bench_path(directory, i, path, sizeof(path));
+		works[i] = fs_write(fs, path, data, fs_bench_file_size(i), k_fs_compression_none);
+	}
+	for (int i = 0; i < file_count; ++i) {
+		if (fs_work_get_result(works[i]) != 0) {
+			debug_print_line(k_print_error, "fs_bench: unable to write file %d.\n", i);
+		}
+		fs_work_destroy(works[i]);
+	}
+
+	heap_free(heap, works);
+	heap_free(heap, data);
+	fs_destroy(fs);
+}
+
+// Read every file with worker_count workers, or with overlapped I/O when max_in_flight is not 0.
+// Returns the time taken in microseconds.
+static uint64_t fs_bench_read_all(heap_t* heap, const char* directory, int file_count, int worker_count, int max_in_flight, size_t* total_size) {
+	fs_t* fs = max_in_flight
+		? fs_create_overlapped(heap, file_count, worker_count, max_in_flight)
+		: fs_create(heap, file_count, worker_count);
+	fs_work_t** works = heap_alloc(heap, sizeof(fs_work_t*) * file_count, 8);
+
+	uint64_t start = timer_get_ticks();
+	for (int i = 0; i < file_count; ++i) {
+		char path[1024];
+		fs_bench_path(directory, i, path, sizeof(path));
+		works[i] = fs_read(fs, path, heap, false, false);
+	}
+	for (int i = 0; i < file_count; ++i) {
+		fs_work_wait(works[i]);
+	}
+	uint64_t us = timer_ticks_to_us(timer_get_ticks() - start);
+
+	*total_size = 0;
+	for (int i = 0; i < file_count; ++i) {
+		if (fs_work_get_result(works[i]) == 0) {
+			*total_size += fs_work_get_size(works[i]);
+			heap_free(heap, fs_work_get_buffer(works[i]));
+		}
+		fs_work_destroy(works[i]);
+	}
+
+	heap_free(heap, works);
+	fs_destroy(fs);
+	return us;
+}
+
+void fs_bench_run(heap_t* heap, const char* directory, int file_count) {
+	char path[1024];
+	fs_bench_path(directory, file_count - 1, path, sizeof(path));
+	if (GetFileAttributesA(path) == INVALID_FILE_ATTRIBUTES) {
+		debug_print_line(k_print_info, "fs_bench: writing %d files to %s.\n", file_count, directory);
+		fs_bench_generate(heap, directory, file_count);
+	}
+
+	static const int k_worker_counts[] = { 1, 2, 4, 8 };
+	size_t total_size = 0;
+
+	uint64_t first_us = fs_bench_read_all(heap, directory, file_count, 4, 0, &total_size);
+	debug_print_line(k_print_info, "fs_bench: first pass, 4 workers: %d files, %zu bytes in %.2f ms.\n",
+		file_count, total_size, first_us * 0.001);
+
+	uint64_t baseline_us = 0;
+	for (int i = 0; i < _countof(k_worker_counts); ++i) {
+		uint64_t us = fs_bench_read_all(heap, directory, file_count, k_worker_counts[i], 0, &total_size);
+		if (i == 0) {
+			baseline_us = us;
+		}
+		debug_print_line(k_print_info, "fs_bench: cached, %d workers: %.2f ms, %.0f MB/s, %.2fx\n",
+			k_worker_counts[i], us * 0.001, us ? total_size / (double)us : 0.0,
+			us ? baseline_us / (double)us : 0.0);
+	}
+
+	static const int k_in_flight_counts[] = { 1, 16, 64 };
+	for (int i = 0; i < _countof(k_in_flight_counts); ++i) {
+		uint64_t us = fs_bench_read_all(heap, directory, file_count, 1, k_in_flight_counts[i], &total_size);
+		debug_print_line(k_print_info, "fs_bench: cached, overlapped, %d in flight: %.2f ms, %.0f MB/s, %.2fx\n",
+			k_in_flight_counts[i], us * 0.001, us ? total_size / (double)us : 0.0,
+			us ? baseline_us / (double)us : 0.0);
+	}
+}
+
+// Size classes of the benchmark corpus.
+typedef struct fs_bench_class_t {
+	const char* name;
+	int file_count;
+	size_t min_size;
+	size_t max_size;
+} fs_bench_class_t;
+
+static const fs_bench_class_t k_fs_bench_classes[] = {
+	{ "small", 256, 4 * 1024, 64 * 1024 },
+	{ "medium", 64, 256 * 1024, 1024 * 1024 },
+	{ "large", 4, 16 * 1024 * 1024, 16 * 1024 * 1024 },
+};
+
+// A backend setup, max_in_flight is the overlapped queue depth and 0 for the file threads.
+typedef struct fs_bench_config_t {
+	int worker_count;
+	int max_in_flight;
+} fs_bench_config_t;
+
+static const fs_bench_config_t k_fs_bench_configs[] = {
+	{ 1, 0 },
+	{ 4, 0 },
+	{ 8, 0 },
+	{ 4, 1 },
+	{ 4, 16 },
+	{ 4, 64 },
+};
+
+// Growable JSON text.
+typedef struct fs_bench_json_t {
+	heap_t* heap;
+	char* text;
+	size_t length;
+	size_t capacity;
+} fs_bench_json_t;
+
+static void fs_bench_json_append(fs_bench_json_t* json, _Printf_format_string_ const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (json->length + length + 1 > json->capacity) {
+		size_t capacity = __max(json->capacity * 2, json->length + length + 1024);
+		char* text = heap_alloc(json->heap, capacity, 8);
+		if (json->text) {
+			memcpy(text, json->text, json->length);
+			heap_free(json->heap, json->text);
+		}
+		json->text = text;
+		json->capacity = capacity;
+	}
+	va_start(args, format);
+	vsnprintf(json->text + json->length, json->capacity - json->length, format, args);
+	va_end(args);
+	json->length += length;
+}
+
+static size_t fs_bench_class_file_size(const fs_bench_class_t* file_class, int index) {
+	uint32_t hash = (uint32_t)index * 2654435761u;
+	size_t range = file_class->max_size - file_class->min_size;
+	return file_class->min_size + (range ? hash % range : 0);
+}
+
+static void fs_bench_class_path(const char* directory, const fs_bench_class_t* file_class, int index,
+	bool compressed, bool output, char* path, size_t path_size) {
+	snprintf(path, path_size, "%s/%s%s_%04d.%s", directory, output ? "out_" : "", file_class->name, index,
+		compressed ? "lz4" : "bin");
+}
+
+// Words from a small vocabulary, so the data compresses about as well as text assets do.
+static void fs_bench_fill(char* data, size_t size) {
+	static const char* k_words[] = { "vertex ", "uniform ", "float ", "mesh ", "texture ", "0.125 ", "1.0 ",
+		"normal ", "\n", "layout ", "struct ", "index ", "-3.75 ", "color ", "{ ", "} " };
+	uint32_t state = 12345;
+	size_t offset = 0;
+	while (offset < size) {
+		state = state * 1664525u + 1013904223u;
+		const char* word = k_words[(state >> 16) % _countof(k_words)];
+		size_t length = __min(strlen(word), size - offset);
+		memcpy(data + offset, word, length);
+		offset += length;
+		if ((state & 0xff) == 0 && offset < size) {
+			// a little noise so not everything is a repeat
+			data[offset++] = (char)(state >> 8);
+		}
+	}
+}
+
+// Write the raw and compressed copies of every class's files, if they are not there yet.
+static void fs_bench_suite_generate(heap_t* heap, const char* directory, const char* data) {
+	CreateDirectoryA(directory, NULL);
+	fs_t* fs = fs_create(heap, 64, 4);
+	for (int c = 0; c < _countof(k_fs_bench_classes); ++c) {
+		const fs_bench_class_t* file_class = &k_fs_bench_classes[c];
+		char path[1024];
+		fs_bench_class_path(directory, file_class, file_class->file_count - 1, true, false, path, sizeof(path));
+		if (GetFileAttributesA(path) != INVALID_FILE_ATTRIBUTES) {
+			continue;
+		}
+		debug_print_line(k_print_info, "fs_bench: writing %d %s files to %s.\n", file_class->file_count, file_class->name, directory);
+		for (int compressed = 0; compressed < 2; ++compressed) {
+			for (int i = 0; i < file_class->file_count; ++i) {
+				fs_bench_class_path(directory, file_class, i, compressed, false, path, sizeof(path));
+				fs_work_t* work = fs_write(fs, path, data, fs_bench_class_file_size(file_class, i),
+					compressed ? k_fs_compression_fast : k_fs_compression_none);
+				if (fs_work_get_result(work) != 0) {
+					debug_print_line(k_print_error, "fs_bench: unable to write %s.\n", path);
+				}
+				fs_work_destroy(work);
+			}
+		}
+	}
+	fs_destroy(fs);
+}
+
+static int fs_bench_compare_us(const void* a, const void* b) {
+	uint64_t us_a = *(const uint64_t*)a;
+	uint64_t us_b = *(const uint64_t*)b;
+	return us_a < us_b ? -1 : us_a > us_b;
+}
+
+// Sort count samples and append their p50, p99 and p999 as a JSON object named name.
+static void fs_bench_json_percentiles(fs_bench_json_t* json, const char* name, uint64_t* samples, int count, bool last) {
+	qsort(samples, count, sizeof(uint64_t), fs_bench_compare_us);
+	static const double k_percentiles[] = { 0.5, 0.99, 0.999 };
+	uint64_t values[_countof(k_percentiles)] = { 0 };
+	for (int i = 0; i < _countof(k_percentiles) && count > 0; ++i) {
+		values[i] = samples[__min((int)(k_percentiles[i] * count), count - 1)];
+	}
+	fs_bench_json_append(json, "\"%s\": { \"p50\": %llu, \"p99\": %llu, \"p999\": %llu }%s", name,
+		values[0], values[1], values[2], last ? "" : ", ");
+}
+
+// Run one case, every file of a class read or written at once, and append its JSON object.
+// With direct, reads are made with fs_read_direct.
+static void fs_bench_suite_case(heap_t* heap, fs_bench_json_t* json, const char* directory, const char* data,
+	const fs_bench_config_t* config, const fs_bench_class_t* file_class, bool write, bool compressed, bool direct) {
+	fs_t* fs = config->max_in_flight
+		? fs_create_overlapped(heap, file_class->file_count, config->worker_count, config->max_in_flight)
+		: fs_create(heap, file_class->file_count, config->worker_count);
+	int count = file_class->file_count;
+	fs_work_t** works = heap_alloc(heap, sizeof(fs_work_t*) * count, 8);
+
+	uint64_t start = timer_get_ticks();
+	for (int i = 0; i < count; ++i) {
+		char path[1024];
+		fs_bench_class_path(directory, file_class, i, compressed, write, path, sizeof(path));
+		works[i] = write
+			? fs_write(fs, path, data, fs_bench_class_file_size(file_class, i), compressed ? k_fs_compression_fast : k_fs_compression_none)
+			: direct
+			? fs_read_direct(fs, path, heap, false, compressed, k_fs_priority_normal, 0)
+			: fs_read(fs, path, heap, false, compressed);
+	}
+	for (int i = 0; i < count; ++i) {
+		fs_work_wait(works[i]);
+	}
+	uint64_t elapsed_us = timer_ticks_to_us(timer_get_ticks() - start);
+
+	uint64_t* samples = heap_alloc(heap, sizeof(uint64_t) * count * 4, 8);
+	uint64_t* total = samples;
+	uint64_t* queue = samples + count;
+	uint64_t* io = samples + count * 2;
+	uint64_t* codec = samples + count * 3;
+	size_t bytes = 0;
+	int errors = 0;
+	for (int i = 0; i < count; ++i) {
+		fs_work_timing_t timing;
+		fs_work_get_timing(works[i], &timing);
+		total[i] = timing.total_us;
+		queue[i] = timing.queue_us;
+		io[i] = timing.io_us;
+		codec[i] = timing.codec_us;
+		if (fs_work_get_result(works[i]) == 0) {
+			bytes += fs_work_get_size(works[i]);
+			if (!write) {
+				heap_free(heap, fs_work_get_buffer(works[i]));
+			}
+		} else {
+			++errors;
+		}
+		fs_work_destroy(works[i]);
+	}
+	heap_free(heap, works);
+	fs_destroy(fs);
+
+	fs_bench_json_append(json, "%s\n    { \"backend\": \"%s\", \"workers\": %d, \"max_in_flight\": %d, \"op\": \"%s\", "
+		"\"direct\": %s, \"compression\": %s, \"class\": \"%s\", \"files\": %d, \"bytes\": %zu, \"errors\": %d, \"elapsed_us\": %llu, "
+		"\"mb_per_s\": %.1f, \"requests_per_s\": %.1f, \"latency_us\": { ",
+		json->text[json->length - 1] == '[' ? "" : ",",
+		config->max_in_flight ? "overlapped" : "threads", config->worker_count, config->max_in_flight,
+		write ? "write" : "read", direct ? "true" : "false", compressed ? "true" : "false", file_class->name, count, bytes, errors, elapsed_us,
+		bytes / (double)__max(elapsed_us, 1), count * 1000000.0 / (double)__max(elapsed_us, 1));
+	fs_bench_json_percentiles(json, "total", total, count, false);
+	fs_bench_json_percentiles(json, "queue", queue, count, false);
+	fs_bench_json_percentiles(json, "io", io, count, false);
+	fs_bench_json_percentiles(json, "codec", codec, count, true);
+	fs_bench_json_append(json, " } }");
+	heap_free(heap, samples);
+}
+
+// Read every raw file of the corpus out of a mounted pack, returns the time taken in microseconds.
+static uint64_t fs_bench_verify_pass(heap_t* heap, const char* pack_path, bool verify, int* file_count, size_t* bytes, int* errors) {
+	fs_t* fs = fs_create(heap, 64, 4);
+	fs_mount(fs, pack_path);
+	fs_set_verify(fs, verify);
+
+	int count = 0;
+	for (int c = 0; c < _countof(k_fs_bench_classes); ++c) {
+		count += k_fs_bench_classes[c].file_count;
+	}
+	fs_work_t** works = heap_alloc(heap, sizeof(fs_work_t*) * count, 8);
+
+	uint64_t start = timer_get_ticks();
+	int index = 0;
+	for (int c = 0; c < _countof(k_fs_bench_classes); ++c) {
+		for (int i = 0; i < k_fs_bench_classes[c].file_count; ++i) {
+			char path[256];
+			snprintf(path, sizeof(path), "%s_%04d.bin", k_fs_bench_classes[c].name, i);
+			works[index++] = fs_read(fs, path, heap, false, false);
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		fs_work_wait(works[i]);
+	}
+	uint64_t elapsed_us = timer_ticks_to_us(timer_get_ticks() - start);
+
+	*file_count = count;
+	*bytes = 0;
+	*errors = 0;
+	for (int i = 0; i < count; ++i) {
+		if (fs_work_get_result(works[i]) == 0) {
+			*bytes += fs_work_get_size(works[i]);
+			heap_free(heap, fs_work_get_buffer(works[i]));
+		} else {
+			++*errors;
+		}
+		fs_work_destroy(works[i]);
+	}
+	heap_free(heap, works);
+	fs_destroy(fs);
+	return elapsed_us;
+}
+
+// Pack the corpus raw and compressed, then time loading it from the pack with and without
+// fs_set_verify and append the results. Each time is the best of a few passes after a warm
+// up, so both read from the page cache, where verify is the largest share of the load.
+static void fs_bench_suite_verify(heap_t* heap, fs_bench_json_t* json, const char* directory) {
+	static const int k_levels[] = { k_fs_compression_none, k_fs_compression_fast };
+	for (int l = 0; l < _countof(k_levels); ++l) {
+		char pack_path[1024];
+		snprintf(pack_path, sizeof(pack_path), "%s_%d.pack", directory, k_levels[l]);
+		fs_t* fs = fs_create(heap, 64, 4);
+		bool packed = fs_pack(fs, directory, pack_path, k_levels[l], NULL);
+		fs_destroy(fs);
+		if (!packed) {
+			debug_print_line(k_print_error, "fs_bench: unable to pack %s.\n", directory);
+			continue;
+		}
+
+		int file_count = 0;
+		size_t bytes = 0;
+		int errors = 0;
+		fs_bench_verify_pass(heap, pack_path, false, &file_count, &bytes, &errors);
+		uint64_t best_us[2] = { UINT64_MAX, UINT64_MAX };
+		int total_errors = 0;
+		for (int pass = 0; pass < 5; ++pass) {
+			for (int verify = 0; verify < 2; ++verify) {
+				uint64_t us = fs_bench_verify_pass(heap, pack_path, verify, &file_count, &bytes, &errors);
+				best_us[verify] = __min(best_us[verify], us);
+				total_errors += errors;
+			}
+		}
+
+		double overhead = (best_us[1] - (double)best_us[0]) * 100.0 / (double)__max(best_us[0], 1);
+		debug_print_line(overhead < 5.0 ? k_print_info : k_print_warning,
+			"fs_bench: verify, compression %d: %.2f ms plain, %.2f ms verified, %.1f%% overhead.\n",
+			k_levels[l], best_us[0] * 0.001, best_us[1] * 0.001, overhead);
+		fs_bench_json_append(json, "%s\n    { \"compression\": %d, \"files\": %d, \"bytes\": %zu, \"errors\": %d, "
+			"\"plain_us\": %llu, \"verified_us\": %llu, \"overhead_percent\": %.2f }",
+			json->text[json->length - 1] == '[' ? "" : ",", k_levels[l], file_count, bytes, total_errors,
+			best_us[0], best_us[1], overhead);
+		DeleteFileA(pack_path);
+	}
+}
+
+bool fs_bench_suite(heap_t* heap, const char* directory, const char* json_path) {
+	size_t max_size = 0;
+	for (int c = 0; c < _countof(k_fs_bench_classes); ++c) {
+		max_size = __max(max_size, k_fs_bench_classes[c].max_size);
+	}
+	char* data = heap_alloc(heap, max_size, 8);
+	fs_bench_fill(data, max_size);
+	fs_bench_suite_generate(heap, directory, data);
+
+	fs_bench_json_t json = { heap, NULL, 0, 0 };
+	fs_bench_json_append(&json, "{\n  \"benchmark\": \"fs\",\n  \"cases\": [");
+	for (int k = 0; k < _countof(k_fs_bench_configs); ++k) {
+		for (int c = 0; c < _countof(k_fs_bench_classes); ++c) {
+			for (int op = 0; op < 6; ++op) {
+				bool write = op == 2 || op == 3;
+				bool compressed = op & 1;
+				bool direct = op >= 4;
+				if (direct && k_fs_bench_configs[k].max_in_flight) {
+					// direct reads always run on the file threads, the overlapped setups would repeat them
+					continue;
+				}
+				fs_bench_suite_case(heap, &json, directory, data, &k_fs_bench_configs[k], &k_fs_bench_classes[c], write, compressed, direct);
+			}
+		}
+		debug_print_line(k_print_info, "fs_bench: %d of %d setups done.\n", k + 1, (int)_countof(k_fs_bench_configs));
+	}
+	fs_bench_json_append(&json, "\n  ],\n  \"verify\": [");
+	fs_bench_suite_verify(heap, &json, directory);
+	fs_bench_json_append(&json, "\n  ]\n}\n");
+	heap_free(heap, data);
+
+	fs_t* fs = fs_create(heap, 1, 1);
+	fs_work_t* work = fs_write(fs, json_path, json.text, json.length, k_fs_compression_none);
+	bool written = fs_work_get_result(work) == 0;
+	fs_work_destroy(work);
+	fs_destroy(fs);
+	heap_free(heap, json.text);
+
+	if (written) {
+		debug_print_line(k_print_info, "fs_bench: results written to %s.\n", json_path);
+	} else {
+		debug_print_line(k_print_error, "fs_bench: unable to write %s.\n", json_path);
+	}
+	return written;
+}
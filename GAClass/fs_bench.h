@@ -0,0 +1,29 @@
+#pragma once
+
+// File system benchmarks.
+
+#include <stdbool.h>
+
+typedef struct heap_t heap_t;
+
+// Time reading file_count asset-like files out of directory with 1, 2, 4 and 8 I/O workers,
+// then with overlapped I/O at 1, 16 and 64 reads in flight.
+// Most files are small like shaders, every 16th is large like a texture or mesh.
+// Files are written first if the directory does not have them yet.
+// The first pass is cold if the files are not in the page cache, such as after a reboot,
+// the passes after it read from the page cache. Results are printed.
+void fs_bench_run(heap_t* heap, const char* directory, int file_count);
+
+// Run the fs benchmark suite and write the results as JSON to json_path.
+// A corpus of small, medium and large files, raw and compressed, is written to directory
+// if it is not there yet. Every class is then read and written, with and without compression,
+// with 1, 4 and 8 file threads and with overlapped I/O at 1, 16 and 64 in flight.
+// Each case records MB/s, requests/s and p50/p99/p999 latency in total and split into queue
+// wait, I/O and compression or exposed decompression, see fs_work_get_timing. Reads come from
+// the page cache as the corpus was just written or read.
+// With the file threads, reads are also timed with fs_read_direct, which reads from the drive
+// every time. Direct is worth it where its MB/s comes close to the buffered cases, as a stream
+// bigger than memory is not in the page cache and costs buffered reads a copy on top.
+// Last, the corpus is packed raw and compressed and loaded from each pack with and without
+// fs_set_verify, to show the share of the load time that verification costs.
+bool fs_bench_suite(heap_t* heap, const char* directory, const char* json_path);
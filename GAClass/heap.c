@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "mutex.h"
+#include "trace.h"
 #include "include/tlsf/tlsf.h"
 
 #include <stddef.h>
@@ -10,6 +11,12 @@
 
 #define MAIN_STRING_NAME "main"
 
+// Each block keeps room past the requested size for the callstack of its allocation.
+enum {
+	k_heap_callstack_frames = 8,
+	k_heap_callstack_size = k_heap_callstack_frames * sizeof(void*),
+};
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <windowsx.h>
@@ -42,6 +49,7 @@ typedef struct heap_t {
 	arena_t* arena;
 	// allocation_list_t* allocation;
 	mutex_t* mutex;
+	size_t allocated;
 } heap_t;
 
 allocation_list_t* initialize_allocation_list() {
@@ -139,6 +147,7 @@ heap_t* heap_create(size_t grow_increment) {
 	heap->tlsf = tlsf_create(heap + 1);
 	heap->arena = NULL;
 	heap->mutex = mutex_create();
+	heap->allocated = 0;
 	return heap;
 }
 
@@ -146,7 +155,7 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment) {
 
 	mutex_lock(heap->mutex);
 
-	size_t size_plus_callstack = size + 64;
+	size_t size_plus_callstack = size + k_heap_callstack_size;
 
 	void* address = tlsf_memalign(heap->tlsf, alignment, size_plus_callstack);
 	if (!address) { // memory has not been allocated yet
@@ -168,10 +177,16 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment) {
 	
 	if(address){
 		char* callstack = (char*) address + size;
-		CaptureStackBackTrace(1, 8, callstack, NULL);
+		CaptureStackBackTrace(1, k_heap_callstack_frames, callstack, NULL);
+		heap->allocated += tlsf_block_size(address);
 	}
 
 	mutex_unlock(heap->mutex);
+
+	if (address) {
+		// block size less the callstack, so frees report the same size
+		TRACE_HEAP_ALLOC(address, tlsf_block_size(address) - k_heap_callstack_size, (void**)((char*)address + size));
+	}
 	
 	return address;
 }
@@ -179,13 +194,21 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment) {
 void heap_free(heap_t* heap, void* address) {
 	mutex_lock(heap->mutex);
 	//remove_from_list(heap->allocation, address);
+	size_t block_size = tlsf_block_size(address);
+	heap->allocated -= block_size;
 	tlsf_free(heap->tlsf, address);
 	mutex_unlock(heap->mutex);
+
+	TRACE_HEAP_FREE(address, block_size - k_heap_callstack_size);
+}
+
+size_t heap_get_allocated(heap_t* heap) {
+	return heap->allocated;
 }
 
 static void leak_check(void* ptr, size_t size, int used, void* usert) {
 	if (used) {
-		void* callstack = (char*)ptr + (size - 64);
+		void* callstack = (char*)ptr + (size - k_heap_callstack_size);
 		// symbolicate callstack
 		HANDLE process = GetCurrentProcess();
 		SymInitialize(process, NULL, TRUE);
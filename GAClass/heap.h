@@ -26,6 +26,9 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment);
 
 void heap_free(heap_t* heap, void* address);
 
+// Bytes currently allocated from the heap, including per-allocation overhead.
+size_t heap_get_allocated(heap_t* heap);
+
 // Destroy the given heap, checks for any memory leaks if possible
 void heap_destroy(heap_t* heap);
 
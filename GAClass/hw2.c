@@ -3,13 +3,18 @@
 
 #include "hw2.h"
 #include <assert.h>
+#include <string.h>
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
 
 void homework2_test_internal(heap_t* heap, fs_t* fs, bool use_compression) {
 	const char* huck_finn = "YOU don't know about me without you have read a book by the name of The Adventures of Tom Sawyer; but that ain't no matter.  That book was made by Mr. Mark Twain, and he told the truth, mainly.  There was things which he stretched, but mainly he told the truth.  That is nothing.  I never seen anybody but lied one time or another, without it was Aunt Polly, or the widow, or maybe Mary.  Aunt PollyTom's Aunt Polly, she isand Mary, and the Widow Douglas is all told about in that book, which is mostly a true book, with some stretchers, as I said before. Now the way that the book winds up is this:  Tom and me found the money that the robbers hid in the cave, and it made us rich.  We got six thousand dollars apieceall gold.  It was an awful sight of money when it was piled up.  Well, Judge Thatcher he took it and put it out at interest, and it fetched us a dollar a day apiece all the year roundmore than a body could tell what to do with.  The Widow Douglas she took me for her son, and allowed she would sivilize me; but it was rough living in the house all the time, considering how dismal regular and decent the widow was in all her ways; and so when I couldn't stand it no longer I lit out.  I got into my old rags and my sugar-hogshead again, and was free and satisfied.  But Tom Sawyer he hunted me up and said he was going to start a band of robbers, and I might join if I would go back to the widow and be respectable.  So I went back. The widow she cried over me, and called me a poor lost lamb, and she called me a lot of other names, too, but she never meant no harm by it. She put me in them new clothes again, and I couldn't do nothing but sweat and sweat, and feel all cramped up.  Well, then, the old thing commenced again.  The widow rung a bell for supper, and you had to come to time. When you got to the table you couldn't go right to eating, but you had to wait for the widow to tuck down her head and grumble a little over the victuals, though there warn't really anything the matter with them,that is, nothing only everything was cooked by itself.  In a barrel of odds and ends it is different; things get mixed up, and the juice kind of swaps around, and the things go better. After supper she got out her book and learned me about Moses and the Bulrushers, and I was in a sweat to find out all about him; but by and by she let it out that Moses had been dead a considerable long time; so then I didn't care no more about him, because I don't take no stock in dead people. Pretty soon I wanted to smoke, and asked the widow to let me.  But she wouldn't.  She said it was a mean practice and wasn't clean, and I must try to not do it any more.  That is just the way with some people.  They get down on a thing when they don't know nothing about it.  Here she was a-bothering about Moses, which was no kin to her, and no use to anybody, being gone, you see, yet finding a power of fault with me for doing a thing that had some good in it.  And she took snuff, too; of course that was all right, because she done it herself. Her sister, Miss Watson, a tolerable slim old maid, with goggles on, had just come to live with her, and took a set at me now with a spelling-book. She worked me middling hard for about an hour, and then the widow made her ease up.  I couldn't stood it much longer.  Then for an hour it was deadly dull, and I was fidgety.  Miss Watson would say, \"Don't put your feet up there, Huckleberry;\" and \"Don't scrunch up like that, Huckleberryset up straight; \" and pretty soon she would say, \"Don't gap and stretch like that, Huckleberrywhy don't you try to behave ? \"  Then she told me all about the bad place, and I said I wished I was there. She got mad then, but I didn't mean no harm.  All I wanted was to go somewheres; all I wanted was a change, I warn't particular.  She said it was wicked to say what I said; said she wouldn't say it for the whole world; she was going to live so as to go to the good place.  Well, I couldn't see no advantage in going where she was going, so I made up my mind I wouldn't try for it.  But I never said so, because it would only make trouble, and wouldn't do no good. Now she had got a start, and she went on and told me all about the good place.  She said all a body would have to do there was to go around all day long with a harp and sing, forever and ever.  So I didn't think much of it. But I never said so.  I asked her if she reckoned Tom Sawyer would go there, and she said not by a considerable sight.  I was glad about that, because I wanted him and me to be together. Miss Watson she kept pecking at me, and it got tiresome and lonesome.  By and by they fetched the niggers in and had prayers, and then everybody was off to bed.  I went up to my room with a piece of candle, and put it on the table.  Then I set down in a chair by the window and tried to think of something cheerful, but it warn't no use.  I felt so lonesome I most wished I was dead.  The stars were shining, and the leaves rustled in the woods ever so mournful; and I heard an owl, away off, who-whooing about somebody that was dead, and a whippowill and a dog crying about somebody that was going to die; and the wind was trying to whisper something to me, and I couldn't make out what it was, and so it made the cold shivers run over me. Then away out in the woods I heard that kind of a sound that a ghost makes when it wants to tell about something that's on its mind and can't make itself understood, and so can't rest easy in its grave, and has to go about that way every night grieving.  I got so down-hearted and scared I did wish I had some company.  Pretty soon a spider went crawling up my shoulder, and I flipped it off and it lit in the candle; and before I could budge it was all shriveled up.  I didn't need anybody to tell me that that was an awful bad sign and would fetch me some bad luck, so I was scared and most shook the clothes off of me. I got up and turned around in my tracks three times and crossed my breast every time; and then I tied up a little lock of my hair with a thread to keep witches away.  But I hadn't no confidence.  You do that when you've lost a horseshoe that you've found, instead of nailing it up over the door, but I hadn't ever heard anybody say it was any way to keep off bad luck when you'd killed a spider. I set down again, a-shaking all over, and got out my pipe for a smoke; for the house was all as still as death now, and so the widow wouldn't know. Well, after a long time I heard the clock away off in the town go boomboomboomtwelve licks; and all still againstiller than ever. Pretty soon I heard a twig snap down in the dark amongst the treessomething was a stirring.  I set still and listened.  Directly I could just barely hear a \"me - yow!me - yow!\" down there.  That was good!  Says I, \"me - yow!me - yow!\" as soft as I could, and then I put out the light and scrambled out of the window on to the shed.  Then I slipped down to the ground and crawled in among the trees, and, sure enough, there was Tom Sawyer waiting for me.";
 	const size_t huck_finn_len = strlen(huck_finn);
 
 	const char* write_data = huck_finn;
-	fs_work_t* write_work = fs_write(fs, "foo.bar", write_data, huck_finn_len, use_compression);
+	fs_work_t* write_work = fs_write(fs, "foo.bar", write_data, huck_finn_len,
+		use_compression ? k_fs_compression_fast : k_fs_compression_none);
 	fs_work_wait(write_work);
 
 	assert(fs_work_get_result(write_work) == 0);
@@ -28,9 +33,190 @@ void homework2_test_internal(heap_t* heap, fs_t* fs, bool use_compression) {
 	heap_free(heap, read_data);
 }
 
+// Write size bytes to path and check the write succeeded.
+static void homework2_write_file(fs_t* fs, const char* path, const void* data, size_t size) {
+	fs_work_t* write_work = fs_write(fs, path, data, size, k_fs_compression_none);
+	fs_work_wait(write_work);
+	assert(fs_work_get_result(write_work) == 0);
+	fs_work_destroy(write_work);
+}
+
+// Pack a directory, mount the pack in a new fs and read an entry back through it.
+void homework2_test_pack(heap_t* heap) {
+	fs_t* fs = fs_create(heap, 16, 4);
+
+	// repeats so that the entry is stored compressed
+	const char* line = "Entries of a pack are found by the hash of their path. ";
+	const size_t line_len = strlen(line);
+	const size_t entry_len = 64 * line_len;
+	char* entry = heap_alloc(heap, entry_len, 8);
+	for (size_t i = 0; i < entry_len; i += line_len) {
+		memcpy(entry + i, line, line_len);
+	}
+	CreateDirectoryA("hw2_pack", NULL);
+	homework2_write_file(fs, "hw2_pack/entry.txt", entry, entry_len);
+	bool packed = fs_pack(fs, "hw2_pack", "hw2.pack", k_fs_compression_fast, NULL);
+	assert(packed);
+	fs_destroy(fs);
+
+	fs_t* mounted = fs_create(heap, 16, 4);
+	bool pack_mounted = fs_mount(mounted, "hw2.pack");
+	assert(pack_mounted);
+
+	// entry.txt only exists inside the pack
+	fs_work_t* read_work = fs_read(mounted, "entry.txt", heap, false, false);
+	char* read_data = fs_work_get_buffer(read_work);
+	assert(fs_work_get_result(read_work) == 0);
+	assert(fs_work_get_size(read_work) == entry_len);
+	assert(read_data && memcmp(read_data, entry, entry_len) == 0);
+	fs_work_destroy(read_work);
+	if (read_data) {
+		heap_free(heap, read_data);
+	}
+
+	// a path missing from the table of contents falls through to the disk and fails there
+	fs_work_t* missing_work = fs_read(mounted, "missing.txt", heap, false, false);
+	assert(fs_work_get_result(missing_work) != 0);
+	fs_work_destroy(missing_work);
+
+	fs_destroy(mounted);
+	heap_free(heap, entry);
+}
+
+// Read ranges of a file into caller buffers and compare them to the bytes written.
+void homework2_test_ranges(heap_t* heap) {
+	fs_t* fs = fs_create(heap, 16, 4);
+
+	char data[4096];
+	for (size_t i = 0; i < sizeof(data); ++i) {
+		data[i] = (char)(i * 7);
+	}
+	homework2_write_file(fs, "hw2_ranges.bin", data, sizeof(data));
+
+	char first[100];
+	char second[300];
+	fs_range_t ranges[] = {
+		{ 10, sizeof(first), first },
+		{ 3000, sizeof(second), second },
+	};
+	fs_work_t* ranges_work = fs_read_ranges(fs, "hw2_ranges.bin", ranges, 2);
+	assert(fs_work_get_result(ranges_work) == 0);
+	assert(fs_work_get_size(ranges_work) == sizeof(first) + sizeof(second));
+	assert(fs_work_get_buffer(ranges_work) == NULL);
+	assert(memcmp(first, data + 10, sizeof(first)) == 0);
+	assert(memcmp(second, data + 3000, sizeof(second)) == 0);
+	fs_work_destroy(ranges_work);
+
+	// the last range ends past the end of the file
+	fs_range_t past_end[] = {
+		{ 0, sizeof(first), first },
+		{ sizeof(data) - 100, sizeof(second), second },
+	};
+	fs_work_t* past_end_work = fs_read_ranges(fs, "hw2_ranges.bin", past_end, 2);
+	assert(fs_work_get_result(past_end_work) != 0);
+	fs_work_destroy(past_end_work);
+
+	fs_destroy(fs);
+}
+
+// Queue two writes of one path at once, the file must end up as one of them in full.
+void homework2_test_concurrent_writes(heap_t* heap) {
+	fs_t* fs = fs_create(heap, 16, 4);
+
+	// different sizes and contents, large enough that the writes overlap
+	const size_t first_len = 1024 * 1024;
+	const size_t second_len = 768 * 1024;
+	char* first = heap_alloc(heap, first_len, 8);
+	char* second = heap_alloc(heap, second_len, 8);
+	memset(first, 'a', first_len);
+	memset(second, 'b', second_len);
+
+	fs_work_t* first_work = fs_write(fs, "hw2_concurrent.bin", first, first_len, k_fs_compression_none);
+	fs_work_t* second_work = fs_write(fs, "hw2_concurrent.bin", second, second_len, k_fs_compression_none);
+	assert(fs_work_get_result(first_work) == 0);
+	assert(fs_work_get_result(second_work) == 0);
+	fs_work_destroy(first_work);
+	fs_work_destroy(second_work);
+
+	fs_work_t* read_work = fs_read(fs, "hw2_concurrent.bin", heap, false, false);
+	char* read_data = fs_work_get_buffer(read_work);
+	size_t read_len = fs_work_get_size(read_work);
+	assert(fs_work_get_result(read_work) == 0);
+	assert((read_len == first_len && memcmp(read_data, first, first_len) == 0) ||
+		(read_len == second_len && memcmp(read_data, second, second_len) == 0));
+	fs_work_destroy(read_work);
+	heap_free(heap, read_data);
+
+	heap_free(heap, second);
+	heap_free(heap, first);
+	fs_destroy(fs);
+}
+
+// Flip a byte of a stored pack entry, reading it with verify on must fail.
+void homework2_test_verify(heap_t* heap) {
+	fs_t* fs = fs_create(heap, 16, 4);
+
+	char entry[8192];
+	for (size_t i = 0; i < sizeof(entry); ++i) {
+		entry[i] = (char)(i * 13 + 1);
+	}
+	CreateDirectoryA("hw2_verify", NULL);
+	homework2_write_file(fs, "hw2_verify/entry.bin", entry, sizeof(entry));
+	// stored raw so that the entry's bytes can be found in the pack
+	bool packed = fs_pack(fs, "hw2_verify", "hw2_verify.pack", k_fs_compression_none, NULL);
+	assert(packed);
+
+	fs_work_t* pack_work = fs_read(fs, "hw2_verify.pack", heap, false, false);
+	char* pack = fs_work_get_buffer(pack_work);
+	size_t pack_len = fs_work_get_size(pack_work);
+	assert(fs_work_get_result(pack_work) == 0);
+	fs_work_destroy(pack_work);
+
+	size_t offset = 0;
+	while (offset + sizeof(entry) <= pack_len && memcmp(pack + offset, entry, sizeof(entry)) != 0) {
+		++offset;
+	}
+	bool found = pack && offset + sizeof(entry) <= pack_len;
+	assert(found);
+	if (!found) {
+		if (pack) {
+			heap_free(heap, pack);
+		}
+		fs_destroy(fs);
+		return;
+	}
+	pack[offset + 100] ^= 0xff;
+	homework2_write_file(fs, "hw2_verify.pack", pack, pack_len);
+	heap_free(heap, pack);
+	fs_destroy(fs);
+
+	fs_t* unchecked = fs_create(heap, 16, 4);
+	bool unchecked_mounted = fs_mount(unchecked, "hw2_verify.pack");
+	assert(unchecked_mounted);
+	fs_work_t* unchecked_work = fs_read(unchecked, "entry.bin", heap, false, false);
+	char* unchecked_data = fs_work_get_buffer(unchecked_work);
+	assert(fs_work_get_result(unchecked_work) == 0);
+	assert(unchecked_data && memcmp(unchecked_data, entry, sizeof(entry)) != 0);
+	fs_work_destroy(unchecked_work);
+	if (unchecked_data) {
+		heap_free(heap, unchecked_data);
+	}
+	fs_destroy(unchecked);
+
+	fs_t* verified = fs_create(heap, 16, 4);
+	bool verified_mounted = fs_mount(verified, "hw2_verify.pack");
+	assert(verified_mounted);
+	fs_set_verify(verified, true);
+	fs_work_t* verified_work = fs_read(verified, "entry.bin", heap, false, false);
+	assert(fs_work_get_result(verified_work) != 0);
+	assert(fs_work_get_buffer(verified_work) == NULL);
+	fs_work_destroy(verified_work);
+	fs_destroy(verified);
+}
+
 void homework2_test() {
 	heap_t* heap = heap_create(4096);
-	fs_t* fs = fs_create(heap, 16);
+	fs_t* fs = fs_create(heap, 16, 4);
 
 	//const bool disable_compression = false;
 	//homework2_test_internal(heap, fs, disable_compression);
@@ -40,6 +226,11 @@ void homework2_test() {
 	homework2_test_internal(heap, fs, enable_compression);
 
 	fs_destroy(fs);
+
+	homework2_test_pack(heap);
+	homework2_test_ranges(heap);
+	homework2_test_concurrent_writes(heap);
+	homework2_test_verify(heap);
 	heap_destroy(heap);
 }
 
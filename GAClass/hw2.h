@@ -6,6 +6,10 @@
 #include "fs.h"
 
 void homework2_test_internal(heap_t* heap, fs_t* fs, bool use_compression);
+void homework2_test_pack(heap_t* heap);
+void homework2_test_ranges(heap_t* heap);
+void homework2_test_concurrent_writes(heap_t* heap);
+void homework2_test_verify(heap_t* heap);
 void homework2_test();
 
 #endif
\ No newline at end of file
@@ -17,6 +17,13 @@ void homework3_slow_function(trace_t* trace) {
 	trace_duration_pop(trace);
 }
 
+// A zone through the macros, which record into the active trace rather than one passed in.
+void homework3_zone_function() {
+	TRACE_ZONE_BEGIN("homework3_zone_function");
+	thread_sleep(50);
+	TRACE_ZONE_END();
+}
+
 int homework3_test_func(void* data) {
 	trace_t* trace = data;
 	homework3_slow_function(trace);
@@ -52,6 +59,9 @@ void homework3_test() {
 	// Call a function that will push/pop duration events.
 	homework3_slow_function(trace);
 
+	// TRACE_ZONE_BEGIN and TRACE_ZONE_END also add an event each, to the trace being captured.
+	homework3_zone_function();
+
 	// Wait for thread to finish.
 	thread_destroy(thread);
 
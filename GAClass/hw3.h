@@ -4,6 +4,7 @@ typedef struct trace_t trace_t;
 
 void homework3_slower_function(trace_t* trace);
 void homework3_slow_function(trace_t* trace);
+void homework3_zone_function();
 int homework3_test_func(void* data);
 void homework3_test();
 
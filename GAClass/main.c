@@ -1,12 +1,16 @@
 #include "debug.h"
 #include "fs.h"
+#include "fs_bench.h"
 #include "heap.h"
 #include "render.h"
 #include "timer.h"
+#include "trace.h"
 #include "wm.h"
 #include "scene.h"
 
 #include <SDL.h>
+#include <stdlib.h>
+#include <string.h>
 
 int main(int argc, const char* argv[])
 {
@@ -16,11 +20,121 @@ int main(int argc, const char* argv[])
 	timer_startup();
 
 	heap_t* heap = heap_create(2 * 1024 * 1024);
-	fs_t* fs = fs_create(heap, 8);
+
+	trace_t* trace = trace_create(heap, 64 * 1024);
+	bool hitch_trace = false;
+	bool sample = false;
+	bool heap_profile = false;
+	const char* fs_bench_directory = NULL;
+	const char* fs_bench_suite_directory = NULL;
+	const char* fs_bench_json_path = NULL;
+	const char* pack_directory = NULL;
+	const char* pack_path = NULL;
+	const char* mount_path = NULL;
+	bool mount_direct = false;
+	bool verify = false;
+	const char* startup_manifest = NULL;
+	int pack_level = k_fs_compression_fast;
+	const char* pack_dictionary = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--hitch-trace") == 0) {
+			// write the last few frames to ga2022_hitch_<n>.json when a frame goes over 50 ms
+			hitch_trace = true;
+		}
+		if (strcmp(argv[i], "--sample") == 0) {
+			// also sample every thread's callstack into the hitch captures
+			sample = true;
+		}
+		if (strcmp(argv[i], "--heap-profile") == 0) {
+			// also record allocations, dumps get allocation flamegraph and leak reports
+			heap_profile = true;
+		}
+		if (strcmp(argv[i], "--fs-bench") == 0 && i + 1 < argc) {
+			fs_bench_directory = argv[++i];
+		}
+		if (strcmp(argv[i], "--fs-bench-json") == 0 && i + 2 < argc) {
+			// run the fs benchmark suite and exit, --fs-bench-json <directory> <json path>
+			fs_bench_suite_directory = argv[++i];
+			fs_bench_json_path = argv[++i];
+		}
+		if (strcmp(argv[i], "--pack") == 0 && i + 2 < argc) {
+			// pack a directory of assets and exit, --pack <directory> <pack path>
+			pack_directory = argv[++i];
+			pack_path = argv[++i];
+		}
+		if (strcmp(argv[i], "--pack-level") == 0 && i + 1 < argc) {
+			// compression level for --pack, 0 stores files raw and 3 and up are LZ4HC
+			pack_level = atoi(argv[++i]);
+		}
+		if (strcmp(argv[i], "--pack-dictionary") == 0 && i + 1 < argc) {
+			pack_dictionary = argv[++i];
+		}
+		if (strcmp(argv[i], "--mount") == 0 && i + 1 < argc) {
+			mount_path = argv[++i];
+		}
+		if (strcmp(argv[i], "--mount-direct") == 0 && i + 1 < argc) {
+			// mount a pack whose large entries are streamed with direct I/O
+			mount_path = argv[++i];
+			mount_direct = true;
+		}
+		if (strcmp(argv[i], "--startup-manifest") == 0 && i + 1 < argc) {
+			// prefetch what the last run read at startup and record this run's for the next
+			startup_manifest = argv[++i];
+		}
+		if (strcmp(argv[i], "--verify") == 0) {
+			// check reads from the mounted pack against its digests
+			verify = true;
+		}
+	}
+
+	// keep the last few frames of zones around for the profiler window and crash captures,
+	// hitches are only written out when asked for
+	trace_flight_recorder_start(trace, "ga2022", 8, hitch_trace ? 50 * 1000 : 0);
+	trace_set_stats(trace, true);
+	trace_set_allocations(trace, heap_profile);
+	if (sample) {
+		trace_sampler_start(trace, 1000, 16 * 1024);
+	}
+
+	if (fs_bench_suite_directory) {
+		bool succeeded = fs_bench_suite(heap, fs_bench_suite_directory, fs_bench_json_path);
+		trace_destroy(trace);
+		heap_destroy(heap);
+		return succeeded ? 0 : 1;
+	}
+	if (fs_bench_directory) {
+		fs_bench_run(heap, fs_bench_directory, 256);
+		trace_destroy(trace);
+		heap_destroy(heap);
+		return 0;
+	}
+
+	fs_t* fs = fs_create_overlapped(heap, 8, 4, 64);
+	if (pack_directory) {
+		bool packed = fs_pack(fs, pack_directory, pack_path, pack_level, pack_dictionary);
+		fs_destroy(fs);
+		trace_destroy(trace);
+		heap_destroy(heap);
+		return packed ? 0 : 1;
+	}
+	if (mount_path) {
+		if (mount_direct) {
+			fs_mount_direct(fs, mount_path);
+		} else {
+			fs_mount(fs, mount_path);
+		}
+	}
+	fs_set_verify(fs, verify);
+	if (startup_manifest) {
+		// replay what the last run read at startup, then record this run's startup for the next
+		fs_prefetch_manifest(fs, startup_manifest);
+		fs_record_manifest(fs, startup_manifest, 10 * 1000);
+	}
 	wm_window_t* window = wm_create(heap);
 	render_t* render = render_create(heap, window, true);
 
 	scene_t* scene = scene_create(heap, fs, window, render);
+	fs_prefetch_release(fs);
 
 	while (!wm_pump(window)) {
 		scene_update(scene);
@@ -32,6 +146,10 @@ int main(int argc, const char* argv[])
 
 	wm_destroy(window);
 	fs_destroy(fs);
+
+	trace_capture_stop(trace);
+	trace_destroy(trace);
+
 	heap_destroy(heap);
 
 	return 0;
@@ -73,4 +73,9 @@ void* queue_try_pop(queue_t* queue)
 		return item;
 	}
 	return NULL;
+}
+
+int queue_get_count(queue_t* queue)
+{
+	return atomic_load(&queue->tail_index) - atomic_load(&queue->head_index);
 }
\ No newline at end of file
@@ -36,4 +36,8 @@ bool queue_try_push(queue_t* queue, void* item);
 // Safe for multiple threads to pop at the same time.
 void* queue_try_pop(queue_t* queue);
 
+// Number of items in a queue.
+// Only a hint while other threads push and pop.
+int queue_get_count(queue_t* queue);
+
 #endif
\ No newline at end of file
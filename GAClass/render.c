@@ -5,6 +5,7 @@
 #include "heap.h"
 #include "queue.h"
 #include "thread.h"
+#include "trace.h"
 #include "wm.h"
 #include "debug.h"
 
@@ -38,6 +39,7 @@ typedef enum command_type_t
 typedef struct model_command_t
 {
 	command_type_t type;
+	uint32_t trace_id;
 	ecs_entity_ref_t entity;
 	gpu_mesh_info_t* mesh;
 	gpu_shader_info_t* shader;
@@ -47,15 +49,18 @@ typedef struct model_command_t
 typedef struct model_texture_command_t
 {
 	command_type_t type;
+	uint32_t trace_id;
 	ecs_entity_ref_t entity;
 	gpu_image_mesh_info_t* mesh;
 	gpu_shader_info_t* shader;
 	gpu_uniform_buffer_info_t uniform_buffer;
 } model_texture_command_t;
 
+// Every command starts with its type and trace id, so any command can be read through this.
 typedef struct frame_done_command_t
 {
 	command_type_t type;
+	uint32_t trace_id;
 } frame_done_command_t;
 
 typedef struct draw_instance_t
@@ -123,6 +128,7 @@ static draw_instance_t* create_or_get_instance_for_model_command(render_t* rende
 static draw_instance_t* create_or_get_instance_for_texture_model_command(render_t* render, gpu_texture_mesh_t* mesh, model_texture_command_t* command, gpu_shader_t* shader);
 
 static void destroy_stale_data(render_t* render);
+static void push_command(render_t* render, frame_done_command_t* command);
 
 render_t* render_create(heap_t* heap, wm_window_t* window, bool render_imgui)
 {
@@ -156,7 +162,7 @@ void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info
 	command->uniform_buffer.size = uniform->size;
 	command->uniform_buffer.data = heap_alloc(render->heap, uniform->size, 8);
 	memcpy(command->uniform_buffer.data, uniform->data, uniform->size);
-	queue_push(render->queue, command);
+	push_command(render, (frame_done_command_t*)command);
 }
 
 void render_push_model_image(render_t* render, ecs_entity_ref_t* entity, gpu_image_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform)
@@ -169,7 +175,7 @@ void render_push_model_image(render_t* render, ecs_entity_ref_t* entity, gpu_ima
 	command->uniform_buffer.size = uniform->size;
 	command->uniform_buffer.data = heap_alloc(render->heap, uniform->size, 8);
 	memcpy(command->uniform_buffer.data, uniform->data, uniform->size);
-	queue_push(render->queue, command);
+	push_command(render, (frame_done_command_t*)command);
 }
 
 void render_push_model_imgui(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform)
@@ -182,14 +188,24 @@ void render_push_model_imgui(render_t* render, ecs_entity_ref_t* entity, gpu_mes
 	command->uniform_buffer.size = uniform->size;
 	command->uniform_buffer.data = heap_alloc(render->heap, uniform->size, 8);
 	memcpy(command->uniform_buffer.data, uniform->data, uniform->size);
-	queue_push(render->queue, command);
+	push_command(render, (frame_done_command_t*)command);
 }
 
 void render_push_done(render_t* render)
 {
 	frame_done_command_t* command = heap_alloc(render->heap, sizeof(frame_done_command_t), 8);
 	command->type = k_command_frame_done;
+	push_command(render, command);
+}
+
+// Queue a command, tracing the time it waits for the render thread.
+static void push_command(render_t* render, frame_done_command_t* command)
+{
+	command->trace_id = TRACE_NEW_ID();
+	TRACE_ASYNC_BEGIN("render_queue_wait", command->trace_id);
+	TRACE_FLOW_BEGIN("render_flow", command->trace_id);
 	queue_push(render->queue, command);
+	TRACE_COUNTER("render_queue_depth", queue_get_count(render->queue));
 }
 
 static int render_thread_func(void* user)
@@ -217,6 +233,11 @@ static int render_thread_func(void* user)
 			break;
 		}
 
+		uint32_t trace_id = ((frame_done_command_t*)type)->trace_id;
+		TRACE_ASYNC_END("render_queue_wait", trace_id);
+		TRACE_ZONE_BEGIN("render_command");
+		TRACE_FLOW_END("render_flow", trace_id);
+
 		if (!cmdbuf)
 		{
 			cmdbuf = gpu_frame_begin(render->gpu);
@@ -226,6 +247,7 @@ static int render_thread_func(void* user)
 
 		if (*type == k_command_frame_done)
 		{
+			TRACE_ZONE_BEGIN("gpu_frame_end");
 			gpu_frame_end(render->gpu);
 			cmdbuf = NULL;
 			last_pipeline = NULL;
@@ -235,6 +257,7 @@ static int render_thread_func(void* user)
 			destroy_stale_data(render);
 			++render->frame_counter;
 			frame_index = render->frame_counter % render->gpu_frame_count;
+			TRACE_ZONE_END();
 		}
 		else if (*type == k_command_model)
 		{
@@ -287,6 +310,7 @@ static int render_thread_func(void* user)
 		}
 
 		heap_free(render->heap, type);
+		TRACE_ZONE_END();
 	}
 
 	gpu_wait_until_idle(render->gpu);
@@ -1,9 +1,12 @@
+#include "asset_cache.h"
 #include "ecs.h"
 #include "fs.h"
 #include "gpu.h"
 #include "heap.h"
 #include "render.h"
+#include "timer.h"
 #include "timer_object.h"
+#include "trace.h"
 #include "transform.h"
 #include "wm.h"
 #include "debug.h"
@@ -19,6 +22,7 @@
 #include "cimgui_impl.h"
 
 #define _USE_MATH_DEFINES
+#include <float.h>
 #include <math.h>
 #include <string.h>
 #include <stdint.h>
@@ -116,6 +120,20 @@ enum
 	k_max_entities = 512,
 };
 
+// profiler tab limits
+enum
+{
+	k_profiler_top_zones = 16,
+	k_profiler_frames = 4,
+	k_profiler_events = 16 * 1024,
+	k_profiler_threads = 16,
+	k_profiler_depth = 32,
+	k_profiler_flame_nodes = 512,
+	k_profiler_counters = 8,
+	k_profiler_counter_values = 256,
+	k_profiler_row_height = 16,
+};
+
 typedef struct scene_t
 {
 	heap_t* heap;
@@ -151,16 +169,22 @@ typedef struct scene_t
 	gpu_mesh_info_t cube_mesh;
 	gpu_shader_info_t cube_shader;
 
-	fs_work_t* vertex_shader_work;
-	fs_work_t* fragment_shader_work;
+	// shaders are shared through the asset cache, each shader info holds its own references
+	asset_cache_t* assets;
+	asset_t* ui_shader_assets[2];
+	asset_t* object_shader_assets[2];
 
 	SDL_Window* imgui_window;
 	ImVec4 clearColor;
 	ImGui_ImplVulkanH_Window* wd;
+
+	trace_event_t* profiler_events;
 } scene_t;
 
 // general
 static void draw_models(scene_t* scene);
+static void load_shader(scene_t* scene, gpu_shader_info_t* shader, asset_t** assets,
+	const char* vertex_path, const char* fragment_path, int uniform_buffer_count);
 static void unload_shader_resources(scene_t* scene);
 
 // camera
@@ -205,6 +229,11 @@ static vec3f_t get_collision_max(collider_component_t col);
 
 static void InitIMGUI(scene_t* scene);
 static void IMGUI_HIERARCHY(scene_t* scene);
+static void IMGUI_PROFILER(scene_t* scene);
+static void IMGUI_PROFILER_TOP_ZONES(trace_t* trace);
+static void IMGUI_PROFILER_TIMELINE(trace_event_t* events, int count);
+static void IMGUI_PROFILER_FLAME_GRAPH(trace_event_t* events, int count);
+static void IMGUI_PROFILER_COUNTERS(trace_event_t* events, int count);
 
 // controls
 static void move_object_x_up(scene_t* scene, float dt);
@@ -229,9 +258,13 @@ scene_t* scene_create(heap_t* heap, fs_t* fs, wm_window_t* window, render_t* ren
 	scene_t* scene = heap_alloc(heap, sizeof(scene_t), 8);
 	scene->heap = heap;
 	scene->fs = fs;
+	scene->assets = asset_cache_create(heap, fs, 16 * 1024 * 1024);
+	memset(scene->ui_shader_assets, 0, sizeof(scene->ui_shader_assets));
+	memset(scene->object_shader_assets, 0, sizeof(scene->object_shader_assets));
 	scene->window = window;
 	scene->render = render;
 	scene->next_free_entity = 0;
+	scene->profiler_events = heap_alloc(heap, sizeof(trace_event_t) * k_profiler_events, 8);
 
 	scene->timer = timer_object_create(heap, NULL);
 
@@ -726,12 +759,17 @@ void scene_destroy(scene_t* scene)
 	timer_object_destroy(scene->timer);
 
 	unload_shader_resources(scene);
+	asset_cache_destroy(scene->assets);
 
+	heap_free(scene->heap, scene->profiler_events);
 	heap_free(scene->heap, scene);
 }
 
 void scene_update(scene_t* scene) {
 	timer_object_update(scene->timer);
+	trace_frame_mark(g_trace_active, timer_object_get_delta_us(scene->timer));
+	TRACE_COUNTER("heap_bytes", heap_get_allocated(scene->heap));
+	TRACE_ZONE_BEGIN("scene_update");
 	ecs_update(scene->ecs);
 	update_camera(scene);
 
@@ -741,10 +779,12 @@ void scene_update(scene_t* scene) {
 
 	draw_models(scene);
 	render_push_done(scene->render);
+	TRACE_ZONE_END();
 }
 
 static void draw_models(scene_t* scene)
 {
+	TRACE_ZONE_BEGIN("draw_models");
 	uint64_t k_camera_query_mask = (1ULL << scene->camera_type);
 	for (ecs_query_t camera_query = ecs_query_create(scene->ecs, k_camera_query_mask);
 		ecs_query_is_valid(scene->ecs, &camera_query);
@@ -822,6 +862,7 @@ static void draw_models(scene_t* scene)
 			render_push_model_imgui(scene->render, &entity_ref, ui_comp->mesh_info, ui_comp->shader_info, &uniform_info);
 		}
 	}
+	TRACE_ZONE_END();
 }
 
 
@@ -931,16 +972,8 @@ static void spawn_scene_hierarchy(scene_t* scene) {
 }
 
 static void load_scene_hierarchy_resources(scene_t* scene, const char* image_location) {
-	scene->vertex_shader_work = fs_read(scene->fs, "shaders/triangle-vert.spv", scene->heap, false, false);
-	scene->fragment_shader_work = fs_read(scene->fs, "shaders/triangle-frag.spv", scene->heap, false, false);
-	scene->ui_shader = (gpu_shader_info_t)
-	{
-		.vertex_shader_data = fs_work_get_buffer(scene->vertex_shader_work),
-		.vertex_shader_size = fs_work_get_size(scene->vertex_shader_work),
-		.fragment_shader_data = fs_work_get_buffer(scene->fragment_shader_work),
-		.fragment_shader_size = fs_work_get_size(scene->fragment_shader_work),
-		.uniform_buffer_count = 2,
-	};
+	load_shader(scene, &scene->ui_shader, scene->ui_shader_assets,
+		"shaders/triangle-vert.spv", "shaders/triangle-frag.spv", 2);
 
 	static vec3f_t plane_verts[] =
 	{
@@ -1157,12 +1190,380 @@ static void IMGUI_HIERARCHY(scene_t* scene) {
 			}
 			igEndTabItem();
 		}
+		if (igBeginTabItem("Profiler", p_open, NULL)) {
+			IMGUI_PROFILER(scene);
+			igEndTabItem();
+		}
 		igEndTabBar();
 	}
 
 	igEnd();
 }
 
+static void IMGUI_PROFILER(scene_t* scene) {
+	trace_t* trace = g_trace_active;
+	if (trace == NULL) {
+		igText("No trace is running.");
+		return;
+	}
+
+	if (igBeginTabBar("Profiler", 0)) {
+		if (igBeginTabItem("Top zones", NULL, 0)) {
+			IMGUI_PROFILER_TOP_ZONES(trace);
+			igEndTabItem();
+		}
+		// the rest draw from a copy of the flight recorder's last few frames
+		if (igBeginTabItem("Timeline", NULL, 0)) {
+			int count = trace_snapshot_frames(trace, k_profiler_frames, scene->profiler_events, k_profiler_events);
+			IMGUI_PROFILER_TIMELINE(scene->profiler_events, count);
+			igEndTabItem();
+		}
+		if (igBeginTabItem("Flame graph", NULL, 0)) {
+			int count = trace_snapshot_frames(trace, 1, scene->profiler_events, k_profiler_events);
+			IMGUI_PROFILER_FLAME_GRAPH(scene->profiler_events, count);
+			igEndTabItem();
+		}
+		if (igBeginTabItem("Counters", NULL, 0)) {
+			int count = trace_snapshot_frames(trace, k_profiler_frames, scene->profiler_events, k_profiler_events);
+			IMGUI_PROFILER_COUNTERS(scene->profiler_events, count);
+			igEndTabItem();
+		}
+		igEndTabBar();
+	}
+}
+
+// top zones by self time, merged from the per-thread trace stats
+static void IMGUI_PROFILER_TOP_ZONES(trace_t* trace) {
+	ImVec2 buttonSize;
+	buttonSize.x = 0;
+	buttonSize.y = 0;
+	if (igButton("Reset", buttonSize))
+		trace_stats_reset(trace);
+	igSameLine(0.0f, -1.0f);
+	bool counters = trace_get_counters(trace);
+	if (igCheckbox("Thread cycles", &counters))
+		trace_set_counters(trace, counters);
+
+	trace_zone_stats_t stats[k_profiler_top_zones];
+	int count = trace_stats_get(trace, stats, k_profiler_top_zones);
+	if (count == 0) {
+		igText("No zone stats yet.");
+		return;
+	}
+
+	ImVec2 tableSize;
+	tableSize.x = 0;
+	tableSize.y = 0;
+	double cycles_per_us = trace_get_cycles_per_us(trace);
+	if (igBeginTable("Top zones", 8, ImGuiTableFlags_Borders | ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingFixedFit, tableSize, 0.0f)) {
+		igTableSetupColumn("Zone", 0, 0.0f, 0);
+		igTableSetupColumn("Count", 0, 0.0f, 0);
+		igTableSetupColumn("Self ms", 0, 0.0f, 0);
+		igTableSetupColumn("Total ms", 0, 0.0f, 0);
+		igTableSetupColumn("Avg us", 0, 0.0f, 0);
+		igTableSetupColumn("Min us", 0, 0.0f, 0);
+		igTableSetupColumn("Max us", 0, 0.0f, 0);
+		igTableSetupColumn("CPU %", 0, 0.0f, 0);
+		igTableHeadersRow();
+
+		for (int i = 0; i < count; ++i) {
+			const trace_zone_t* zone = trace_zone_get(stats[i].zone);
+			igTableNextRow(0, 0.0f);
+			igTableSetColumnIndex(0);
+			igText("%s", zone ? zone->name : "unknown");
+			if (igIsItemHovered(0)) {
+				// log2 histogram of the zone's durations
+				float histogram[k_trace_histogram_buckets];
+				for (int bucket = 0; bucket < k_trace_histogram_buckets; ++bucket)
+					histogram[bucket] = (float)stats[i].histogram[bucket];
+				ImVec2 graphSize;
+				graphSize.x = 240;
+				graphSize.y = 60;
+				igBeginTooltip();
+				igPlotHistogram_FloatPtr("##durations", histogram, k_trace_histogram_buckets, 0, "1 us .. 8 s, log2", 0.0f, FLT_MAX, graphSize, sizeof(float));
+				igEndTooltip();
+			}
+			igTableSetColumnIndex(1);
+			igText("%llu", (unsigned long long)stats[i].count);
+			igTableSetColumnIndex(2);
+			igText("%.3f", stats[i].self_us * 0.001);
+			igTableSetColumnIndex(3);
+			igText("%.3f", stats[i].total_us * 0.001);
+			igTableSetColumnIndex(4);
+			igText("%llu", (unsigned long long)(stats[i].total_us / stats[i].count));
+			igTableSetColumnIndex(5);
+			igText("%llu", (unsigned long long)stats[i].min_us);
+			igTableSetColumnIndex(6);
+			igText("%llu", (unsigned long long)stats[i].max_us);
+			igTableSetColumnIndex(7);
+			// share of the zone's wall time its thread was actually running
+			if (stats[i].cycles && stats[i].total_us && cycles_per_us > 0.0)
+				igText("%.1f", 100.0 * stats[i].cycles / (stats[i].total_us * cycles_per_us));
+			else
+				igText("-");
+		}
+		igEndTable();
+	}
+}
+
+// zones without a color get one picked from their id
+static ImU32 profiler_zone_color(const trace_zone_t* zone) {
+	uint32_t rgb = 0x808080;
+	if (zone && zone->color)
+		rgb = zone->color;
+	else if (zone)
+		rgb = 0x404040 + (((zone->id * 2654435761u) >> 8) & 0x7f7f7f);
+	// ImU32 colors are ABGR
+	return 0xff000000 | ((rgb & 0xff) << 16) | (rgb & 0xff00) | ((rgb >> 16) & 0xff);
+}
+
+// draw one zone as a bar, begin and end are ticks from the start of the view
+static void profiler_draw_zone(ImDrawList* draw_list, ImVec2 origin, double scale, uint64_t begin, uint64_t end, int depth, uint16_t zone_id) {
+	const trace_zone_t* zone = trace_zone_get(zone_id);
+	ImVec2 min;
+	min.x = origin.x + (float)(begin * scale);
+	min.y = origin.y + depth * k_profiler_row_height;
+	ImVec2 max;
+	max.x = __max(origin.x + (float)(end * scale), min.x + 1.0f);
+	max.y = min.y + k_profiler_row_height - 1.0f;
+
+	ImDrawList_AddRectFilled(draw_list, min, max, profiler_zone_color(zone), 0.0f, 0);
+	if (zone && max.x - min.x > 24.0f) {
+		ImVec2 text_pos;
+		text_pos.x = min.x + 2.0f;
+		text_pos.y = min.y;
+		ImDrawList_PushClipRect(draw_list, min, max, true);
+		ImDrawList_AddText_Vec2(draw_list, text_pos, 0xffffffff, zone->name, NULL);
+		ImDrawList_PopClipRect(draw_list);
+	}
+	if (igIsMouseHoveringRect(min, max, true))
+		igSetTooltip("%s\n%.3f ms", zone ? zone->name : "unknown", timer_ticks_to_us(end - begin) * 0.001);
+}
+
+// per-thread lanes of nested zones across the last few frames
+static void IMGUI_PROFILER_TIMELINE(trace_event_t* events, int count) {
+	uint64_t start_ticks = UINT64_MAX;
+	uint64_t end_ticks = 0;
+	uint32_t tids[k_profiler_threads];
+	int thread_count = 0;
+	for (int i = 0; i < count; ++i) {
+		if (events[i].event_type == 0)
+			continue;
+		start_ticks = __min(start_ticks, events[i].ticks);
+		end_ticks = __max(end_ticks, events[i].ticks);
+
+		int t = 0;
+		while (t < thread_count && tids[t] != events[i].tid)
+			t++;
+		if (t == thread_count && thread_count < k_profiler_threads && events[i].event_type == 'B')
+			tids[thread_count++] = events[i].tid;
+	}
+	if (thread_count == 0 || end_ticks <= start_ticks) {
+		igText("No frames recorded yet.");
+		return;
+	}
+
+	ImDrawList* draw_list = igGetWindowDrawList();
+	ImVec2 origin;
+	igGetCursorScreenPos(&origin);
+	ImVec2 avail;
+	igGetContentRegionAvail(&avail);
+	double scale = avail.x / (double)(end_ticks - start_ticks);
+
+	ImVec2 lane = origin;
+	for (int t = 0; t < thread_count; ++t) {
+		char label[32];
+		snprintf(label, sizeof(label), "thread %u", tids[t]);
+		ImDrawList_AddText_Vec2(draw_list, lane, 0xffc0c0c0, label, NULL);
+		lane.y += k_profiler_row_height;
+
+		uint64_t stack_ticks[k_profiler_depth];
+		uint16_t stack_zones[k_profiler_depth];
+		int depth = 0;
+		int lane_depth = 1;
+		for (int i = 0; i < count; ++i) {
+			trace_event_t* event = &events[i];
+			if (event->tid != tids[t])
+				continue;
+			if (event->event_type == 'B') {
+				if (depth < k_profiler_depth) {
+					stack_ticks[depth] = event->ticks;
+					stack_zones[depth] = event->zone;
+				}
+				depth++;
+			} else if (event->event_type == 'E' && depth > 0) { // ends of zones from before the view are skipped
+				depth--;
+				if (depth < k_profiler_depth)
+					profiler_draw_zone(draw_list, lane, scale, stack_ticks[depth] - start_ticks, event->ticks - start_ticks, depth, stack_zones[depth]);
+			}
+			lane_depth = __max(lane_depth, __min(depth, k_profiler_depth));
+		}
+		// zones still open at the end of the view
+		for (int d = __min(depth, k_profiler_depth) - 1; d >= 0; --d)
+			profiler_draw_zone(draw_list, lane, scale, stack_ticks[d] - start_ticks, end_ticks - start_ticks, d, stack_zones[d]);
+
+		lane.y += lane_depth * k_profiler_row_height + 4.0f;
+	}
+
+	// frame boundaries over every lane
+	for (int i = 0; i < count; ++i) {
+		if (events[i].event_type != 'i')
+			continue;
+		ImVec2 top;
+		top.x = origin.x + (float)((events[i].ticks - start_ticks) * scale);
+		top.y = origin.y;
+		ImVec2 bottom;
+		bottom.x = top.x + 1.0f;
+		bottom.y = lane.y;
+		ImDrawList_AddRectFilled(draw_list, top, bottom, 0x80ffffff, 0.0f, 0);
+	}
+
+	ImVec2 size;
+	size.x = avail.x;
+	size.y = lane.y - origin.y;
+	igDummy(size);
+}
+
+// one node per unique call path of the frame
+typedef struct profiler_flame_node_t
+{
+	uint16_t zone;
+	int first_child;
+	int next_sibling;
+	uint64_t ticks;
+} profiler_flame_node_t;
+
+static void profiler_draw_flame_node(ImDrawList* draw_list, ImVec2 origin, double scale, profiler_flame_node_t* nodes, int node, uint64_t begin, int depth) {
+	for (int child = nodes[node].first_child; child >= 0; child = nodes[child].next_sibling) {
+		profiler_draw_zone(draw_list, origin, scale, begin, begin + nodes[child].ticks, depth, nodes[child].zone);
+		profiler_draw_flame_node(draw_list, origin, scale, nodes, child, begin, depth + 1);
+		begin += nodes[child].ticks;
+	}
+}
+
+// zones of the last whole frame on the thread that marks frames, merged by call path
+static void IMGUI_PROFILER_FLAME_GRAPH(trace_event_t* events, int count) {
+	int frame_start = -1;
+	for (int i = count - 1; i >= 0 && frame_start < 0; --i) {
+		if (events[i].event_type == 'i')
+			frame_start = i;
+	}
+	if (frame_start < 0) {
+		igText("No frames recorded yet.");
+		return;
+	}
+	uint32_t tid = events[frame_start].tid;
+
+	profiler_flame_node_t nodes[k_profiler_flame_nodes];
+	int node_count = 1;
+	nodes[0].zone = 0;
+	nodes[0].first_child = -1;
+	nodes[0].next_sibling = -1;
+	nodes[0].ticks = 0;
+
+	int stack_nodes[k_profiler_depth];
+	uint64_t stack_ticks[k_profiler_depth];
+	int depth = 0;
+	int max_depth = 1;
+	uint64_t end_ticks = events[frame_start].ticks;
+	for (int i = frame_start + 1; i < count; ++i) {
+		trace_event_t* event = &events[i];
+		if (event->tid != tid)
+			continue;
+		end_ticks = __max(end_ticks, event->ticks);
+		if (event->event_type == 'B') {
+			int parent = depth > 0 ? stack_nodes[depth - 1] : 0;
+			int node = nodes[parent].first_child;
+			while (node >= 0 && nodes[node].zone != event->zone)
+				node = nodes[node].next_sibling;
+			if (node < 0 && node_count < k_profiler_flame_nodes) {
+				node = node_count++;
+				nodes[node].zone = event->zone;
+				nodes[node].first_child = -1;
+				nodes[node].next_sibling = -1;
+				nodes[node].ticks = 0;
+				// keep siblings in the order they first ran
+				int* link = &nodes[parent].first_child;
+				while (*link >= 0)
+					link = &nodes[*link].next_sibling;
+				*link = node;
+			}
+			if (node < 0 || depth >= k_profiler_depth)
+				break; // out of room, draw what we have
+			stack_nodes[depth] = node;
+			stack_ticks[depth] = event->ticks;
+			depth++;
+			max_depth = __max(max_depth, depth);
+		} else if (event->event_type == 'E' && depth > 0) {
+			depth--;
+			nodes[stack_nodes[depth]].ticks += event->ticks - stack_ticks[depth];
+		}
+	}
+	uint64_t frame_ticks = end_ticks - events[frame_start].ticks;
+	if (frame_ticks == 0) {
+		igText("No zones in the last frame.");
+		return;
+	}
+
+	igText("Frame %.3f ms", timer_ticks_to_us(frame_ticks) * 0.001);
+	ImDrawList* draw_list = igGetWindowDrawList();
+	ImVec2 origin;
+	igGetCursorScreenPos(&origin);
+	ImVec2 avail;
+	igGetContentRegionAvail(&avail);
+	profiler_draw_flame_node(draw_list, origin, avail.x / (double)frame_ticks, nodes, 0, 0, 0);
+
+	ImVec2 size;
+	size.x = avail.x;
+	size.y = (float)(max_depth * k_profiler_row_height);
+	igDummy(size);
+}
+
+// graphs of every counter recorded in the last few frames
+static void IMGUI_PROFILER_COUNTERS(trace_event_t* events, int count) {
+	uint16_t zones[k_profiler_counters];
+	float values[k_profiler_counters][k_profiler_counter_values];
+	int value_counts[k_profiler_counters];
+	int counter_count = 0;
+	for (int i = 0; i < count; ++i) {
+		if (events[i].event_type != 'C')
+			continue;
+		int c = 0;
+		while (c < counter_count && zones[c] != events[i].zone)
+			c++;
+		if (c == counter_count) {
+			if (counter_count == k_profiler_counters)
+				continue;
+			zones[c] = events[i].zone;
+			value_counts[c] = 0;
+			counter_count++;
+		}
+		if (value_counts[c] == k_profiler_counter_values) { // keep the newest values
+			memmove(values[c], values[c] + 1, sizeof(float) * (k_profiler_counter_values - 1));
+			value_counts[c]--;
+		}
+		values[c][value_counts[c]++] = (float)events[i].value;
+	}
+	if (counter_count == 0) {
+		igText("No counters recorded yet.");
+		return;
+	}
+
+	ImVec2 avail;
+	igGetContentRegionAvail(&avail);
+	ImVec2 graphSize;
+	graphSize.x = avail.x;
+	graphSize.y = 48;
+	for (int c = 0; c < counter_count; ++c) {
+		const trace_zone_t* zone = trace_zone_get(zones[c]);
+		char overlay[64];
+		snprintf(overlay, sizeof(overlay), "%s %.0f", zone ? zone->name : "unknown", values[c][value_counts[c] - 1]);
+		igPushID_Int(c);
+		igPlotLines_FloatPtr("##counter", values[c], value_counts[c], 0, overlay, 0.0f, FLT_MAX, graphSize, sizeof(float));
+		igPopID();
+	}
+}
+
 // ===========================================================================================
 //                                   COMPONENT ADD/REPLACE/ETC
 // ===========================================================================================
@@ -1186,16 +1587,8 @@ static void add_collider(scene_t* scene, ecs_entity_ref_t entity) {
 // ===========================================================================================
 
 static void load_object_scene_resources(scene_t* scene) {
-	scene->vertex_shader_work = fs_read(scene->fs, "shaders/triangle-vert.spv", scene->heap, false, false);
-	scene->fragment_shader_work = fs_read(scene->fs, "shaders/triangle-frag.spv", scene->heap, false, false);
-	scene->object_shader = (gpu_shader_info_t)
-	{
-		.vertex_shader_data = fs_work_get_buffer(scene->vertex_shader_work),
-		.vertex_shader_size = fs_work_get_size(scene->vertex_shader_work),
-		.fragment_shader_data = fs_work_get_buffer(scene->fragment_shader_work),
-		.fragment_shader_size = fs_work_get_size(scene->fragment_shader_work),
-		.uniform_buffer_count = 1,
-	};
+	load_shader(scene, &scene->object_shader, scene->object_shader_assets,
+		"shaders/triangle-vert.spv", "shaders/triangle-frag.spv", 1);
 
 	static vec3f_t cube_verts[] =
 	{
@@ -1270,16 +1663,8 @@ static void add_entity_type_to_object(scene_t* scene, ecs_entity_ref_t entity, i
 
 static void load_object_resources(scene_t* scene)
 {
-	scene->vertex_shader_work = fs_read(scene->fs, "shaders/default.vert.spv", scene->heap, false, false);
-	scene->fragment_shader_work = fs_read(scene->fs, "shaders/default.frag.spv", scene->heap, false, false);
-	scene->object_shader = (gpu_shader_info_t)
-	{
-		.vertex_shader_data = fs_work_get_buffer(scene->vertex_shader_work),
-		.vertex_shader_size = fs_work_get_size(scene->vertex_shader_work),
-		.fragment_shader_data = fs_work_get_buffer(scene->fragment_shader_work),
-		.fragment_shader_size = fs_work_get_size(scene->fragment_shader_work),
-		.uniform_buffer_count = 1,
-	};
+	load_shader(scene, &scene->object_shader, scene->object_shader_assets,
+		"shaders/default.vert.spv", "shaders/default.frag.spv", 1);
 
 	static vec3f_t cube_verts[] =
 	{
@@ -1318,11 +1703,37 @@ static void load_object_resources(scene_t* scene)
 	};
 }
 
-// unload all the shader resources used for the frag/vertex shader work
+// fill in a shader from the asset cache, releasing the assets it used before
+// assets holds the vertex and fragment shader references
+static void load_shader(scene_t* scene, gpu_shader_info_t* shader, asset_t** assets,
+	const char* vertex_path, const char* fragment_path, int uniform_buffer_count)
+{
+	asset_t* vertex = asset_cache_acquire(scene->assets, vertex_path);
+	asset_t* fragment = asset_cache_acquire(scene->assets, fragment_path);
+	asset_cache_release(scene->assets, assets[0]);
+	asset_cache_release(scene->assets, assets[1]);
+	assets[0] = vertex;
+	assets[1] = fragment;
+
+	*shader = (gpu_shader_info_t)
+	{
+		.vertex_shader_data = (void*)asset_get_data(scene->assets, vertex),
+		.vertex_shader_size = asset_get_size(scene->assets, vertex),
+		.fragment_shader_data = (void*)asset_get_data(scene->assets, fragment),
+		.fragment_shader_size = asset_get_size(scene->assets, fragment),
+		.uniform_buffer_count = uniform_buffer_count,
+	};
+}
+
+// release the shader assets, the cache frees them once it is over budget or destroyed
 static void unload_shader_resources(scene_t* scene)
 {
-	fs_work_destroy(scene->fragment_shader_work);
-	fs_work_destroy(scene->vertex_shader_work);
+	for (int i = 0; i < 2; ++i) {
+		asset_cache_release(scene->assets, scene->ui_shader_assets[i]);
+		asset_cache_release(scene->assets, scene->object_shader_assets[i]);
+		scene->ui_shader_assets[i] = NULL;
+		scene->object_shader_assets[i] = NULL;
+	}
 }
 
 // moving and rotating (x, y, z) due to the current "selected" entity
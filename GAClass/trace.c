@@ -1,214 +1,1496 @@
 #include "trace.h"
 
+#include "atomic.h"
 #include "heap.h"
 #include "timer.h"
-#include "timer_object.h"
-#include "queue.h"
 #include "debug.h"
 #include "mutex.h"
+#include "semaphore.h"
+#include "thread.h"
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <windowsx.h>
+#include <intrin.h>
+#include <tlhelp32.h>
+
+enum {
+	k_trace_max_zones = 4096,
+	k_trace_max_depth = 64,
+	k_trace_intern_buckets = 1024,
+	k_trace_name_pool_size = 64 * 1024,
+	k_trace_writer_size = 64 * 1024,
+	k_trace_stats_chunk_zones = 256,
+	k_trace_max_threads = 64,
+	k_trace_sample_depth = 32,
+	k_trace_sampler_threads = 64,
+	k_trace_sampler_modules = 256,
+	k_trace_sampler_refresh_ms = 250,
+	k_trace_frame_buckets = 16 * 1024,
+	k_trace_max_frames = 64 * 1024,
+	k_trace_max_callstacks = 16 * 1024,
+	k_trace_callstack_buckets = 4096,
+	k_trace_callstack_depth = 8,
+	k_trace_crash_wait_ms = 2000,
+};
+
+// State of the flight recorder dump buffer, only one dump is written at a time.
+enum {
+	k_trace_dump_idle,
+	k_trace_dump_copying,
+	k_trace_dump_pending,
+};
+
+typedef struct trace_stats_table_t trace_stats_table_t;
+typedef struct trace_sample_t trace_sample_t;
 
 /* A trace, defines a trace structure that can be use to trace processes
 
-A trace contains a path to the file, a heap, a definition for when the trace process begins, and a mutex
-- the first trace event element to add every recorded trace event
-- a trace event queue to push and pop elements
+A trace contains a path to the file, a heap, a flag for when the trace is capturing, and a mutex
+- a fixed array of event_capacity events, filled by an atomic index so threads never lock to record
+- a generation that changes on each capture so stale per-thread zone stacks are thrown away
+- in flight recorder mode the event array is a ring, and frame_starts remembers where each
+  of the last frame_capacity frames began so a dump can cover whole frames
+- a dump copies the ring into dump_events without locking or allocating and a writer thread
+  writes the file, hitch_cooldown frames are ignored after a dump so it cannot trigger itself
+- with record_stats each thread that ends a zone gets its own stats table, the tables are
+  listed here and only merged when someone asks for the stats
+- with record_counters each zone also measures the CPU cycles its thread was scheduled for,
+  tsc_start and ticks_start calibrate those cycles against wall time
+- while sampling a sampler thread stores callstacks of the other threads into a ring of samples,
+  they are symbolized and written out with the events
+- with record_allocations heap_alloc and heap_free add A and F events, written out as a live
+  bytes counter plus allocation flamegraph and still-live reports next to the trace file
 */
 typedef struct trace_t {
-	bool started;
-	const char* path;
 	heap_t* heap;
-	trace_event_t* trace_event_head;
-	queue_t* trace_event_queue;
+	const char* path;
+	int capturing;
+	int generation;
+	int pid;
+	trace_event_t* events;
+	int event_capacity;
+	int event_count;
 	mutex_t* mutex;
+
+	bool ring;
+	uint32_t ring_mask;
+	uint32_t* frame_starts;
+	int frame_capacity;
+	int frame_count;
+	uint64_t budget_us;
+	int dump_count;
+	int crash_dumped;
+	int hitch_cooldown;
+	trace_event_t* dump_events;
+	int dump_event_count;
+	char dump_reason[32];
+	int dump_state;
+	int dump_quit;
+	semaphore_t* dump_ready;
+	thread_t* dump_writer;
+
+	int serial;
+	bool record_events;
+	bool record_stats;
+	bool record_counters;
+	bool record_allocations;
+	uint64_t tsc_start;
+	uint64_t ticks_start;
+	trace_stats_table_t* stats_tables[k_trace_max_threads];
+	int stats_table_count;
+	trace_zone_stats_t* stats_merged;
+
+	thread_t* sampler;
+	int sampling;
+	uint32_t sample_interval_ms;
+	trace_sample_t* samples;
+	uint32_t sample_mask;
+	int sample_count;
 } trace_t;
 
-/* A trace event, in a single list format :
+// Statistics for one zone on one thread, times are in OS ticks.
+typedef struct trace_zone_counters_t {
+	uint64_t count;
+	uint64_t total_ticks;
+	uint64_t self_ticks;
+	uint64_t min_ticks;
+	uint64_t max_ticks;
+	uint64_t cycles;
+	uint32_t histogram[k_trace_histogram_buckets];
+} trace_zone_counters_t;
 
-A trace event contains:
-- name of function
-- process ID
-- thread ID
-- time
-- event type (supports B: Begin and E: End for now)
-- next trace event
-*/
-typedef struct trace_event_t {
-	const char* name;
-	int pid;
-	DWORD tid;
-	int ts;
-	char event_type;
-	trace_event_t* next;
-} trace_event_t;
+// Per-thread stats, indexed by zone id and only written by the owning thread.
+// Zones are counted in chunks that are allocated the first time a zone in them ends,
+// so every registered zone has counters without each thread paying for all of them.
+typedef struct trace_stats_table_t {
+	uint32_t tid;
+	trace_zone_counters_t* chunks[k_trace_max_zones / k_trace_stats_chunk_zones];
+} trace_stats_table_t;
+
+// Per-thread stack of open zones, so an end event knows which zone it closes.
+// Start and child ticks give the self time of each zone when it ends.
+typedef struct trace_thread_t {
+	trace_t* trace;
+	int generation;
+	uint32_t tid;
+	int depth;
+	uint16_t stack[k_trace_max_depth];
+	uint64_t start_ticks[k_trace_max_depth];
+	uint64_t child_ticks[k_trace_max_depth];
+	uint64_t start_cycles[k_trace_max_depth];
+	int stats_serial;
+	trace_stats_table_t* stats;
+} trace_thread_t;
+
+// A callstack of one thread taken by the sampler.
+// seq is the sample's index in the ring plus one, cleared first and written last so
+// a reader can tell when the sampler has reused the slot.
+typedef struct trace_sample_t {
+	volatile uint32_t seq;
+	uint32_t tid;
+	uint64_t ticks;
+	int depth;
+	uint64_t frames[k_trace_sample_depth];
+} trace_sample_t;
+
+// An interned allocation callstack, as captured by heap_alloc, and the zone that was open.
+typedef struct trace_callstack_t {
+	uint16_t tag;
+	uint16_t next;
+	void* frames[k_trace_callstack_depth];
+} trace_callstack_t;
+
+// Unique callstack prefixes of the written samples, the stackFrames of a Chrome trace.
+typedef struct trace_frame_node_t {
+	uint64_t address;
+	int parent;
+	int next;
+} trace_frame_node_t;
+
+typedef struct trace_frame_tree_t {
+	trace_frame_node_t* nodes;
+	int count;
+	int* buckets;
+} trace_frame_tree_t;
+
+// Buffered writer for the JSON output.
+typedef struct trace_writer_t {
+	HANDLE handle;
+	char* buffer;
+	size_t size;
+	bool failed;
+} trace_writer_t;
+
+trace_t* volatile g_trace_active = NULL;
+
+// Zone table shared by every trace. Id 0 is reserved for "no zone".
+static trace_zone_t s_zones[k_trace_max_zones];
+static int s_zone_count = 1;
+static int s_zone_lock = 0;
+
+// Names interned by trace_duration_push, chained by hash.
+static uint16_t s_intern_buckets[k_trace_intern_buckets];
+static uint16_t s_intern_next[k_trace_max_zones];
+static char s_name_pool[k_trace_name_pool_size];
+static int s_name_pool_used = 0;
+
+static int s_next_id = 0;
+static int s_next_serial = 0;
+
+// Allocation callstacks interned by trace_heap_alloc, id 0 is reserved for "unknown".
+static trace_callstack_t s_callstacks[k_trace_max_callstacks];
+static uint16_t s_callstack_buckets[k_trace_callstack_buckets];
+static int s_callstack_count = 1;
+
+static __declspec(thread) trace_thread_t s_trace_thread;
+
+static void trace_zone_lock() {
+	while (atomic_compare_and_exchange(&s_zone_lock, 0, 1) != 0) {
+		thread_sleep(0);
+	}
+}
+
+static void trace_zone_unlock() {
+	atomic_store(&s_zone_lock, 0);
+}
+
+// Must be called with the zone lock held.
+static uint16_t trace_zone_add(const char* name, const char* file, int line, uint32_t color) {
+	if (s_zone_count >= k_trace_max_zones) {
+		debug_print_line(k_print_warning, "Trace zone table is full, '%s' will not be traced.\n", name);
+		return 0;
+	}
+	uint16_t id = (uint16_t)s_zone_count++;
+	s_zones[id].name = name;
+	s_zones[id].file = file;
+	s_zones[id].line = line;
+	s_zones[id].color = color;
+	s_zones[id].id = id;
+	return id;
+}
+
+uint16_t trace_zone_register(trace_zone_t* zone) {
+	trace_zone_lock();
+	if (zone->id == 0) {
+		zone->id = trace_zone_add(zone->name, zone->file, zone->line, zone->color);
+	}
+	trace_zone_unlock();
+	return zone->id;
+}
+
+const trace_zone_t* trace_zone_get(uint16_t id) {
+	if (id == 0 || id >= atomic_load(&s_zone_count)) {
+		return NULL;
+	}
+	return &s_zones[id];
+}
+
+// FNV-1a over the name, only used to intern names from trace_duration_push.
+static uint32_t trace_hash_name(const char* name) {
+	uint32_t hash = 2166136261u;
+	while (*name) {
+		hash ^= (uint8_t)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static uint16_t trace_zone_intern(const char* name) {
+	uint32_t bucket = trace_hash_name(name) % k_trace_intern_buckets;
+
+	trace_zone_lock();
+	uint16_t id = s_intern_buckets[bucket];
+	while (id != 0 && strcmp(s_zones[id].name, name) != 0) {
+		id = s_intern_next[id];
+	}
+	if (id == 0) {
+		// copy the name, the caller's string does not have to outlive the trace
+		size_t length = strlen(name) + 1;
+		if (s_name_pool_used + length <= sizeof(s_name_pool)) {
+			char* copy = s_name_pool + s_name_pool_used;
+			memcpy(copy, name, length);
+			s_name_pool_used += (int)length;
+			id = trace_zone_add(copy, NULL, 0, 0);
+			if (id != 0) {
+				s_intern_next[id] = s_intern_buckets[bucket];
+				s_intern_buckets[bucket] = id;
+			}
+		}
+	}
+	trace_zone_unlock();
+	return id;
+}
+
+static trace_thread_t* trace_thread_get(trace_t* trace) {
+	trace_thread_t* thread = &s_trace_thread;
+	if (thread->trace != trace || thread->generation != trace->generation) {
+		thread->trace = trace;
+		thread->generation = trace->generation;
+		thread->tid = GetCurrentThreadId();
+		thread->depth = 0;
+	}
+	return thread;
+}
+
+static void trace_record(trace_t* trace, trace_thread_t* thread, uint16_t zone, char event_type, uint32_t id, uint64_t ticks, uint64_t value) {
+	uint32_t index;
+	if (trace->ring) {
+		// the ring size is a power of two, so the counter can wrap freely
+		index = (uint32_t)atomic_increment(&trace->event_count) & trace->ring_mask;
+	} else {
+		if (atomic_load(&trace->event_count) >= trace->event_capacity) {
+			return; // buffer is full, drop the event
+		}
+		index = (uint32_t)atomic_increment(&trace->event_count);
+		if (index >= (uint32_t)trace->event_capacity) {
+			return;
+		}
+	}
+	trace_event_t* event = &trace->events[index];
+	event->event_type = 0;
+	event->ticks = ticks;
+	event->value = value;
+	event->tid = thread->tid;
+	event->id = id;
+	event->zone = zone;
+	event->event_type = event_type;
+}
 
 trace_t* trace_create(heap_t* heap, int event_capacity) {
 	trace_t* trace = heap_alloc(heap, sizeof(trace_t), 8);
 	trace->heap = heap;
-	trace->started = false;
-	trace->trace_event_head = NULL;
-	trace->trace_event_queue = queue_create(heap, event_capacity);
+	trace->path = NULL;
+	trace->capturing = 0;
+	trace->generation = 0;
+	trace->pid = GetCurrentProcessId();
+	trace->events = heap_alloc(heap, sizeof(trace_event_t) * event_capacity, 8);
+	trace->event_capacity = event_capacity;
+	trace->event_count = 0;
 	trace->mutex = mutex_create();
+	trace->ring = false;
+	trace->ring_mask = 0;
+	trace->frame_starts = NULL;
+	trace->frame_capacity = 0;
+	trace->frame_count = 0;
+	trace->budget_us = 0;
+	trace->dump_count = 0;
+	trace->crash_dumped = 0;
+	trace->hitch_cooldown = 0;
+	trace->dump_events = NULL;
+	trace->dump_event_count = 0;
+	trace->dump_reason[0] = '\0';
+	trace->dump_state = k_trace_dump_idle;
+	trace->dump_quit = 0;
+	trace->dump_ready = NULL;
+	trace->dump_writer = NULL;
+	trace->serial = atomic_increment(&s_next_serial) + 1;
+	trace->record_events = true;
+	trace->record_stats = false;
+	trace->stats_table_count = 0;
+	trace->stats_merged = NULL;
+	trace->record_counters = false;
+	trace->record_allocations = false;
+	trace->tsc_start = __rdtsc();
+	trace->ticks_start = timer_get_ticks();
+	trace->sampler = NULL;
+	trace->sampling = 0;
+	trace->sample_interval_ms = 0;
+	trace->samples = NULL;
+	trace->sample_mask = 0;
+	trace->sample_count = 0;
 	return trace;
 }
 
 void trace_destroy(trace_t* trace) {
-	queue_destroy(trace->trace_event_queue);
+	if (g_trace_active == trace) {
+		g_trace_active = NULL;
+	}
+	trace_sampler_stop(trace);
+	if (trace->samples) {
+		heap_free(trace->heap, trace->samples);
+	}
+	if (trace->frame_starts) {
+		debug_set_exception_callback(NULL, NULL);
+		heap_free(trace->heap, trace->frame_starts);
+	}
+	if (trace->dump_writer) {
+		// a dump still pending is written before the writer quits
+		atomic_store(&trace->dump_quit, 1);
+		semaphore_release(trace->dump_ready);
+		thread_destroy(trace->dump_writer);
+		semaphore_destroy(trace->dump_ready);
+		heap_free(trace->heap, trace->dump_events);
+	}
+	for (int i = 0; i < trace->stats_table_count; ++i) {
+		for (int chunk = 0; chunk < _countof(trace->stats_tables[i]->chunks); ++chunk) {
+			if (trace->stats_tables[i]->chunks[chunk]) {
+				heap_free(trace->heap, trace->stats_tables[i]->chunks[chunk]);
+			}
+		}
+		heap_free(trace->heap, trace->stats_tables[i]);
+	}
+	if (trace->stats_merged) {
+		heap_free(trace->heap, trace->stats_merged);
+	}
 	mutex_destroy(trace->mutex);
+	heap_free(trace->heap, trace->events);
 	heap_free(trace->heap, trace);
 }
 
-void trace_duration_push(trace_t* trace, const char* name) {
-	if (trace == NULL || !trace->started) // trace has not started or null
+// Get the stats table of the current thread, creating it the first time.
+// NULL once k_trace_max_threads threads have tables.
+static trace_stats_table_t* trace_stats_table_get(trace_t* trace, trace_thread_t* thread) {
+	if (thread->stats_serial != trace->serial) {
+		thread->stats_serial = trace->serial;
+		thread->stats = NULL;
+
+		mutex_lock(trace->mutex);
+		if (trace->stats_table_count < k_trace_max_threads) {
+			trace_stats_table_t* table = heap_alloc(trace->heap, sizeof(trace_stats_table_t), 8);
+			memset(table, 0, sizeof(trace_stats_table_t));
+			table->tid = thread->tid;
+			trace->stats_tables[trace->stats_table_count++] = table;
+			thread->stats = table;
+		} else {
+			debug_print_line(k_print_warning, "Trace stats table limit reached, thread %u will not be counted.\n", thread->tid);
+		}
+		mutex_unlock(trace->mutex);
+	}
+	return thread->stats;
+}
+
+// Bucket n of the histogram holds durations of [2^n, 2^(n+1)) us.
+static int trace_histogram_bucket(uint64_t us) {
+	unsigned long bit;
+	if (!_BitScanReverse64(&bit, us)) {
+		return 0;
+	}
+	return __min((int)bit, k_trace_histogram_buckets - 1);
+}
+
+// Cycles the current thread has been scheduled for, time spent blocked or preempted does not count.
+static uint64_t trace_thread_cycles() {
+	ULONG64 cycles = 0;
+	QueryThreadCycleTime(GetCurrentThread(), &cycles);
+	return cycles;
+}
+
+static void trace_stats_add(trace_t* trace, trace_thread_t* thread, uint16_t id, uint64_t ticks, uint64_t self_ticks, uint64_t cycles) {
+	if (id == 0 || id >= k_trace_max_zones) {
+		return;
+	}
+	trace_stats_table_t* table = trace_stats_table_get(trace, thread);
+	if (table == NULL) {
 		return;
+	}
 
-	mutex_lock(trace->mutex);
+	trace_zone_counters_t** chunk = &table->chunks[id / k_trace_stats_chunk_zones];
+	if (*chunk == NULL) {
+		// published under the lock that trace_stats_get reads the chunks with
+		trace_zone_counters_t* counters = heap_alloc(trace->heap, sizeof(trace_zone_counters_t) * k_trace_stats_chunk_zones, 8);
+		memset(counters, 0, sizeof(trace_zone_counters_t) * k_trace_stats_chunk_zones);
+		mutex_lock(trace->mutex);
+		*chunk = counters;
+		mutex_unlock(trace->mutex);
+	}
+	trace_zone_counters_t* counters = &(*chunk)[id % k_trace_stats_chunk_zones];
+	if (counters->count == 0 || ticks < counters->min_ticks) {
+		counters->min_ticks = ticks;
+	}
+	if (ticks > counters->max_ticks) {
+		counters->max_ticks = ticks;
+	}
+	counters->total_ticks += ticks;
+	counters->self_ticks += self_ticks;
+	counters->cycles += cycles;
+	counters->histogram[trace_histogram_bucket(timer_ticks_to_us(ticks))]++;
+	counters->count++;
+}
 
-	// create a new trace event that begins with the current name
-	trace_event_t* trace_event = heap_alloc(trace->heap, sizeof(trace_event_t), 8);
-	trace_event->name = name;
-	trace_event->pid = getpid();
-	trace_event->event_type = 'B';
-	trace_event->tid = GetCurrentThreadId();
-	trace_event->ts = timer_ticks_to_ms(timer_get_ticks());
-	trace_event->next = NULL;
-	
-	// push trace into the queue
-	queue_push(trace->trace_event_queue, trace_event);
-
-	// add trace object to the end of trace
-	trace_event_t* last_event = trace->trace_event_head;
-	if (last_event == NULL) { // no trace objects are in trace_obj yet
-		trace->trace_event_head = trace_event;
-	} else {
-		trace_event_t* event_tracker = trace->trace_event_head;
-		while (event_tracker->next != NULL) { // loop through the obj to find the last trace object
-			event_tracker = event_tracker->next;
+static void trace_zone_begin_id(trace_t* trace, uint16_t id) {
+	trace_thread_t* thread = trace_thread_get(trace);
+	uint64_t ticks = timer_get_ticks();
+	if (thread->depth < k_trace_max_depth) {
+		thread->stack[thread->depth] = id;
+		thread->start_ticks[thread->depth] = ticks;
+		thread->child_ticks[thread->depth] = 0;
+		thread->start_cycles[thread->depth] = trace->record_counters ? trace_thread_cycles() : 0;
+	}
+	thread->depth++;
+	if (trace->record_events) {
+		trace_record(trace, thread, id, 'B', 0, ticks, 0);
+	}
+}
+
+void trace_zone_begin(trace_t* trace, trace_zone_t* zone) {
+	if (trace == NULL || !trace->capturing) // trace has not started or null
+		return;
+
+	trace_zone_begin_id(trace, zone->id ? zone->id : trace_zone_register(zone));
+}
+
+void trace_zone_end(trace_t* trace) {
+	if (trace == NULL || !trace->capturing) // trace has not started or null
+		return;
+
+	trace_thread_t* thread = trace_thread_get(trace);
+	if (thread->depth == 0) { // zone began before this capture did
+		return;
+	}
+	// read the cycle counter first so the timer call is not counted
+	uint64_t cycles = 0;
+	if (trace->record_counters && thread->depth <= k_trace_max_depth && thread->start_cycles[thread->depth - 1]) {
+		cycles = trace_thread_cycles() - thread->start_cycles[thread->depth - 1];
+	}
+	uint64_t ticks = timer_get_ticks();
+	thread->depth--;
+	uint16_t id = 0;
+	if (thread->depth < k_trace_max_depth) {
+		id = thread->stack[thread->depth];
+
+		// time spent in this zone counts as child time of the zone around it
+		uint64_t duration = ticks - thread->start_ticks[thread->depth];
+		if (thread->depth > 0) {
+			thread->child_ticks[thread->depth - 1] += duration;
+		}
+		if (trace->record_stats) {
+			trace_stats_add(trace, thread, id, duration, duration - thread->child_ticks[thread->depth], cycles);
 		}
-		event_tracker->next = trace_event; // add it to the end of the list
 	}
+	if (trace->record_events) {
+		trace_record(trace, thread, id, 'E', 0, ticks, cycles);
+	}
+}
 
-	mutex_unlock(trace->mutex);
+uint32_t trace_new_id() {
+	// skip 0, it marks events without an id
+	uint32_t id;
+	do {
+		id = (uint32_t)atomic_increment(&s_next_id) + 1;
+	} while (id == 0);
+	return id;
 }
 
-void trace_duration_pop(trace_t* trace) {
-	if (trace == NULL || !trace->started) // trace has not started
+void trace_zone_event(trace_t* trace, trace_zone_t* zone, char event_type, uint32_t id) {
+	if (trace == NULL || !trace->capturing || !trace->record_events || id == 0) // not capturing, or work issued before the capture
 		return;
 
-	mutex_lock(trace->mutex);
+	uint16_t zone_id = zone->id ? zone->id : trace_zone_register(zone);
+	trace_record(trace, trace_thread_get(trace), zone_id, event_type, id, timer_get_ticks(), 0);
+}
 
-	// pop first from the queue (active thread in that queue), 
-	// copy it to a list to then parse into json later
-	trace_event_t* first_event = queue_pop(trace->trace_event_queue);
-	trace_event_t* first_event_copy = heap_alloc(trace->heap, sizeof(trace_event_t), 8);
+void trace_counter(trace_t* trace, trace_zone_t* zone, uint64_t value) {
+	if (trace == NULL || !trace->capturing || !trace->record_events)
+		return;
 
-	first_event_copy->name = first_event->name;
-	first_event_copy->pid = first_event->pid;
-	first_event_copy->event_type = 'E';
-	first_event_copy->tid = first_event->tid;
-	first_event_copy->ts = timer_ticks_to_ms(timer_get_ticks());
-	first_event_copy->next = NULL;
+	uint16_t zone_id = zone->id ? zone->id : trace_zone_register(zone);
+	trace_record(trace, trace_thread_get(trace), zone_id, 'C', 0, timer_get_ticks(), value);
+}
 
-	// add trace object to the end of trace
-	trace_event_t* last_event = trace->trace_event_head;
-	if (last_event == NULL) { // no trace objects are in trace_obj yet
-		trace->trace_event_head = first_event_copy;
+static uint16_t trace_callstack_intern(uint16_t tag, void** frames) {
+	uint32_t hash = 2166136261u ^ tag;
+	for (int i = 0; i < k_trace_callstack_depth; ++i) {
+		hash = (hash ^ (uint32_t)((uintptr_t)frames[i] >> 4)) * 16777619u;
 	}
-	else {
-		trace_event_t* event_tracker = trace->trace_event_head;
-		while (event_tracker->next != NULL) { // loop through the obj to find the last trace object
-			event_tracker = event_tracker->next;
-		}
-		event_tracker->next = first_event_copy; // add it to the end of the list
+	uint32_t bucket = hash % k_trace_callstack_buckets;
+
+	trace_zone_lock();
+	uint16_t id = s_callstack_buckets[bucket];
+	while (id != 0 && (s_callstacks[id].tag != tag ||
+		memcmp(s_callstacks[id].frames, frames, sizeof(s_callstacks[id].frames)) != 0)) {
+		id = s_callstacks[id].next;
+	}
+	if (id == 0 && s_callstack_count < k_trace_max_callstacks) {
+		id = (uint16_t)s_callstack_count++;
+		s_callstacks[id].tag = tag;
+		memcpy(s_callstacks[id].frames, frames, sizeof(s_callstacks[id].frames));
+		s_callstacks[id].next = s_callstack_buckets[bucket];
+		s_callstack_buckets[bucket] = id;
 	}
+	trace_zone_unlock();
+	return id;
+}
 
-	mutex_unlock(trace->mutex);
+void trace_heap_alloc(trace_t* trace, void* address, size_t size, void** callstack) {
+	if (trace == NULL || !trace->capturing || !trace->record_events || !trace->record_allocations) // aggregate mode keeps no events
+		return;
+
+	// the innermost open zone tags the allocation
+	trace_thread_t* thread = trace_thread_get(trace);
+	uint16_t tag = thread->depth > 0 && thread->depth <= k_trace_max_depth ? thread->stack[thread->depth - 1] : 0;
+	uint16_t callstack_id = trace_callstack_intern(tag, callstack);
+	trace_record(trace, thread, callstack_id, 'A', (uint32_t)__min(size, UINT32_MAX), timer_get_ticks(), (uint64_t)(uintptr_t)address);
+}
+
+void trace_heap_free(trace_t* trace, void* address, size_t size) {
+	if (trace == NULL || !trace->capturing || !trace->record_events || !trace->record_allocations) // aggregate mode keeps no events
+		return;
+
+	trace_record(trace, trace_thread_get(trace), 0, 'F', (uint32_t)__min(size, UINT32_MAX), timer_get_ticks(), (uint64_t)(uintptr_t)address);
+}
+
+void trace_duration_push(trace_t* trace, const char* name) {
+	if (trace == NULL || !trace->capturing) // trace has not started or null
+		return;
+
+	trace_zone_begin_id(trace, trace_zone_intern(name));
+}
+
+void trace_duration_pop(trace_t* trace) {
+	trace_zone_end(trace);
 }
 
 void trace_capture_start(trace_t* trace, const char* path) {
-	trace->started = true;
+	mutex_lock(trace->mutex);
 	trace->path = path;
+	trace->ring = false;
+	trace->record_events = true;
+	memset(trace->events, 0, sizeof(trace_event_t) * trace->event_capacity);
+	atomic_store(&trace->event_count, 0);
+	atomic_increment(&trace->generation);
+	atomic_store(&trace->capturing, 1);
+	g_trace_active = trace;
+	mutex_unlock(trace->mutex);
 }
 
-// stops recording the trace events, begin writing the trace events into the JSON file
-void trace_capture_stop(trace_t* trace) {
+// =======================================================================================
+//									   WRITE TO JSON
+// =======================================================================================
 
-	mutex_lock(trace->mutex);
+static void trace_writer_flush(trace_writer_t* writer) {
+	if (writer->size && !writer->failed) {
+		DWORD bytes_written = 0;
+		if (!WriteFile(writer->handle, writer->buffer, (DWORD)writer->size, &bytes_written, NULL)) {
+			debug_print_line(k_print_error, "In 'trace_capture_stop' unable to write to json file.\n");
+			writer->failed = true;
+		}
+	}
+	writer->size = 0;
+}
+
+static void trace_writer_print(trace_writer_t* writer, const char* format, ...) {
+	if (writer->size + 1024 > k_trace_writer_size) {
+		trace_writer_flush(writer);
+	}
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(writer->buffer + writer->size, k_trace_writer_size - writer->size, format, args);
+	va_end(args);
+	if (length > 0) {
+		writer->size += __min((size_t)length, k_trace_writer_size - writer->size - 1);
+	}
+}
+
+// JSON strings cannot hold raw backslashes, which MSVC puts in __FILE__.
+static void trace_writer_escape(const char* source, char* dest, size_t dest_size) {
+	size_t used = 0;
+	while (source && *source && used + 2 < dest_size) {
+		if (*source == '\\' || *source == '"') {
+			dest[used++] = '\\';
+		}
+		dest[used++] = *source++;
+	}
+	dest[used] = '\0';
+}
+
+static bool trace_write_events(trace_t* trace, trace_writer_t* writer, trace_event_t* events, int count) {
+	bool first = true;
+	int64_t live_bytes = 0;
+	for (int i = 0; i < count; ++i) {
+		trace_event_t* event = &events[i];
+		if (event->event_type == 0) { // still being written when capture stopped
+			continue;
+		}
+		if (event->event_type == 'A' || event->event_type == 'F') {
+			// bytes allocated since the first event, frees of older allocations can take it below 0
+			live_bytes += event->event_type == 'A' ? (int64_t)event->id : -(int64_t)event->id;
+			trace_writer_print(writer, "%s\t\t{\"name\":\"live_bytes\",\"ph\":\"C\",\"pid\":%d,\"tid\":%u,\"ts\":%llu,\"args\":{\"value\":%lld}}",
+				first ? "" : ",\n", trace->pid, event->tid, (unsigned long long)timer_ticks_to_us(event->ticks), (long long)live_bytes);
+			first = false;
+			continue;
+		}
+
+		const trace_zone_t* zone = trace_zone_get(event->zone);
+		char name[256];
+		trace_writer_escape(zone ? zone->name : "unknown", name, sizeof(name));
+		trace_writer_print(writer, "%s\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":%u,\"ts\":%llu",
+			first ? "" : ",\n", name, event->event_type, trace->pid, event->tid,
+			(unsigned long long)timer_ticks_to_us(event->ticks));
+		if (event->id) {
+			// async slices and flow arrows are matched by category and id
+			trace_writer_print(writer, ",\"cat\":\"%s\",\"id\":%u", name, event->id);
+			if (event->event_type == 'f') {
+				trace_writer_print(writer, ",\"bp\":\"e\"");
+			}
+		}
+		if (event->event_type == 'B' && zone && zone->file) {
+			char file[512];
+			trace_writer_escape(zone->file, file, sizeof(file));
+			trace_writer_print(writer, ",\"args\":{\"file\":\"%s\",\"line\":%d}", file, zone->line);
+		}
+		if (event->event_type == 'E' && event->value) {
+			// args on the end event are merged into the slice
+			trace_writer_print(writer, ",\"args\":{\"thread_cycles\":%llu}", (unsigned long long)event->value);
+		}
+		if (event->event_type == 'C') {
+			trace_writer_print(writer, ",\"args\":{\"value\":%llu}", (unsigned long long)event->value);
+		}
+		if (event->event_type == 'i') {
+			trace_writer_print(writer, ",\"s\":\"g\"");
+		}
+		trace_writer_print(writer, "}");
+		first = false;
+	}
+	return first;
+}
+
+// Name of the function containing address, or the address itself without symbols.
+// The caller must have called SymInitialize.
+static void trace_symbol_name(HANDLE process, uint64_t address, char* name, size_t name_size) {
+	char symbol_buffer[sizeof(SYMBOL_INFO) + 256];
+	SYMBOL_INFO* symbol = (SYMBOL_INFO*)symbol_buffer;
+	memset(symbol, 0, sizeof(SYMBOL_INFO));
+	symbol->SizeOfStruct = sizeof(SYMBOL_INFO);
+	symbol->MaxNameLen = 255;
+	if (SymFromAddr(process, address, NULL, symbol)) {
+		snprintf(name, name_size, "%s", symbol->Name);
+	} else {
+		snprintf(name, name_size, "0x%llx", (unsigned long long)address);
+	}
+}
+
+static int trace_frame_tree_get(trace_frame_tree_t* tree, int parent, uint64_t address) {
+	uint32_t bucket = (uint32_t)(((address * 0x9E3779B97F4A7C15ull) >> 32) ^ (uint32_t)parent) & (k_trace_frame_buckets - 1);
+	for (int i = tree->buckets[bucket]; i >= 0; i = tree->nodes[i].next) {
+		if (tree->nodes[i].address == address && tree->nodes[i].parent == parent) {
+			return i;
+		}
+	}
+	if (tree->count >= k_trace_max_frames) {
+		return -1;
+	}
+	int index = tree->count++;
+	tree->nodes[index].address = address;
+	tree->nodes[index].parent = parent;
+	tree->nodes[index].next = tree->buckets[bucket];
+	tree->buckets[bucket] = index;
+	return index;
+}
+
+// Write the sampler's callstacks as P events followed by the stackFrames they point at,
+// then close the JSON object. Symbols are looked up here rather than while sampling.
+static void trace_write_samples(trace_t* trace, trace_writer_t* writer, bool first, uint64_t start_ticks) {
+	trace_frame_tree_t tree = {
+		.nodes = heap_alloc(trace->heap, sizeof(trace_frame_node_t) * k_trace_max_frames, 8),
+		.count = 0,
+		.buckets = heap_alloc(trace->heap, sizeof(int) * k_trace_frame_buckets, 8),
+	};
+	memset(tree.buckets, 0xff, sizeof(int) * k_trace_frame_buckets);
+
+	uint32_t end = (uint32_t)atomic_load(&trace->sample_count);
+	uint32_t ring_size = trace->sample_mask + 1;
+	uint32_t begin = end > ring_size ? end - ring_size : 0;
+	for (uint32_t index = begin; index != end; ++index) {
+		trace_sample_t* slot = &trace->samples[index & trace->sample_mask];
+		trace_sample_t sample = *slot;
+		if (sample.seq != index + 1 || slot->seq != index + 1 || sample.ticks < start_ticks) {
+			continue; // overwritten while we were copying it, or older than the events
+		}
+
+		// outermost frame first so callstacks share their common prefix
+		int node = -1;
+		for (int i = sample.depth - 1; i >= 0; --i) {
+			int child = trace_frame_tree_get(&tree, node, sample.frames[i]);
+			if (child < 0) {
+				break;
+			}
+			node = child;
+		}
+		if (node < 0) {
+			continue;
+		}
+		trace_writer_print(writer, "%s\t\t{\"name\":\"sample\",\"ph\":\"P\",\"pid\":%d,\"tid\":%u,\"ts\":%llu,\"sf\":\"%d\"}",
+			first ? "" : ",\n", trace->pid, sample.tid, (unsigned long long)timer_ticks_to_us(sample.ticks), node);
+		first = false;
+	}
+	trace_writer_print(writer, "\n\t],\n\t\"stackFrames\": {\n");
 
-	// clean most of the trace
-	trace->started = false;
-	trace_event_t* trace_event = trace->trace_event_head;
+	HANDLE process = GetCurrentProcess();
+	SymInitialize(process, NULL, TRUE);
+	for (int i = 0; i < tree.count; ++i) {
+		char symbol[256];
+		trace_symbol_name(process, tree.nodes[i].address, symbol, sizeof(symbol));
+		char name[512];
+		trace_writer_escape(symbol, name, sizeof(name));
+		trace_writer_print(writer, "%s\t\t\"%d\":{\"name\":\"%s\"", i == 0 ? "" : ",\n", i, name);
+		if (tree.nodes[i].parent >= 0) {
+			trace_writer_print(writer, ",\"parent\":\"%d\"", tree.nodes[i].parent);
+		}
+		trace_writer_print(writer, "}");
+	}
+	SymCleanup(process);
+	trace_writer_print(writer, "\n\t}\n}");
 
-	// =======================================================================================
-	//									   WRITE TO JSON
-	// =======================================================================================
+	heap_free(trace->heap, tree.buckets);
+	heap_free(trace->heap, tree.nodes);
+}
 
-	// write to JSON format for each saved trace event in the trace event list starting from head
+static bool trace_writer_open(trace_t* trace, trace_writer_t* writer, const char* path) {
 	wchar_t wide_path[1024];
-	if (MultiByteToWideChar(CP_UTF8, 0, trace->path, -1, wide_path, sizeof(wide_path)) <= 0) {
-		debug_print_line(k_print_error, "In 'trace_capture_stop' creating wide_path is invalid.\n");
-		return;
+	if (MultiByteToWideChar(CP_UTF8, 0, path, -1, wide_path, _countof(wide_path)) <= 0) {
+		debug_print_line(k_print_error, "In 'trace_writer_open' creating wide_path is invalid.\n");
+		return false;
 	}
 	HANDLE handle = CreateFile(wide_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
 		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 
 	if (handle == INVALID_HANDLE_VALUE) {
-		debug_print_line(k_print_error, "In 'trace_capture_stop' creating the handle is invalid.\n");
+		debug_print_line(k_print_error, "In 'trace_writer_open' creating the handle is invalid.\n");
+		return false;
+	}
+
+	writer->handle = handle;
+	writer->buffer = heap_alloc(trace->heap, k_trace_writer_size, 8);
+	writer->size = 0;
+	writer->failed = false;
+	return true;
+}
+
+static void trace_writer_close(trace_t* trace, trace_writer_t* writer) {
+	trace_writer_flush(writer);
+	heap_free(trace->heap, writer->buffer);
+	CloseHandle(writer->handle);
+}
+
+// Write the folded frames of an allocation callstack, its zone first and the allocating function last.
+static void trace_write_callstack(trace_writer_t* writer, HANDLE process, uint16_t callstack_id) {
+	const trace_zone_t* tag = trace_zone_get(s_callstacks[callstack_id].tag);
+	trace_writer_print(writer, "%s", tag ? tag->name : "untagged");
+	if (callstack_id == 0) {
+		trace_writer_print(writer, ";unknown");
 		return;
 	}
+	for (int i = k_trace_callstack_depth - 1; i >= 0; --i) {
+		if (s_callstacks[callstack_id].frames[i]) {
+			char name[256];
+			trace_symbol_name(process, (uint64_t)(uintptr_t)s_callstacks[callstack_id].frames[i], name, sizeof(name));
+			trace_writer_print(writer, ";%s", name);
+		}
+	}
+}
+
+/* Write the allocation reports of a trace file at path :
+
+- <path>.alloc.folded, bytes allocated per callstack in the folded format flamegraph tools read
+- <path>.live.txt, allocations made during the events and never freed, grouped by callstack
+*/
+static void trace_write_heap_reports(trace_t* trace, const char* path, trace_event_t* events, int count) {
+	uint64_t* allocated = heap_alloc(trace->heap, sizeof(uint64_t) * k_trace_max_callstacks, 8);
+	memset(allocated, 0, sizeof(uint64_t) * k_trace_max_callstacks);
+
+	// open addressed table from address to the index of its A event, -1 empty and -2 freed
+	int table_size = 1;
+	while (table_size < count * 2) {
+		table_size *= 2;
+	}
+	int* table = heap_alloc(trace->heap, sizeof(int) * table_size, 8);
+	memset(table, 0xff, sizeof(int) * table_size);
 
-	// write the first starting two lines to the file
-	char start_of_json_lines[47] = "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n";
+	for (int i = 0; i < count; ++i) {
+		trace_event_t* event = &events[i];
+		if (event->event_type != 'A' && event->event_type != 'F') {
+			continue;
+		}
+		uint32_t slot = (uint32_t)((event->value * 0x9E3779B97F4A7C15ull) >> 40) & (table_size - 1);
+		while (table[slot] != -1 && (table[slot] == -2 || events[table[slot]].value != event->value)) {
+			slot = (slot + 1) & (table_size - 1);
+		}
+		if (event->event_type == 'A') {
+			allocated[event->zone] += event->id;
+			table[slot] = i;
+		} else if (table[slot] >= 0) {
+			table[slot] = -2;
+		}
+	}
+
+	HANDLE process = GetCurrentProcess();
+	SymInitialize(process, NULL, TRUE);
+
+	char report_path[1024];
+	trace_writer_t writer;
+	snprintf(report_path, sizeof(report_path), "%s.alloc.folded", path);
+	if (trace_writer_open(trace, &writer, report_path)) {
+		for (int id = 0; id < k_trace_max_callstacks; ++id) {
+			if (allocated[id]) {
+				trace_write_callstack(&writer, process, (uint16_t)id);
+				trace_writer_print(&writer, " %llu\n", (unsigned long long)allocated[id]);
+			}
+		}
+		trace_writer_close(trace, &writer);
+	}
+
+	// reuse allocated to total what is still live per callstack
+	memset(allocated, 0, sizeof(uint64_t) * k_trace_max_callstacks);
+	int live_count = 0;
+	for (int slot = 0; slot < table_size; ++slot) {
+		if (table[slot] >= 0) {
+			allocated[events[table[slot]].zone] += events[table[slot]].id;
+			live_count++;
+		}
+	}
+	snprintf(report_path, sizeof(report_path), "%s.live.txt", path);
+	if (trace_writer_open(trace, &writer, report_path)) {
+		trace_writer_print(&writer, "%d allocations still live\n", live_count);
+		for (int slot = 0; slot < table_size; ++slot) {
+			if (table[slot] < 0) {
+				continue;
+			}
+			trace_event_t* event = &events[table[slot]];
+			trace_writer_print(&writer, "0x%llx %u bytes at ", (unsigned long long)event->value, event->id);
+			trace_write_callstack(&writer, process, event->zone);
+			trace_writer_print(&writer, "\n");
+		}
+		trace_writer_close(trace, &writer);
+	}
 
-	if (!WriteFile(handle, (LPVOID)start_of_json_lines, strlen(start_of_json_lines), NULL, NULL)) {
-		debug_print_line(k_print_error, "In 'trace_capture_stop' unable to write to json file.\n");
-		CloseHandle(handle);
+	SymCleanup(process);
+	heap_free(trace->heap, table);
+	heap_free(trace->heap, allocated);
+}
+
+// Write events to a Chrome trace file at path.
+static void trace_write_file(trace_t* trace, const char* path, trace_event_t* events, int count) {
+	trace_writer_t writer;
+	if (!trace_writer_open(trace, &writer, path)) {
 		return;
 	}
 
-	while (trace_event != NULL) { // for every trace event write into the file
-		char event_str[2048];
-		if (trace_event->next != NULL) { 
-			// events from start to last - 1
-			snprintf(event_str, sizeof(event_str),
-				"\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%lu\",\"ts\":\"%d\"},\n",
-				trace_event->name, trace_event->event_type, trace_event->pid, trace_event->tid, trace_event->ts);
-		} else { 
-			// last event remove the , from the event str
-			snprintf(event_str, sizeof(event_str),
-				"\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%lu\",\"ts\":\"%d\"}\n",
-				trace_event->name, trace_event->event_type, trace_event->pid, trace_event->tid, trace_event->ts);
+	trace_writer_print(&writer, "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+	bool first = trace_write_events(trace, &writer, events, count);
+	if (trace->samples) {
+		// samples taken since the oldest event, so a dump only gets its own frames
+		uint64_t start_ticks = 0;
+		for (int i = 0; i < count; ++i) {
+			if (events[i].event_type) {
+				start_ticks = events[i].ticks;
+				break;
+			}
 		}
+		trace_write_samples(trace, &writer, first, start_ticks);
+	} else {
+		trace_writer_print(&writer, "\n\t]\n}");
+	}
+	trace_writer_close(trace, &writer);
 
-		if (!WriteFile(handle, (LPVOID)event_str, strlen(event_str), NULL, NULL)) {
-			debug_print_line(k_print_error, "In 'trace_capture_stop' unable to write to json file.\n");
-			CloseHandle(handle);
-			return;
+	if (trace->record_allocations) {
+		trace_write_heap_reports(trace, path, events, count);
+	}
+}
+
+// stops recording the trace events, begin writing the trace events into the JSON file
+void trace_capture_stop(trace_t* trace) {
+
+	// stop new events before taking the lock
+	atomic_store(&trace->capturing, 0);
+	trace_sampler_stop(trace);
+	if (g_trace_active == trace) {
+		g_trace_active = NULL;
+	}
+
+	mutex_lock(trace->mutex);
+	if (!trace->ring && trace->record_events) { // the flight recorder only writes on a dump
+		int count = __min(atomic_load(&trace->event_count), trace->event_capacity);
+		trace_write_file(trace, trace->path, trace->events, count);
+	}
+	mutex_unlock(trace->mutex);
+}
+
+// =======================================================================================
+//									   FLIGHT RECORDER
+// =======================================================================================
+
+// Copy the retained frames into dump_events and wake the writer thread.
+// Takes no locks and does not allocate so the exception handler can use it.
+// Returns false if the previous dump is still being written.
+static bool trace_dump_queue(trace_t* trace, const char* reason) {
+	if (atomic_compare_and_exchange(&trace->dump_state, k_trace_dump_idle, k_trace_dump_copying) != k_trace_dump_idle) {
+		return false;
+	}
+
+	// the oldest retained frame starts where the slot we would overwrite next points
+	uint32_t end = (uint32_t)atomic_load(&trace->event_count);
+	int frames = trace->frame_count;
+	uint32_t start = frames >= trace->frame_capacity ? trace->frame_starts[frames % trace->frame_capacity] : 0;
+	uint32_t ring_size = trace->ring_mask + 1;
+	if (end - start > ring_size) {
+		start = end - ring_size;
+	}
+
+	int count = (int)(end - start);
+	for (int i = 0; i < count; ++i) {
+		trace->dump_events[i] = trace->events[(start + i) & trace->ring_mask];
+	}
+
+	// threads kept recording while we copied, drop anything they may have lapped
+	uint32_t now = (uint32_t)atomic_load(&trace->event_count);
+	if (now - start > ring_size) {
+		int lost = __min((int)(now - ring_size - start), count);
+		memmove(trace->dump_events, trace->dump_events + lost, sizeof(trace_event_t) * (count - lost));
+		count -= lost;
+	}
+
+	trace->dump_event_count = count;
+	strncpy_s(trace->dump_reason, sizeof(trace->dump_reason), reason, _TRUNCATE);
+	atomic_store(&trace->dump_state, k_trace_dump_pending);
+	semaphore_release(trace->dump_ready);
+	return true;
+}
+
+// Writes each queued dump, the trace lock is only ever taken here and never on the frame thread.
+static int trace_dump_writer_func(void* user) {
+	trace_t* trace = user;
+	while (true) {
+		semaphore_acquire(trace->dump_ready);
+		if (atomic_load(&trace->dump_state) == k_trace_dump_pending) {
+			char path[1024];
+			snprintf(path, sizeof(path), "%s_%s_%d.json", trace->path, trace->dump_reason, trace->dump_count++);
+			debug_print_line(k_print_info, "Flight recorder writing %d events to %s.\n", trace->dump_event_count, path);
+
+			mutex_lock(trace->mutex);
+			trace_write_file(trace, path, trace->dump_events, trace->dump_event_count);
+			mutex_unlock(trace->mutex);
+			atomic_store(&trace->dump_state, k_trace_dump_idle);
 		}
-		
-		
-		trace_event_t* temp = trace_event;
-		trace_event = trace_event->next;
-		heap_free(trace->heap, temp);
+		if (atomic_load(&trace->dump_quit)) {
+			break;
+		}
+	}
+	return 0;
+}
+
+// Runs inside the vectored exception handler, the faulting thread may hold the trace lock
+// or the heap lock so only the lock free copy is done here. Waits a bounded time for a hitch
+// dump in progress and then for the writer, the process may be too broken for it to finish.
+static void trace_crash_callback(void* user) {
+	trace_t* trace = user;
+	if (atomic_compare_and_exchange(&trace->crash_dumped, 0, 1) != 0) {
+		return;
+	}
+	int waited = 0;
+	while (!trace_dump_queue(trace, "crash") && waited < k_trace_crash_wait_ms) {
+		thread_sleep(10);
+		waited += 10;
+	}
+	while (atomic_load(&trace->dump_state) != k_trace_dump_idle && waited < k_trace_crash_wait_ms) {
+		thread_sleep(10);
+		waited += 10;
+	}
+}
+
+void trace_flight_recorder_start(trace_t* trace, const char* path, int frame_count, uint64_t budget_us) {
+	mutex_lock(trace->mutex);
+
+	// use the largest power of two that fits in the event buffer
+	uint32_t ring_size = 1;
+	while (ring_size * 2 <= (uint32_t)trace->event_capacity) {
+		ring_size *= 2;
+	}
+
+	if (trace->frame_starts) {
+		heap_free(trace->heap, trace->frame_starts);
+	}
+	trace->frame_capacity = __max(frame_count, 1);
+	trace->frame_starts = heap_alloc(trace->heap, sizeof(uint32_t) * trace->frame_capacity, 8);
+	memset(trace->frame_starts, 0, sizeof(uint32_t) * trace->frame_capacity);
+	trace->frame_count = 0;
+	trace->budget_us = budget_us;
+	trace->dump_count = 0;
+	trace->crash_dumped = 0;
+	// the first frame mark measures startup loading, not a frame
+	trace->hitch_cooldown = 1;
+
+	// dump_events holds a whole ring, the ring never grows past the event capacity
+	if (trace->dump_writer == NULL) {
+		trace->dump_events = heap_alloc(trace->heap, sizeof(trace_event_t) * trace->event_capacity, 8);
+		trace->dump_ready = semaphore_create(0, 2);
+		trace->dump_writer = thread_create(trace_dump_writer_func, trace);
 	}
 
-	// write the last two lines
-	char end_of_json_lines[6] = "\t]\n}";
+	trace->path = path;
+	trace->ring = true;
+	trace->record_events = true;
+	trace->ring_mask = ring_size - 1;
+	memset(trace->events, 0, sizeof(trace_event_t) * trace->event_capacity);
+	atomic_store(&trace->event_count, 0);
+	atomic_increment(&trace->generation);
+	atomic_store(&trace->capturing, 1);
+	g_trace_active = trace;
+
+	mutex_unlock(trace->mutex);
 
-	if (!WriteFile(handle, (LPVOID)end_of_json_lines, strlen(end_of_json_lines), NULL, NULL)) {
-		debug_print_line(k_print_error, "In 'trace_capture_stop' unable to write to json file.\n");
-		CloseHandle(handle);
+	debug_set_exception_callback(trace_crash_callback, trace);
+}
+
+void trace_frame_mark(trace_t* trace, uint64_t frame_us) {
+	if (trace == NULL || !trace->ring || !trace->capturing)
 		return;
+
+	// frame_starts[n % frame_capacity] is where frame n began in the ring
+	trace->frame_starts[trace->frame_count % trace->frame_capacity] = (uint32_t)atomic_load(&trace->event_count);
+	trace->frame_count++;
+
+	// instant event at the start of each frame, it also tells the profiler view which thread runs frames
+	static trace_zone_t s_frame_zone = { "frame", __FILE__, __LINE__, 0, 0 };
+	uint16_t frame_zone = s_frame_zone.id ? s_frame_zone.id : trace_zone_register(&s_frame_zone);
+	trace_record(trace, trace_thread_get(trace), frame_zone, 'i', 0, timer_get_ticks(), 0);
+
+	if (trace->hitch_cooldown > 0) {
+		trace->hitch_cooldown--;
+	} else if (trace->budget_us && frame_us > trace->budget_us) {
+		debug_print_line(k_print_warning, "Frame took %llu us, over the %llu us budget.\n",
+			(unsigned long long)frame_us, (unsigned long long)trace->budget_us);
+		// the dumped frames are in the file already, wait until they have all left the window
+		if (trace_dump_queue(trace, "hitch")) {
+			trace->hitch_cooldown = trace->frame_capacity;
+		}
 	}
+}
+
+int trace_snapshot_frames(trace_t* trace, int frame_count, trace_event_t* events, int capacity) {
+	if (trace == NULL || !trace->ring || !trace->capturing)
+		return 0;
 
+	// only whole frames, the one in progress is still being recorded
+	int frames = trace->frame_count;
+	frame_count = __min(frame_count, __min(frames - 1, trace->frame_capacity - 1));
+	if (frame_count <= 0 || capacity <= 0) {
+		return 0;
+	}
+	uint32_t end = trace->frame_starts[(frames - 1) % trace->frame_capacity];
+	uint32_t start = trace->frame_starts[(frames - 1 - frame_count) % trace->frame_capacity];
+	uint32_t ring_size = trace->ring_mask + 1;
+	if (end - start > ring_size) {
+		start = end - ring_size;
+	}
+	if (end - start > (uint32_t)capacity) {
+		start = end - (uint32_t)capacity;
+	}
+
+	int count = (int)(end - start);
+	for (int i = 0; i < count; ++i) {
+		events[i] = trace->events[(start + i) & trace->ring_mask];
+	}
+
+	// threads kept recording while we copied, drop anything they may have lapped
+	uint32_t now = (uint32_t)atomic_load(&trace->event_count);
+	if (now - start > ring_size) {
+		int lost = (int)(now - ring_size - start);
+		if (lost >= count) {
+			return 0;
+		}
+		memmove(events, events + lost, sizeof(trace_event_t) * (count - lost));
+		count -= lost;
+	}
+	return count;
+}
+
+void trace_flight_recorder_dump(trace_t* trace, const char* reason) {
+	if (trace == NULL || !trace->ring)
+		return;
+
+	if (!trace_dump_queue(trace, reason)) {
+		debug_print_line(k_print_warning, "Flight recorder is still writing a dump, %s dump skipped.\n", reason);
+	}
+}
+
+// =======================================================================================
+//									   AGGREGATE STATS
+// =======================================================================================
+
+void trace_aggregate_start(trace_t* trace) {
+	mutex_lock(trace->mutex);
+	trace->path = NULL;
+	trace->ring = false;
+	trace->record_events = false;
+	trace->record_stats = true;
+	atomic_increment(&trace->generation);
+	atomic_store(&trace->capturing, 1);
+	g_trace_active = trace;
+	mutex_unlock(trace->mutex);
+}
+
+void trace_set_stats(trace_t* trace, bool enabled) {
+	trace->record_stats = enabled;
+}
+
+void trace_set_allocations(trace_t* trace, bool enabled) {
+	trace->record_allocations = enabled;
+}
+
+void trace_set_counters(trace_t* trace, bool enabled) {
+	trace->record_counters = enabled;
+}
+
+bool trace_get_counters(trace_t* trace) {
+	return trace->record_counters;
+}
+
+double trace_get_cycles_per_us(trace_t* trace) {
+	uint64_t us = timer_ticks_to_us(timer_get_ticks() - trace->ticks_start);
+	return us ? (double)(__rdtsc() - trace->tsc_start) / us : 0.0;
+}
+
+void trace_stats_reset(trace_t* trace) {
+	mutex_lock(trace->mutex);
+	for (int i = 0; i < trace->stats_table_count; ++i) {
+		for (int chunk = 0; chunk < _countof(trace->stats_tables[i]->chunks); ++chunk) {
+			if (trace->stats_tables[i]->chunks[chunk]) {
+				memset(trace->stats_tables[i]->chunks[chunk], 0, sizeof(trace_zone_counters_t) * k_trace_stats_chunk_zones);
+			}
+		}
+	}
+	mutex_unlock(trace->mutex);
+}
+
+static int trace_stats_compare_self(const void* a, const void* b) {
+	const trace_zone_stats_t* stats_a = a;
+	const trace_zone_stats_t* stats_b = b;
+	if (stats_a->self_us != stats_b->self_us) {
+		return stats_a->self_us < stats_b->self_us ? 1 : -1;
+	}
+	return (int)stats_a->zone - (int)stats_b->zone;
+}
+
+int trace_stats_get(trace_t* trace, trace_zone_stats_t* stats, int capacity) {
+	if (trace == NULL) {
+		return 0;
+	}
+
+	mutex_lock(trace->mutex);
+	if (trace->stats_merged == NULL) {
+		trace->stats_merged = heap_alloc(trace->heap, sizeof(trace_zone_stats_t) * k_trace_max_zones, 8);
+	}
+	trace_zone_stats_t* merged = trace->stats_merged;
+	memset(merged, 0, sizeof(trace_zone_stats_t) * k_trace_max_zones);
+
+	// owners keep writing while we read, a zone that ends mid-merge may be off by one
+	int zone_count = __min(atomic_load(&s_zone_count), k_trace_max_zones);
+	for (int i = 0; i < trace->stats_table_count; ++i) {
+		trace_stats_table_t* table = trace->stats_tables[i];
+		for (int id = 1; id < zone_count; ++id) {
+			trace_zone_counters_t* chunk = table->chunks[id / k_trace_stats_chunk_zones];
+			if (chunk == NULL) {
+				// no zone of this chunk has ended on this thread, go to the next chunk
+				id += k_trace_stats_chunk_zones - 1 - id % k_trace_stats_chunk_zones;
+				continue;
+			}
+			trace_zone_counters_t* counters = &chunk[id % k_trace_stats_chunk_zones];
+			if (counters->count == 0) {
+				continue;
+			}
+			trace_zone_stats_t* zone = &merged[id];
+			if (zone->count == 0 || counters->min_ticks < zone->min_us) {
+				zone->min_us = counters->min_ticks;
+			}
+			zone->max_us = __max(zone->max_us, counters->max_ticks);
+			zone->total_us += counters->total_ticks;
+			zone->self_us += counters->self_ticks;
+			zone->cycles += counters->cycles;
+			zone->count += counters->count;
+			for (int bucket = 0; bucket < k_trace_histogram_buckets; ++bucket) {
+				zone->histogram[bucket] += counters->histogram[bucket];
+			}
+		}
+	}
+
+	// pack the zones that were hit and convert ticks to microseconds
+	int count = 0;
+	for (int id = 1; id < zone_count; ++id) {
+		trace_zone_stats_t* zone = &merged[id];
+		if (zone->count == 0) {
+			continue;
+		}
+		zone->zone = (uint16_t)id;
+		zone->total_us = timer_ticks_to_us(zone->total_us);
+		zone->self_us = timer_ticks_to_us(zone->self_us);
+		zone->min_us = timer_ticks_to_us(zone->min_us);
+		zone->max_us = timer_ticks_to_us(zone->max_us);
+		merged[count++] = *zone;
+	}
+	qsort(merged, count, sizeof(trace_zone_stats_t), trace_stats_compare_self);
+
+	count = __min(count, capacity);
+	memcpy(stats, merged, sizeof(trace_zone_stats_t) * count);
 	mutex_unlock(trace->mutex);
+	return count;
+}
+
+// =======================================================================================
+//									   SAMPLING PROFILER
+// =======================================================================================
 
-	CloseHandle(handle);
-	
+// Code range and unwind table of a module loaded in the process.
+typedef struct trace_module_t {
+	DWORD64 base;
+	DWORD64 end;
+	const RUNTIME_FUNCTION* functions;
+	DWORD function_count;
+} trace_module_t;
+
+// List the loaded modules and find their unwind tables in their PE headers.
+// Done while no thread is suspended, RtlLookupFunctionEntry would take ntdll's function table
+// lock which a suspended thread may hold.
+static int trace_sampler_modules(trace_module_t* modules, int capacity) {
+	HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPMODULE, 0);
+	if (snapshot == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+
+	int count = 0;
+	MODULEENTRY32 entry;
+	entry.dwSize = sizeof(entry);
+	BOOL more = Module32First(snapshot, &entry);
+	while (more && count < capacity) {
+		BYTE* base = entry.modBaseAddr;
+		IMAGE_NT_HEADERS* headers = (IMAGE_NT_HEADERS*)(base + ((IMAGE_DOS_HEADER*)base)->e_lfanew);
+		IMAGE_DATA_DIRECTORY* exceptions = &headers->OptionalHeader.DataDirectory[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+
+		trace_module_t* module = &modules[count++];
+		module->base = (DWORD64)base;
+		module->end = module->base + entry.modBaseSize;
+		module->functions = (const RUNTIME_FUNCTION*)(base + exceptions->VirtualAddress);
+		module->function_count = exceptions->Size / sizeof(RUNTIME_FUNCTION);
+		more = Module32Next(snapshot, &entry);
+	}
+	CloseHandle(snapshot);
+	return count;
+}
+
+// Find the unwind entry for rip, the table is sorted by address so binary search it.
+// image_base stays 0 when rip is in none of the modules.
+static const RUNTIME_FUNCTION* trace_sample_lookup(const trace_module_t* modules, int module_count, DWORD64 rip, DWORD64* image_base) {
+	for (int i = 0; i < module_count; ++i) {
+		const trace_module_t* module = &modules[i];
+		if (rip < module->base || rip >= module->end) {
+			continue;
+		}
+		*image_base = module->base;
+
+		DWORD offset = (DWORD)(rip - module->base);
+		DWORD low = 0;
+		DWORD high = module->function_count;
+		while (low < high) {
+			DWORD middle = low + (high - low) / 2;
+			const RUNTIME_FUNCTION* function = &module->functions[middle];
+			if (offset < function->BeginAddress) {
+				high = middle;
+			} else if (offset >= function->EndAddress) {
+				low = middle + 1;
+			} else {
+				return function;
+			}
+		}
+		return NULL;
+	}
+	return NULL;
+}
+
+// Walk the callstack of a suspended thread into sample.
+// Nothing here may allocate or lock, the thread could be holding the lock we want.
+static void trace_sample_unwind(const trace_module_t* modules, int module_count, CONTEXT* context, trace_sample_t* sample) {
+	while (sample->depth < k_trace_sample_depth && context->Rip) {
+		sample->frames[sample->depth++] = context->Rip;
+
+		DWORD64 image_base = 0;
+		const RUNTIME_FUNCTION* function = trace_sample_lookup(modules, module_count, context->Rip, &image_base);
+		if (image_base == 0) {
+			break; // generated code or a module loaded since the last snapshot
+		}
+		if (function) {
+			PVOID handler_data = NULL;
+			DWORD64 establisher_frame = 0;
+			RtlVirtualUnwind(UNW_FLAG_NHANDLER, image_base, context->Rip, (PRUNTIME_FUNCTION)function, context,
+				&handler_data, &establisher_frame, NULL);
+		} else if (sample->depth == 1) {
+			// a leaf function has no unwind data, its return address is on top of the stack
+			context->Rip = *(DWORD64*)context->Rsp;
+			context->Rsp += 8;
+		} else {
+			break; // code without unwind data further up, stop rather than guess
+		}
+	}
+}
+
+static void trace_sample_thread(trace_t* trace, const trace_module_t* modules, int module_count, HANDLE handle, DWORD tid) {
+	if (SuspendThread(handle) == (DWORD)-1) {
+		return; // thread has exited
+	}
+
+	CONTEXT context;
+	memset(&context, 0, sizeof(context));
+	context.ContextFlags = CONTEXT_CONTROL | CONTEXT_INTEGER;
+	if (GetThreadContext(handle, &context)) {
+		uint32_t index = (uint32_t)atomic_increment(&trace->sample_count);
+		trace_sample_t* sample = &trace->samples[index & trace->sample_mask];
+		sample->seq = 0;
+		sample->tid = tid;
+		sample->ticks = timer_get_ticks();
+		sample->depth = 0;
+		trace_sample_unwind(modules, module_count, &context, sample);
+		sample->seq = index + 1;
+	}
+
+	ResumeThread(handle);
+}
+
+static int trace_sampler_func(void* user) {
+	trace_t* trace = user;
+	DWORD process_id = GetCurrentProcessId();
+	DWORD self_id = GetCurrentThreadId();
+
+	HANDLE handles[k_trace_sampler_threads];
+	DWORD tids[k_trace_sampler_threads];
+	int thread_count = 0;
+	trace_module_t modules[k_trace_sampler_modules];
+	int module_count = 0;
+	uint64_t refresh_ticks = 0;
+
+	while (atomic_load(&trace->sampling)) {
+		// pick up threads started and modules loaded since the last look
+		if (timer_get_ticks() >= refresh_ticks) {
+			module_count = trace_sampler_modules(modules, k_trace_sampler_modules);
+
+			for (int i = 0; i < thread_count; ++i) {
+				CloseHandle(handles[i]);
+			}
+			thread_count = 0;
+
+			HANDLE snapshot = CreateToolhelp32Snapshot(TH32CS_SNAPTHREAD, 0);
+			if (snapshot != INVALID_HANDLE_VALUE) {
+				THREADENTRY32 entry;
+				entry.dwSize = sizeof(entry);
+				BOOL more = Thread32First(snapshot, &entry);
+				while (more && thread_count < k_trace_sampler_threads) {
+					if (entry.th32OwnerProcessID == process_id && entry.th32ThreadID != self_id) {
+						HANDLE handle = OpenThread(THREAD_SUSPEND_RESUME | THREAD_GET_CONTEXT | THREAD_QUERY_INFORMATION,
+							FALSE, entry.th32ThreadID);
+						if (handle) {
+							handles[thread_count] = handle;
+							tids[thread_count] = entry.th32ThreadID;
+							thread_count++;
+						}
+					}
+					more = Thread32Next(snapshot, &entry);
+				}
+				CloseHandle(snapshot);
+			}
+			refresh_ticks = timer_get_ticks() + timer_get_ticks_per_second() * k_trace_sampler_refresh_ms / 1000;
+		}
+
+		for (int i = 0; i < thread_count; ++i) {
+			trace_sample_thread(trace, modules, module_count, handles[i], tids[i]);
+		}
+		thread_sleep(trace->sample_interval_ms);
+	}
+
+	for (int i = 0; i < thread_count; ++i) {
+		CloseHandle(handles[i]);
+	}
+	return 0;
+}
+
+void trace_sampler_start(trace_t* trace, uint32_t rate_hz, int sample_capacity) {
+	trace_sampler_stop(trace);
+
+	// ring of the largest power of two that fits the capacity
+	uint32_t ring_size = 1;
+	while (ring_size * 2 <= (uint32_t)sample_capacity) {
+		ring_size *= 2;
+	}
+	if (trace->samples) {
+		heap_free(trace->heap, trace->samples);
+	}
+	trace->samples = heap_alloc(trace->heap, sizeof(trace_sample_t) * ring_size, 8);
+	memset(trace->samples, 0, sizeof(trace_sample_t) * ring_size);
+	trace->sample_mask = ring_size - 1;
+	atomic_store(&trace->sample_count, 0);
+
+	trace->sample_interval_ms = 1000 / __max(rate_hz, 1);
+	atomic_store(&trace->sampling, 1);
+	trace->sampler = thread_create(trace_sampler_func, trace);
+}
+
+void trace_sampler_stop(trace_t* trace) {
+	if (trace->sampler) {
+		atomic_store(&trace->sampling, 0);
+		thread_destroy(trace->sampler);
+		trace->sampler = NULL;
+	}
 }
@@ -1,10 +1,70 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 typedef struct heap_t heap_t;
 
 typedef struct trace_t trace_t;
 
-typedef struct trace_event_t trace_event_t;
+// Set TRACE_ENABLED to 0 in the build to compile every TRACE_ZONE macro out.
+#ifndef TRACE_ENABLED
+#define TRACE_ENABLED 1
+#endif
+
+// Static description of a traced zone.
+// The TRACE_ZONE macros place one of these at each call site. It is registered
+// the first time the zone is hit and events only store its 16-bit id.
+typedef struct trace_zone_t {
+	const char* name;
+	const char* file;
+	int line;
+	uint32_t color; // 0xRRGGBB, 0 picks a default
+	uint16_t id;
+} trace_zone_t;
+
+enum {
+	k_trace_histogram_buckets = 24,
+};
+
+/* A trace event, 32 bytes in the event array :
+
+A trace event contains:
+- time in OS ticks
+- a value, thread cycles spent in the zone for E events when counters are on, the
+  counter value for C events and the address for A/F events, 0 otherwise
+- thread ID
+- ID linking async and flow events that belong to the same piece of work, the size for A/F events, 0 otherwise
+- zone ID, the name and location live in the zone table, the callstack ID for A events
+- event type (B/E durations, b/e async slices, s/t/f flow arrows, C counters, i frame marks,
+  A/F heap allocations and frees), cleared first and written last so a half written event reads as 0
+*/
+typedef struct trace_event_t {
+	uint64_t ticks;
+	uint64_t value;
+	uint32_t tid;
+	uint32_t id;
+	uint16_t zone;
+	volatile char event_type;
+} trace_event_t;
+
+// Merged statistics for one zone across every thread, see trace_stats_get.
+typedef struct trace_zone_stats_t {
+	uint16_t zone;
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t self_us; // total time minus the time spent in nested zones
+	uint64_t min_us;
+	uint64_t max_us;
+	uint64_t cycles; // cycles the thread was scheduled for inside the zone, 0 unless counters are on
+	// histogram[n] counts durations of [2^n, 2^(n+1)) us, the first and last buckets are open ended
+	uint64_t histogram[k_trace_histogram_buckets];
+} trace_zone_stats_t;
+
+// The trace that is currently capturing, NULL when nothing is.
+// Set by trace_capture_start and cleared by trace_capture_stop.
+extern trace_t* volatile g_trace_active;
 
 // Creates a CPU performance tracing system.
 // Event capacity is the maximum number of durations that can be traced.
@@ -13,13 +73,37 @@ trace_t* trace_create(heap_t* heap, int event_capacity);
 // Destroys a CPU performance tracing system.
 void trace_destroy(trace_t* trace);
 
+// Register a zone descriptor and return its id.
+// Safe to call more than once and from multiple threads.
+uint16_t trace_zone_register(trace_zone_t* zone);
+
+// Get a registered zone descriptor by id, NULL if the id is unknown.
+const trace_zone_t* trace_zone_get(uint16_t id);
+
+// Begin a registered zone on the current thread.
+void trace_zone_begin(trace_t* trace, trace_zone_t* zone);
+
+// End the innermost zone on the current thread.
+void trace_zone_end(trace_t* trace);
+
+// Get a new id for linking async and flow events, never 0.
+uint32_t trace_new_id();
+
+// Record a single event for a zone on the current thread.
+// event_type is a Chrome trace phase: 'b'/'e' begin and end an async slice, which may
+// happen on different threads, and 's'/'t'/'f' start, step and finish a flow arrow.
+// Events with the same zone name and id are linked together, events with id 0 are dropped.
+void trace_zone_event(trace_t* trace, trace_zone_t* zone, char event_type, uint32_t id);
+
+// Record the current value of a counter, such as bytes allocated or a queue's depth.
+void trace_counter(trace_t* trace, trace_zone_t* zone, uint64_t value);
+
 // Begin tracing a named duration on the current thread.
 // It is okay to nest multiple durations at once.
-// We push the function name into a trace queue, and append it to an event list
+// The name is interned into a zone on first use, prefer TRACE_ZONE_BEGIN on hot paths.
 void trace_duration_push(trace_t* trace, const char* name);
 
-// End tracing the currently active duration on the current thread and append
-// it to the event list
+// End tracing the currently active duration on the current thread.
 void trace_duration_pop(trace_t* trace);
 
 // Start recording trace events.
@@ -27,4 +111,128 @@ void trace_duration_pop(trace_t* trace);
 void trace_capture_start(trace_t* trace, const char* path);
 
 // Stop recording trace events and write the saved trace events to the path.
+// Also ends a flight recorder or aggregate mode, which do not write anything on stop.
 void trace_capture_stop(trace_t* trace);
+
+// Start recording in flight recorder mode.
+// Events go into a ring sized to the event capacity and the last frame_count frames are kept.
+// A capture named <path>_<reason>_<n>.json is written when a frame passed to trace_frame_mark
+// is over budget_us (0 disables this), when trace_flight_recorder_dump is called,
+// or when the debug exception handler sees a fault. Captures are written by a background thread.
+// After a hitch capture no hitch is captured until its frames have left the window,
+// and the first frame mark is never a hitch since it measures startup.
+void trace_flight_recorder_start(trace_t* trace, const char* path, int frame_count, uint64_t budget_us);
+
+// Mark the start of a frame, frame_us is how long the previous frame took.
+// Does nothing unless the trace is a running flight recorder.
+void trace_frame_mark(trace_t* trace, uint64_t frame_us);
+
+// Copy the events of the last frame_count whole frames of a flight recorder into events,
+// keeping the newest capacity events. The trace lock is not taken, events that recording threads
+// overwrite during the copy are dropped. Call from the thread that calls trace_frame_mark.
+// Returns the number of events copied.
+int trace_snapshot_frames(trace_t* trace, int frame_count, trace_event_t* events, int capacity);
+
+// Copy the retained frames of a flight recorder and have them written to a file.
+// Skipped if the previous capture is still being written.
+void trace_flight_recorder_dump(trace_t* trace, const char* reason);
+
+// Start recording in aggregate mode.
+// No events are kept, each zone only adds to per-thread count, time and histogram
+// statistics which are cheap enough to leave running. Stop with trace_capture_stop.
+void trace_aggregate_start(trace_t* trace);
+
+// Also accumulate zone statistics while capturing events or running a flight recorder.
+void trace_set_stats(trace_t* trace, bool enabled);
+
+// Also measure the CPU cycles each zone's thread was scheduled for.
+// They are written as thread_cycles args on the Chrome trace slices and summed into the stats.
+// Comparing them to wall time shows whether a zone is running or waiting.
+void trace_set_counters(trace_t* trace, bool enabled);
+
+// Whether trace_set_counters is on.
+bool trace_get_counters(trace_t* trace);
+
+// Also record every heap_alloc and heap_free, with the allocation's callstack and innermost zone.
+// Trace files then get a live_bytes counter, and reports are written next to each one:
+// <path>.alloc.folded, bytes allocated per callstack for flamegraph tools, and
+// <path>.live.txt, allocations from the trace that were never freed.
+void trace_set_allocations(trace_t* trace, bool enabled);
+
+// Record a heap allocation, callstack is the 8 frames heap_alloc captured.
+void trace_heap_alloc(trace_t* trace, void* address, size_t size, void** callstack);
+
+// Record a heap free.
+void trace_heap_free(trace_t* trace, void* address, size_t size);
+
+// Cycle counter rate measured since the trace was created, for turning stats cycles into time.
+double trace_get_cycles_per_us(trace_t* trace);
+
+// Clear the statistics of every thread.
+void trace_stats_reset(trace_t* trace);
+
+// Merge the per-thread statistics and copy up to capacity zones into stats,
+// sorted by self time with the most expensive zone first.
+// Returns the number of zones written.
+int trace_stats_get(trace_t* trace, trace_zone_stats_t* stats, int capacity);
+
+// Start sampling the callstacks of every other thread in the process rate_hz times a second.
+// Samples go into a ring of sample_capacity entries. Files written by the trace include
+// the samples taken since their first event, symbolized on write. Stopped by trace_capture_stop.
+void trace_sampler_start(trace_t* trace, uint32_t rate_hz, int sample_capacity);
+
+// Stop the sampler thread, the samples it took are kept.
+void trace_sampler_stop(trace_t* trace);
+
+// Zone macros for engine code, they record into g_trace_active.
+// Every TRACE_ZONE_BEGIN must be paired with a TRACE_ZONE_END in the same function.
+// Idle cost while not capturing is a single branch on g_trace_active.
+#if TRACE_ENABLED
+#define TRACE_ZONE_BEGIN_COLOR(zone_name, zone_color) do { \
+		static trace_zone_t s_trace_zone = { zone_name, __FILE__, __LINE__, zone_color, 0 }; \
+		trace_t* trace_zone_active = g_trace_active; \
+		if (trace_zone_active) trace_zone_begin(trace_zone_active, &s_trace_zone); \
+	} while (0)
+#define TRACE_ZONE_END() do { \
+		trace_t* trace_zone_active = g_trace_active; \
+		if (trace_zone_active) trace_zone_end(trace_zone_active); \
+	} while (0)
+#define TRACE_ZONE_EVENT(zone_name, event_type, event_id) do { \
+		static trace_zone_t s_trace_zone = { zone_name, __FILE__, __LINE__, 0, 0 }; \
+		trace_t* trace_zone_active = g_trace_active; \
+		if (trace_zone_active) trace_zone_event(trace_zone_active, &s_trace_zone, event_type, event_id); \
+	} while (0)
+#define TRACE_COUNTER(counter_name, counter_value) do { \
+		static trace_zone_t s_trace_zone = { counter_name, __FILE__, __LINE__, 0, 0 }; \
+		trace_t* trace_zone_active = g_trace_active; \
+		if (trace_zone_active) trace_counter(trace_zone_active, &s_trace_zone, (uint64_t)(counter_value)); \
+	} while (0)
+#define TRACE_HEAP_ALLOC(heap_address, heap_size, heap_callstack) do { \
+		trace_t* trace_zone_active = g_trace_active; \
+		if (trace_zone_active) trace_heap_alloc(trace_zone_active, heap_address, heap_size, heap_callstack); \
+	} while (0)
+#define TRACE_HEAP_FREE(heap_address, heap_size) do { \
+		trace_t* trace_zone_active = g_trace_active; \
+		if (trace_zone_active) trace_heap_free(trace_zone_active, heap_address, heap_size); \
+	} while (0)
+#define TRACE_NEW_ID() (g_trace_active ? trace_new_id() : 0)
+#else
+#define TRACE_NEW_ID() 0
+#define TRACE_ZONE_BEGIN_COLOR(zone_name, zone_color) ((void)0)
+#define TRACE_ZONE_END() ((void)0)
+#define TRACE_ZONE_EVENT(zone_name, event_type, event_id) ((void)0)
+#define TRACE_COUNTER(counter_name, counter_value) ((void)0)
+#define TRACE_HEAP_ALLOC(heap_address, heap_size, heap_callstack) ((void)0)
+#define TRACE_HEAP_FREE(heap_address, heap_size) ((void)0)
+#endif
+
+#define TRACE_ZONE_BEGIN(zone_name) TRACE_ZONE_BEGIN_COLOR(zone_name, 0)
+
+// Async slices, for time spent between threads such as waiting in a queue.
+#define TRACE_ASYNC_BEGIN(zone_name, event_id) TRACE_ZONE_EVENT(zone_name, 'b', event_id)
+#define TRACE_ASYNC_END(zone_name, event_id) TRACE_ZONE_EVENT(zone_name, 'e', event_id)
+
+// Flow arrows, drawn between the zones that are open when each event is recorded.
+#define TRACE_FLOW_BEGIN(zone_name, event_id) TRACE_ZONE_EVENT(zone_name, 's', event_id)
+#define TRACE_FLOW_STEP(zone_name, event_id) TRACE_ZONE_EVENT(zone_name, 't', event_id)
+#define TRACE_FLOW_END(zone_name, event_id) TRACE_ZONE_EVENT(zone_name, 'f', event_id)